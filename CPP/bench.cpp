@@ -0,0 +1,655 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ncurses.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "brush.h"
+#include "compact.h"
+#include "corpus.h"
+#include "desc.h"
+#include "dungeon.h"
+#include "grid.h"
+#include "hash.h"
+#include "io.h"
+#include "live.h"
+#include "loader.h"
+#include "metrics.h"
+#include "path.h"
+#include "publish.h"
+#include "snapshot.h"
+#include "utils.h"
+
+/*
+ * Benchmarks for generation, saving and loading, map queries and
+ * drawing.  The random seed and iteration counts are fixed, and each
+ * benchmark is repeated BENCH_REPS times, so runs are comparable.
+ *
+ * Output is one line per benchmark, meant to be diffed or parsed:
+ *   name iterations median_ns_per_op min_ns_per_op
+ */
+
+const uint32_t BENCH_REPS = 7;
+const uint32_t BENCH_CORPUS = 1000;
+const uint32_t BENCH_SEED = 327;
+/* Entries in the monster description file the parser benchmark reads */
+const uint32_t BENCH_DESC = 10000;
+/* Radius of the grid distance maps and side of the blurred window */
+const uint8_t GRID_BENCH_RADIUS = 128;
+const uint32_t GRID_BENCH_WINDOW = 256;
+
+struct benchmark {
+  const char *name;
+  uint32_t iters;
+  void (*run)(uint32_t iters);
+};
+
+static dungeon bench_dungeon;
+static std::string corpus_dir;
+/* Kept out of corpus_dir, which holds only saves */
+static std::string desc_file;
+static std::vector<uint8_t> encoded;
+static bool have_screen;
+
+/*
+ * Keeps results the compiler could otherwise throw away
+ */
+static volatile uint32_t sink;
+
+static void bench_init_dungeon(uint32_t iters)
+{
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    init_dungeon(&bench_dungeon);
+  }
+} // bench_init_dungeon
+
+static void bench_gen_dungeon(uint32_t iters)
+{
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    gen_dungeon(&bench_dungeon);
+  }
+} // bench_gen_dungeon
+
+static void bench_encode(uint32_t iters)
+{
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    encode_dungeon(&bench_dungeon, encoded);
+  }
+} // bench_encode
+
+static void bench_decode(uint32_t iters)
+{
+  dungeon d;
+  const char *err;
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    sink += decode_dungeon(&d, &encoded[0], encoded.size(), &err);
+  }
+  del_dungeon(&d);
+} // bench_decode
+
+/*
+ * Save and load through the files the game uses.  Saves aren't
+ * synced; that measures the disk, not the code.
+ */
+static void bench_round_trip(uint32_t iters)
+{
+  dungeon d;
+  std::string path;
+  uint32_t i;
+
+  path = corpus_dir + "/round_trip";
+  for (i = 0; i < iters; i++) {
+    write_dungeon(&bench_dungeon, path.c_str(), false);
+    read_dungeon(&d, path.c_str());
+    del_dungeon(&d);
+  }
+  unlink(path.c_str());
+} // bench_round_trip
+
+static void bench_room_present(uint32_t iters)
+{
+  uint32_t i;
+  uint8_t x, y;
+
+  for (i = 0; i < iters; i++) {
+    x = 1 + i % (DUNGEON_X - 1 - MIN_ROOM_XSIZE);
+    y = 1 + (i / DUNGEON_X) % (DUNGEON_Y - 1 - MIN_ROOM_YSIZE);
+    sink += room_present(&bench_dungeon, x, y, MIN_ROOM_XSIZE, MIN_ROOM_YSIZE);
+  }
+} // bench_room_present
+
+static void bench_dist_map(uint32_t iters)
+{
+  uint16_t dist[DUNGEON_Y][DUNGEON_X];
+  uint16_t src;
+  uint32_t i;
+
+  src = cellidx(bench_dungeon.get_pcx(), bench_dungeon.get_pcy());
+  for (i = 0; i < iters; i++) {
+    sink += dist_map(&bench_dungeon, &src, 1, dist);
+  }
+} // bench_dist_map
+
+static void bench_smooth(uint32_t iters)
+{
+  dungeon d;
+  uint32_t i;
+
+  d = bench_dungeon;
+  d.rooms.clear();
+  for (i = 0; i < iters; i++) {
+    sink += smooth_hardness(&d, 1);
+  }
+} // bench_smooth
+
+static void bench_hash(uint32_t iters)
+{
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    sink += hash_dungeon(&bench_dungeon).lo;
+  }
+} // bench_hash
+
+static void bench_metrics(uint32_t iters)
+{
+  dungeon_metrics m;
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    measure_dungeon(&bench_dungeon, &m, nullptr);
+    sink += m.components;
+  }
+} // bench_metrics
+
+static void bench_pack(uint32_t iters)
+{
+  compact_dungeon c;
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    pack_dungeon(&bench_dungeon, &c);
+    sink += c.walk[PLANE_WORDS / 2];
+  }
+} // bench_pack
+
+static void bench_compact_metrics(uint32_t iters)
+{
+  compact_dungeon c;
+  dungeon_metrics m;
+  uint32_t i;
+
+  pack_dungeon(&bench_dungeon, &c);
+  for (i = 0; i < iters; i++) {
+    compact_metrics(&c, &m);
+    sink += m.components;
+  }
+} // bench_compact_metrics
+
+static void bench_compact_hash(uint32_t iters)
+{
+  compact_dungeon c;
+  uint32_t i;
+
+  pack_dungeon(&bench_dungeon, &c);
+  for (i = 0; i < iters; i++) {
+    sink += compact_hash(&c).lo;
+  }
+} // bench_compact_hash
+
+/*
+ * Changes a cell and snapshots the dungeon, sharing the other rows
+ */
+static void bench_snapshot(uint32_t iters)
+{
+  dungeon d;
+  uint32_t i;
+
+  d = bench_dungeon;
+  d.rooms.clear();
+  for (i = 0; i < iters; i++) {
+    set_cell(&d, 1 + i % (DUNGEON_X - 2), 1 + i % (DUNGEON_Y - 2),
+             ter_wall, 1 + i % (MAX_HARDNESS_VALUE - 1));
+    sink += snapshot_dungeon(&d)->version;
+  }
+} // bench_snapshot
+
+/*
+ * Changes a cell, publishes the dungeon on a live link and reads it
+ * back as a game would
+ */
+static void bench_live(uint32_t iters)
+{
+  std::string name;
+  live_link l;
+  live_dungeon ld;
+  dungeon d;
+  uint32_t i;
+
+  name = "dgen_bench_" + std::to_string(getpid());
+  if (publish_open(name.c_str()) || live_open(name.c_str(), &l)) {
+    return;
+  }
+  d = bench_dungeon;
+  d.rooms.clear();
+  for (i = 0; i < iters; i++) {
+    set_cell(&d, 1 + i % (DUNGEON_X - 2), 1 + i % (DUNGEON_Y - 2),
+             ter_wall, 1 + i % (MAX_HARDNESS_VALUE - 1));
+    publish_update(&d);
+    sink += live_poll(&l, &ld);
+  }
+  live_close(&l);
+  publish_close();
+  shm_unlink(live_name(name.c_str()).c_str());
+} // bench_live
+
+/*
+ * Parses the generated monster description file; one op is the file
+ */
+static void bench_desc(uint32_t iters)
+{
+  uint32_t i, skipped;
+
+  for (i = 0; i < iters; i++) {
+    desc_set set;
+
+    load_monster_desc(desc_file.c_str(), &set, &skipped);
+    sink += set.monsters.size() + skipped;
+  }
+} // bench_desc
+
+/*
+ * Loads every dungeon in the corpus; one op is the whole corpus
+ */
+static void bench_corpus_load(uint32_t iters)
+{
+  dungeon d;
+  char name[32];
+  uint32_t i, j;
+
+  for (i = 0; i < iters; i++) {
+    for (j = 0; j < BENCH_CORPUS; j++) {
+      std::snprintf(name, sizeof (name), "/%s_%06u", DUNGEON_SAVE_FILE, j);
+      read_dungeon(&d, (corpus_dir + name).c_str());
+      sink += d.rooms.size();
+      del_dungeon(&d);
+    }
+  }
+} // bench_corpus_load
+
+/*
+ * Loads and decodes the corpus with the bulk loader
+ */
+static void bench_bulk_load(uint32_t iters, load_method method)
+{
+  corpus c;
+  std::atomic<uint32_t> rooms(0);
+  uint32_t i;
+
+  if (c.open(corpus_dir.c_str())) {
+    return;
+  }
+  for (i = 0; i < iters; i++) {
+    load_dungeons(c, default_jobs(), [&](uint32_t, uint32_t, dungeon *d) {
+      rooms += d->rooms.size();
+    }, method);
+  }
+  sink += rooms;
+} // bench_bulk_load
+
+static void bench_bulk_uring(uint32_t iters)
+{
+  bench_bulk_load(iters, load_uring);
+} // bench_bulk_uring
+
+static void bench_bulk_threads(uint32_t iters)
+{
+  bench_bulk_load(iters, load_threads);
+} // bench_bulk_threads
+
+/*
+ * Large maps in each cell layout.  Every layout gets the same map, a
+ * quarter wall of random hardness, and the benchmarks do the same
+ * bounded work in the middle of it whatever its size, so the times
+ * differ only by how well the layout suits the caches and TLB.  Only
+ * one size is kept at a time; a 16k map is 256MB a grid.
+ */
+template <class L>
+struct grid_bench {
+  cell_grid<uint8_t, L> hard, dist;
+  std::vector<uint32_t> queue;
+  std::vector<uint8_t> out;
+};
+
+template <class L>
+static grid_bench<L> &bench_grid(void)
+{
+  static grid_bench<L> g;
+
+  return g;
+} // bench_grid
+
+template <class L>
+static void free_grid(void)
+{
+  bench_grid<L>().hard.clear();
+  bench_grid<L>().dist.clear();
+} // free_grid
+
+static void free_grids(void)
+{
+  free_grid<row_major_layout>();
+  free_grid<morton_layout>();
+  free_grid<tiled_layout>();
+} // free_grids
+
+/*
+ * Builds the N by N map for layout L, untimed.  Returns 1 if it can't.
+ */
+template <class L, uint32_t N>
+static int prepare_grid(void)
+{
+  grid_bench<L> &g = bench_grid<L>();
+  uint32_t x, y, h;
+
+  if (g.hard.get_width() == N) {
+    return 0;
+  }
+  free_grids();
+  if (g.hard.resize(N, N, 0) || g.dist.resize(N, N, GRID_UNREACHED)) {
+    return 1;
+  }
+  for (y = 0; y < N; y++) {
+    for (x = 0; x < N; x++) {
+      h = (x * 0x9e3779b1) ^ (y * 0x85ebca6b);
+      h ^= h >> 15;
+      h *= 0x2c1b3c6d;
+      h ^= h >> 13;
+      if (!(h & 3)) {
+        g.hard.at(x, y) = 1 + (h >> 8) % (MAX_HARDNESS_VALUE - 1);
+      }
+    }
+  }
+  return 0;
+} // prepare_grid
+
+template <class L, uint32_t N>
+static void bench_grid_dist(uint32_t iters)
+{
+  grid_bench<L> &g = bench_grid<L>();
+  uint32_t i, j;
+
+  for (i = 0; i < iters; i++) {
+    g.hard.at(N / 2, N / 2) = 0;
+    sink += grid_dist(g.hard, g.dist, N / 2, N / 2, GRID_BENCH_RADIUS,
+                      g.queue);
+    for (j = 0; j < g.queue.size(); j++) {
+      g.dist.at(g.queue[j] & 0xffff, g.queue[j] >> 16) = GRID_UNREACHED;
+    }
+  }
+} // bench_grid_dist
+
+template <class L, uint32_t N>
+static void bench_grid_blur(uint32_t iters)
+{
+  grid_bench<L> &g = bench_grid<L>();
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    grid_blur(g.hard, (N - GRID_BENCH_WINDOW) / 2, (N - GRID_BENCH_WINDOW) / 2,
+              GRID_BENCH_WINDOW, GRID_BENCH_WINDOW, g.out);
+    sink += g.out[GRID_BENCH_WINDOW / 2];
+  }
+} // bench_grid_blur
+
+/*
+ * Draws the whole map and pushes it through ncurses to /dev/null
+ */
+static void bench_display_full(uint32_t iters)
+{
+  uint32_t i;
+
+  for (i = 0; i < iters; i++) {
+    bench_dungeon.mark_all_dirty();
+    io_display(&bench_dungeon);
+    refresh();
+  }
+} // bench_display_full
+
+/*
+ * Changes one cell per frame, the common case while editing
+ */
+static void bench_display_cell(uint32_t iters)
+{
+  uint32_t i;
+  uint8_t x, y;
+
+  for (i = 0; i < iters; i++) {
+    x = 1 + i % (DUNGEON_X - 2);
+    y = 1 + (i / (DUNGEON_X - 2)) % (DUNGEON_Y - 2);
+    bench_dungeon.mark_dirty(x, y);
+    io_display(&bench_dungeon);
+    refresh();
+  }
+} // bench_display_cell
+
+static const benchmark benchmarks[] = {
+  { "init_dungeon",   20000, bench_init_dungeon },
+  { "gen_dungeon",     5000, bench_gen_dungeon },
+  { "encode_dungeon", 50000, bench_encode },
+  { "decode_dungeon", 50000, bench_decode },
+  { "save_load",       1000, bench_round_trip },
+  { "room_present", 1000000, bench_room_present },
+  { "dist_map",        5000, bench_dist_map },
+  { "smooth_hardness", 5000, bench_smooth },
+  { "hash_dungeon",   50000, bench_hash },
+  { "measure_dungeon", 20000, bench_metrics },
+  { "pack_dungeon",   50000, bench_pack },
+  { "compact_metrics", 20000, bench_compact_metrics },
+  { "compact_hash",  100000, bench_compact_hash },
+  { "snapshot_edit", 100000, bench_snapshot },
+  { "live_publish",  100000, bench_live },
+  { "corpus_load",        3, bench_corpus_load },
+  { "bulk_load_uring",    3, bench_bulk_uring },
+  { "bulk_load_threads",  3, bench_bulk_threads },
+  { "desc_monsters",     10, bench_desc },
+  { "display_full",    2000, bench_display_full },
+  { "display_cell",   20000, bench_display_cell }
+};
+
+/* A benchmark that needs its map built first */
+struct grid_benchmark {
+  benchmark b;
+  int (*prepare)(void);
+};
+
+/* Both benchmarks for one layout and size */
+#define GRID_BENCHMARKS(layout, name, n, size)                         \
+  { { "grid_dist_" name "_" size, 20, bench_grid_dist<layout, n> },   \
+    prepare_grid<layout, n> },                                         \
+  { { "grid_blur_" name "_" size, 20, bench_grid_blur<layout, n> },   \
+    prepare_grid<layout, n> }
+
+/*
+ * The cell layouts of grid.h on 1k, 4k and 16k square maps.  The
+ * biggest take 512MB, so these only run when asked for by name.
+ */
+static const grid_benchmark grid_benchmarks[] = {
+  GRID_BENCHMARKS(row_major_layout, "row", 1024, "1k"),
+  GRID_BENCHMARKS(morton_layout, "z", 1024, "1k"),
+  GRID_BENCHMARKS(tiled_layout, "tile", 1024, "1k"),
+  GRID_BENCHMARKS(row_major_layout, "row", 4096, "4k"),
+  GRID_BENCHMARKS(morton_layout, "z", 4096, "4k"),
+  GRID_BENCHMARKS(tiled_layout, "tile", 4096, "4k"),
+  GRID_BENCHMARKS(row_major_layout, "row", 16384, "16k"),
+  GRID_BENCHMARKS(morton_layout, "z", 16384, "16k"),
+  GRID_BENCHMARKS(tiled_layout, "tile", 16384, "16k")
+};
+
+/*
+ * Runs a benchmark BENCH_REPS times and prints the median and fastest
+ * time per operation
+ */
+static void run_benchmark(const benchmark *b)
+{
+  double ns[BENCH_REPS];
+  uint64_t start;
+  uint32_t r;
+
+  /* The same seed for every benchmark, so each sees the same dungeons */
+  std::srand(BENCH_SEED);
+  gen_dungeon(&bench_dungeon);
+  encode_dungeon(&bench_dungeon, encoded);
+
+  for (r = 0; r < BENCH_REPS; r++) {
+    start = now_nsec();
+    b->run(b->iters);
+    ns[r] = (double) (now_nsec() - start) / b->iters;
+  }
+  std::sort(ns, ns + BENCH_REPS);
+  std::printf("%-18s %8u %14.1f %14.1f\n", b->name, b->iters,
+              ns[BENCH_REPS / 2], ns[0]);
+  std::fflush(stdout);
+} // run_benchmark
+
+/*
+ * Writes BENCH_DESC monsters, a tenth of them sharing names, as a
+ * temporary description file
+ */
+static int make_desc(void)
+{
+  char file[] = "/tmp/dgen_bench_desc_XXXXXX";
+  FILE *f;
+  uint32_t i;
+  int fd;
+
+  if ((fd = mkstemp(file)) < 0) {
+    std::perror("mkstemp");
+    return 1;
+  }
+  desc_file = file;
+  if (!(f = fdopen(fd, "w"))) {
+    std::perror(file);
+    close(fd);
+    return 1;
+  }
+  std::fprintf(f, "%s\n", MONSTER_DESC_SEMANTIC);
+  for (i = 0; i < BENCH_DESC; i++) {
+    std::fprintf(f, "\nBEGIN MONSTER\nNAME Monster %u\nSYMB %c\n"
+                 "COLOR RED BLUE\nDESC\nA monster made up for the benchmark,"
+                 "\nnumber %u.\n.\nSPEED %u+1d4\nDAM 0+%ud6\nHP 12+2d6\n"
+                 "ABIL SMART TUNNEL\nRRTY %u\nEND\n", i % (BENCH_DESC / 10),
+                 'A' + i % 26, i, 5 + i % 10, 1 + i % 4, 1 + i % 100);
+  }
+  return fclose(f) ? 1 : 0;
+} // make_desc
+
+/*
+ * Writes the corpus the load benchmarks read, and a description file
+ */
+static int make_corpus(void)
+{
+  dungeon d;
+  char dir[] = "/tmp/dgen_bench_XXXXXX";
+  char name[32];
+  uint32_t i;
+
+  if (!mkdtemp(dir)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  corpus_dir = dir;
+  std::srand(BENCH_SEED);
+  for (i = 0; i < BENCH_CORPUS; i++) {
+    gen_dungeon(&d);
+    std::snprintf(name, sizeof (name), "/%s_%06u", DUNGEON_SAVE_FILE, i);
+    if (write_dungeon(&d, (corpus_dir + name).c_str(), false)) {
+      return 1;
+    }
+  }
+  del_dungeon(&d);
+  return make_desc();
+} // make_corpus
+
+static void remove_corpus(void)
+{
+  char name[32];
+  uint32_t i;
+
+  for (i = 0; i < BENCH_CORPUS; i++) {
+    std::snprintf(name, sizeof (name), "/%s_%06u", DUNGEON_SAVE_FILE, i);
+    unlink((corpus_dir + name).c_str());
+  }
+  rmdir(corpus_dir.c_str());
+  if (!desc_file.empty()) {
+    unlink(desc_file.c_str());
+  }
+} // remove_corpus
+
+int main(int argc, char *argv[])
+{
+  SCREEN *screen;
+  FILE *out, *in;
+  uint32_t i;
+
+  if (make_corpus()) {
+    return EXIT_FAILURE;
+  }
+
+  /* A real terminal description, but drawn to /dev/null */
+  out = fopen("/dev/null", "w");
+  in = fopen("/dev/null", "r");
+  screen = out && in ? newterm("xterm", out, in) : nullptr;
+  if ((have_screen = screen)) {
+    set_term(screen);
+    io_init_screen();
+  }
+
+  std::printf("# %-16s %8s %14s %14s\n", "benchmark", "iters",
+              "median_ns/op", "min_ns/op");
+  for (i = 0; i < sizeof (benchmarks) / sizeof (benchmarks[0]); i++) {
+    if (argc > 1 && !strstr(benchmarks[i].name, argv[1])) {
+      continue;
+    }
+    if (!have_screen && !strncmp(benchmarks[i].name, "display", 7)) {
+      std::printf("# %s skipped, no xterm terminfo\n", benchmarks[i].name);
+      continue;
+    }
+    run_benchmark(&benchmarks[i]);
+  }
+  for (i = 0; argc > 1 &&
+         i < sizeof (grid_benchmarks) / sizeof (grid_benchmarks[0]); i++) {
+    if (!strstr(grid_benchmarks[i].b.name, argv[1])) {
+      continue;
+    }
+    if (grid_benchmarks[i].prepare()) {
+      std::printf("# %s skipped, its map could not be built\n",
+                  grid_benchmarks[i].b.name);
+      continue;
+    }
+    run_benchmark(&grid_benchmarks[i].b);
+  }
+  free_grids();
+
+  if (have_screen) {
+    endwin();
+    delscreen(screen);
+  }
+  remove_corpus();
+  del_dungeon(&bench_dungeon);
+
+  return 0;
+}
@@ -0,0 +1,200 @@
+#include <cstring>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include "brush.h"
+#include "dungeon.h"
+
+/*
+ * Only wall hardness is sculpted.  Floor (0) and the border
+ * (MAX_HARDNESS_VALUE) never change and don't blur into the walls.
+ */
+static inline bool sculptable(uint8_t h)
+{
+  return h && h < MAX_HARDNESS_VALUE;
+} // sculptable
+
+static inline uint8_t clamp_hardness(int32_t h)
+{
+  if (h < 1) {
+    return 1;
+  }
+  if (h > (int32_t) MAX_HARDNESS_VALUE - 1) {
+    return MAX_HARDNESS_VALUE - 1;
+  }
+  return h;
+} // clamp_hardness
+
+/*
+ * Sums each cell with its left and right neighbors.  Only interior
+ * columns are written.  The kernels work on any grid size so they
+ * don't depend on the dungeon dimensions.
+ */
+static void sum_rows(const uint16_t *src, uint16_t *dst,
+                     uint32_t width, uint32_t height)
+{
+  const uint16_t *s;
+  uint16_t *o;
+  uint32_t x, y;
+
+  for (y = 0; y < height; y++) {
+    s = src + y * width;
+    o = dst + y * width;
+    x = 1;
+#ifdef __SSE2__
+    for (; x + 9 <= width; x += 8) {
+      _mm_storeu_si128((__m128i *) (o + x),
+        _mm_add_epi16(_mm_add_epi16(
+          _mm_loadu_si128((const __m128i *) (s + x - 1)),
+          _mm_loadu_si128((const __m128i *) (s + x))),
+          _mm_loadu_si128((const __m128i *) (s + x + 1))));
+    }
+#endif
+    for (; x + 1 < width; x++) {
+      o[x] = s[x - 1] + s[x] + s[x + 1];
+    }
+  }
+} // sum_rows
+
+/*
+ * Sums each cell with the cells above and below it.  Only interior
+ * rows are written.
+ */
+static void sum_cols(const uint16_t *src, uint16_t *dst,
+                     uint32_t width, uint32_t height)
+{
+  const uint16_t *a, *b, *c;
+  uint16_t *o;
+  uint32_t x, y;
+
+  for (y = 1; y + 1 < height; y++) {
+    a = src + (y - 1) * width;
+    b = src + y * width;
+    c = src + (y + 1) * width;
+    o = dst + y * width;
+    x = 0;
+#ifdef __SSE2__
+    for (; x + 8 <= width; x += 8) {
+      _mm_storeu_si128((__m128i *) (o + x),
+        _mm_add_epi16(_mm_add_epi16(
+          _mm_loadu_si128((const __m128i *) (a + x)),
+          _mm_loadu_si128((const __m128i *) (b + x))),
+          _mm_loadu_si128((const __m128i *) (c + x))));
+    }
+#endif
+    for (; x < width; x++) {
+      o[x] = a[x] + b[x] + c[x];
+    }
+  }
+} // sum_cols
+
+/*
+ * 3x3 box blur of the wall hardness, as separable row and column
+ * sums.  The hardness and a mask of the sculptable cells are summed
+ * alike, so each wall averages only the walls around it.  Cells that
+ * aren't sculptable keep their hardness in out.
+ */
+static void blur_hardness(dungeon *d, uint8_t out[DUNGEON_Y][DUNGEON_X])
+{
+  uint16_t val[DUNGEON_Y][DUNGEON_X], wt[DUNGEON_Y][DUNGEON_X];
+  uint16_t tmp[DUNGEON_Y][DUNGEON_X];
+  uint32_t x, y;
+
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x++) {
+      wt[y][x] = sculptable(hmapxy(x, y));
+      val[y][x] = wt[y][x] ? hmapxy(x, y) : 0;
+    }
+  }
+  memset(tmp, 0, sizeof (tmp));
+  sum_rows(&val[0][0], &tmp[0][0], DUNGEON_X, DUNGEON_Y);
+  sum_cols(&tmp[0][0], &val[0][0], DUNGEON_X, DUNGEON_Y);
+  sum_rows(&wt[0][0], &tmp[0][0], DUNGEON_X, DUNGEON_Y);
+  sum_cols(&tmp[0][0], &wt[0][0], DUNGEON_X, DUNGEON_Y);
+
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x++) {
+      if (y && y < DUNGEON_Y - 1 && x && x < DUNGEON_X - 1 &&
+          sculptable(hmapxy(x, y))) {
+        out[y][x] = (val[y][x] + (wt[y][x] >> 1)) / wt[y][x];
+      } else {
+        out[y][x] = hmapxy(x, y);
+      }
+    }
+  }
+} // blur_hardness
+
+/*
+ * Raise, lower or set the wall hardness within radius of x, y, or
+ * smooth it with amount blur passes.  Results are clamped to
+ * [1, MAX_HARDNESS_VALUE - 1].  Returns the number of cells changed.
+ */
+uint32_t apply_brush(dungeon *d, uint8_t x, uint8_t y, uint8_t radius,
+                     brush_mode mode, uint8_t amount)
+{
+  uint8_t blurred[DUNGEON_Y][DUNGEON_X];
+  int32_t i, j, r2, h;
+  uint32_t pass, passes, changed;
+
+  r2 = radius * radius;
+  passes = mode == brush_smooth ? (amount ? amount : 1) : 1;
+  changed = 0;
+  for (pass = 0; pass < passes; pass++) {
+    if (mode == brush_smooth) {
+      blur_hardness(d, blurred);
+    }
+    for (j = y - radius; j <= y + radius; j++) {
+      for (i = x - radius; i <= x + radius; i++) {
+        if (j < 1 || j >= (int32_t) DUNGEON_Y - 1 ||
+            i < 1 || i >= (int32_t) DUNGEON_X - 1 ||
+            (i - x) * (i - x) + (j - y) * (j - y) > r2 ||
+            !sculptable(hmapxy(i, j))) {
+          continue;
+        }
+        switch (mode) {
+        case brush_raise:
+          h = hmapxy(i, j) + amount;
+          break;
+        case brush_lower:
+          h = hmapxy(i, j) - amount;
+          break;
+        case brush_set:
+          h = amount;
+          break;
+        default:
+          h = blurred[j][i];
+        }
+        if (clamp_hardness(h) != hmapxy(i, j)) {
+          set_cell(d, i, j, dmapxy(i, j), clamp_hardness(h));
+          changed++;
+        }
+      }
+    }
+  }
+  return changed;
+} // apply_brush
+
+/*
+ * Smooth the wall hardness of the whole map.  Returns the number of
+ * cell changes.
+ */
+uint32_t smooth_hardness(dungeon *d, uint32_t passes)
+{
+  uint8_t blurred[DUNGEON_Y][DUNGEON_X];
+  uint32_t x, y, pass, changed;
+
+  changed = 0;
+  for (pass = 0; pass < passes; pass++) {
+    blur_hardness(d, blurred);
+    for (y = 1; y < DUNGEON_Y - 1; y++) {
+      for (x = 1; x < DUNGEON_X - 1; x++) {
+        if (blurred[y][x] != hmapxy(x, y)) {
+          set_cell(d, x, y, dmapxy(x, y), blurred[y][x]);
+          changed++;
+        }
+      }
+    }
+  }
+  return changed;
+} // smooth_hardness
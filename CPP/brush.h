@@ -0,0 +1,25 @@
+#ifndef BRUSH_H
+#define BRUSH_H
+
+#include <stdint.h>
+
+class dungeon;
+
+/* How far one raise or lower stroke moves the hardness */
+const uint8_t BRUSH_STEP = 16;
+const uint8_t MAX_BRUSH_RADIUS = 9;
+/* Smoothing has long settled by then */
+const uint32_t MAX_SMOOTH_PASSES = 100;
+
+enum brush_mode {
+  brush_raise,
+  brush_lower,
+  brush_set,
+  brush_smooth
+};
+
+uint32_t apply_brush(dungeon *d, uint8_t x, uint8_t y, uint8_t radius,
+                     brush_mode mode, uint8_t amount);
+uint32_t smooth_hardness(dungeon *d, uint32_t passes);
+
+#endif
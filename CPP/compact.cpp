@@ -0,0 +1,356 @@
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "compact.h"
+#include "dungeon.h"
+#include "hash.h"
+#include "metrics.h"
+
+/*
+ * Kernels work on the planes a row at a time, each row an 80 bit
+ * integer, so a move left or right is a shift and a move up or down is
+ * the next row.  Floods fill whole runs of a row at once (a
+ * Kogge-Stone fill: seven shift steps cover any run), sweeping down
+ * and then up, so most regions fill in a sweep or two however long
+ * their corridors.  The border is never walkable, so nothing spreads
+ * off the edge.
+ */
+
+typedef unsigned __int128 row_bits;
+
+static const uint32_t PLANE_CELLS = DUNGEON_X * DUNGEON_Y;
+static const row_bits ROW_MASK = ((row_bits) 1 << DUNGEON_X) - 1;
+
+static inline bool get_bit(const uint64_t *p, uint32_t i)
+{
+  return p[i >> 6] >> (i & 63) & 1;
+}
+
+static inline void set_bit(uint64_t *p, uint32_t i)
+{
+  p[i >> 6] |= 1ULL << (i & 63);
+}
+
+static inline uint32_t row_count(row_bits r)
+{
+  return __builtin_popcountll((uint64_t) r) +
+         __builtin_popcountll((uint64_t) (r >> 64));
+}
+
+static inline row_bits dilate(row_bits r)
+{
+  return r | r << 1 | r >> 1;
+}
+
+/*
+ * Unpacks a plane into rows
+ */
+static void plane_rows(const uint64_t *p, row_bits rows[DUNGEON_Y])
+{
+  uint32_t y, bit, w, b;
+  row_bits r;
+
+  for (y = 0; y < DUNGEON_Y; y++) {
+    bit = y * DUNGEON_X;
+    w = bit / 64;
+    b = bit % 64;
+    r = (row_bits) p[w] >> b;
+    if (w + 1 < PLANE_WORDS) {
+      r |= (row_bits) p[w + 1] << (64 - b);
+    }
+    if (w + 2 < PLANE_WORDS && b > 128 - DUNGEON_X) {
+      r |= (row_bits) p[w + 2] << (128 - b);
+    }
+    rows[y] = r & ROW_MASK;
+  }
+} // plane_rows
+
+/*
+ * Spreads s along the runs of m it touches, both ways
+ */
+static inline row_bits fill_runs(row_bits s, row_bits m)
+{
+  row_bits l, r, ml, mr;
+  uint32_t k;
+
+  for (k = 1, l = r = s, ml = mr = m; k < 128; k <<= 1) {
+    r |= (r << k) & mr;
+    mr &= mr << k;
+    l |= (l >> k) & ml;
+    ml &= ml >> k;
+  }
+  return l | r;
+} // fill_runs
+
+/*
+ * Grows s to the whole of every region of m that it touches.  Each row
+ * of s must already be whole runs of m.
+ */
+static void flood_rows(const row_bits *m, row_bits *s)
+{
+  row_bits n;
+  int32_t y;
+  bool grew;
+
+  do {
+    grew = false;
+    for (y = 1; y < (int32_t) DUNGEON_Y - 1; y++) {
+      n = (s[y] | dilate(s[y - 1])) & m[y];
+      if (n != s[y]) {
+        s[y] = fill_runs(n, m[y]);
+        grew = true;
+      }
+    }
+    for (y = DUNGEON_Y - 2; y > 0; y--) {
+      n = (s[y] | dilate(s[y + 1])) & m[y];
+      if (n != s[y]) {
+        s[y] = fill_runs(n, m[y]);
+        grew = true;
+      }
+    }
+  } while (grew);
+} // flood_rows
+
+/*
+ * Grows s by exactly one move in every direction within m.  Returns
+ * false once it stops growing.
+ */
+static bool step_rows(const row_bits *m, row_bits *s)
+{
+  row_bits h[DUNGEON_Y], n;
+  uint32_t y;
+  bool grew;
+
+  for (y = 0; y < DUNGEON_Y; y++) {
+    h[y] = dilate(s[y]);
+  }
+  for (y = 1, grew = false; y < DUNGEON_Y - 1; y++) {
+    n = (h[y - 1] | h[y] | h[y + 1]) & m[y];
+    grew |= n != s[y];
+    s[y] = n;
+  }
+  return grew;
+} // step_rows
+
+/*
+ * Splits the rows of m into their 8-connected regions, appending each
+ * to parts if it isn't null.  Returns how many there are.
+ */
+static uint32_t split_rows(const row_bits *m, std::vector<row_bits> *parts)
+{
+  row_bits rest[DUNGEON_Y], s[DUNGEON_Y];
+  uint32_t y, n;
+
+  memcpy(rest, m, sizeof (rest));
+  for (n = 0, y = 1; y < DUNGEON_Y - 1; ) {
+    if (!rest[y]) {
+      y++;
+      continue;
+    }
+    memset(s, 0, sizeof (s));
+    s[y] = fill_runs(rest[y] & -rest[y], m[y]);
+    flood_rows(m, s);
+    for (uint32_t i = y; i < DUNGEON_Y - 1; i++) {
+      rest[i] &= ~s[i];
+    }
+    if (parts) {
+      parts->insert(parts->end(), s, s + DUNGEON_Y);
+    }
+    n++;
+  }
+  return n;
+} // split_rows
+
+/*
+ * Packs a dungeon
+ */
+void pack_dungeon(dungeon *d, compact_dungeon *c)
+{
+  const terrain_type *ter = &d->d_map[0][0];
+  const uint8_t *hard = &d->h_map[0][0];
+  uint32_t i, q;
+
+  memset(c, 0, sizeof (*c));
+  for (i = 0; i < PLANE_CELLS; i++) {
+    if (ter[i] >= ter_floor) {
+      set_bit(c->walk, i);
+      if (ter[i] == ter_floor_room) {
+        set_bit(c->room, i);
+      }
+      continue;
+    }
+    q = (hard[i] + HARDNESS_STEP / 2) / HARDNESS_STEP;
+    c->hard[i / 2] |= q << (i & 1) * 4;
+  }
+  c->pc_x = (*d).get_pcx();
+  c->pc_y = (*d).get_pcy();
+  find_stairs(d, c->stairs);
+} // pack_dungeon
+
+/*
+ * Unpacks into a dungeon for editing.  Walls come back to within
+ * HARDNESS_STEP of their hardness, and rooms are found again from the
+ * room floor.
+ */
+void unpack_dungeon(const compact_dungeon *c, dungeon *d)
+{
+  uint32_t x, y, i, h;
+
+  del_dungeon(d);
+  init_dungeon(d);
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      i = y * DUNGEON_X + x;
+      if (get_bit(c->walk, i)) {
+        dmapxy(x, y) = get_bit(c->room, i) ? ter_floor_room : ter_floor_hall;
+        hmapxy(x, y) = 0;
+        continue;
+      }
+      h = (c->hard[i / 2] >> (i & 1) * 4 & 0xf) * HARDNESS_STEP;
+      dmapxy(x, y) = ter_wall;
+      hmapxy(x, y) = h < 1 ? 1 : h > MAX_HARDNESS_VALUE - 1 ?
+                     MAX_HARDNESS_VALUE - 1 : h;
+    }
+  }
+  /* Stairs hide the floor under them; as in text maps, it's room *
+   * floor when two or more of its neighbors are.                  */
+  for (i = 0; c->stairs[0] && i < 4; i += 2) {
+    x = c->stairs[i];
+    y = c->stairs[i + 1];
+    if ((dmapxy(x - 1, y) == ter_floor_room) +
+        (dmapxy(x + 1, y) == ter_floor_room) +
+        (dmapxy(x, y - 1) == ter_floor_room) +
+        (dmapxy(x, y + 1) == ter_floor_room) >= 2) {
+      dmapxy(x, y) = ter_floor_room;
+    }
+  }
+  find_rooms(d);
+  if (c->stairs[0]) {
+    dmapxy(c->stairs[0], c->stairs[1]) = ter_stairs_up;
+    dmapxy(c->stairs[2], c->stairs[3]) = ter_stairs_down;
+  }
+  (*d).set_pc(c->pc_x, c->pc_y);
+  (*d).mark_all_dirty();
+} // unpack_dungeon
+
+/*
+ * The number of separate walkable regions
+ */
+uint32_t compact_components(const compact_dungeon *c)
+{
+  row_bits walk[DUNGEON_Y];
+
+  plane_rows(c->walk, walk);
+  return split_rows(walk, nullptr);
+} // compact_components
+
+/*
+ * measure_dungeon on the bit planes.  Rooms are the regions of the
+ * room plane; corridors are walkable cells that are neither room nor
+ * stairs; wall hardness is to within HARDNESS_STEP.  Distances come
+ * from growing the PC's cell a move at a time and noting when each
+ * room is first touched; what the PC reaches is one region, so only
+ * the rest need splitting.
+ */
+void compact_metrics(const compact_dungeon *c, dungeon_metrics *m)
+{
+  row_bits walk[DUNGEON_Y], room[DUNGEON_Y], s[DUNGEON_Y], rest[DUNGEON_Y];
+  row_bits hit[DUNGEON_Y], hall, one, two, n[8], fresh;
+  std::vector<row_bits> rooms;
+  std::vector<bool> reached;
+  uint32_t i, j, r, x, y, dist, h;
+
+  memset(m, 0, sizeof (*m));
+  plane_rows(c->walk, walk);
+  plane_rows(c->room, room);
+  m->rooms = split_rows(room, &rooms);
+
+  for (y = 1, h = 0; y < DUNGEON_Y - 1; y++) {
+    m->room_cells += row_count(room[y]);
+    m->walkable += row_count(walk[y]);
+
+    /* Dead ends: corridor cells with exactly one walkable neighbor */
+    hall = walk[y] & ~room[y];
+    for (i = 0; c->stairs[0] && i < 4; i += 2) {
+      if (c->stairs[i + 1] == y) {
+        hall &= ~((row_bits) 1 << c->stairs[i]);
+      }
+    }
+    m->corridor_cells += row_count(hall);
+    n[0] = walk[y] << 1;
+    n[1] = walk[y] >> 1;
+    n[2] = walk[y - 1];
+    n[3] = walk[y - 1] << 1;
+    n[4] = walk[y - 1] >> 1;
+    n[5] = walk[y + 1];
+    n[6] = walk[y + 1] << 1;
+    n[7] = walk[y + 1] >> 1;
+    for (j = 0, one = two = 0; j < 8; j++) {
+      two |= one & n[j];
+      one |= n[j];
+    }
+    m->dead_ends += row_count(hall & one & ~two);
+
+    /* Floor is packed as hardness 0, so every interior cell counts */
+    for (x = y * DUNGEON_X / 2; x < (y + 1) * DUNGEON_X / 2; x++) {
+      h += (c->hard[x] & 0xf) + (c->hard[x] >> 4);
+    }
+    h -= (c->hard[y * DUNGEON_X / 2] & 0xf) +
+         (c->hard[(y + 1) * DUNGEON_X / 2 - 1] >> 4);
+  }
+
+  m->walls = (DUNGEON_X - 2) * (DUNGEON_Y - 2) - m->walkable;
+  m->wall_hardness = (uint64_t) h * HARDNESS_STEP;
+
+  m->pc_placed = c->pc_x && c->pc_y;
+  memset(s, 0, sizeof (s));
+  memset(hit, 0, sizeof (hit));
+  if (m->pc_placed && get_bit(c->walk, c->pc_y * DUNGEON_X + c->pc_x)) {
+    s[c->pc_y] = (row_bits) 1 << c->pc_x;
+    reached.assign(m->rooms, false);
+    for (dist = 0; ; dist++) {
+      /* Only look for rooms when new room floor was reached */
+      for (y = 1, fresh = 0; y < DUNGEON_Y - 1; y++) {
+        fresh |= s[y] & room[y] & ~hit[y];
+        hit[y] = s[y] & room[y];
+      }
+      for (r = 0; fresh && r < m->rooms; r++) {
+        if (reached[r]) {
+          continue;
+        }
+        for (y = 1; y < DUNGEON_Y - 1 &&
+                    !(s[y] & rooms[r * DUNGEON_Y + y]); y++)
+          ;
+        if (y < DUNGEON_Y - 1) {
+          reached[r] = true;
+          m->reachable_rooms++;
+          m->room_dist_total += dist;
+          m->room_dist_max = dist;
+        }
+      }
+      if (!step_rows(walk, s)) {
+        break;
+      }
+    }
+    for (y = 1; y < DUNGEON_Y - 1; y++) {
+      m->reachable += row_count(s[y]);
+    }
+  }
+
+  for (y = 0; y < DUNGEON_Y; y++) {
+    rest[y] = walk[y] & ~s[y];
+  }
+  m->components = split_rows(rest, nullptr) + (m->reachable != 0);
+} // compact_metrics
+
+/*
+ * Hash of everything kept, so equal compact dungeons hash the same.
+ * It is not hash_dungeon's hash: hardness is quantized and rooms are
+ * only implied.
+ */
+hash128 compact_hash(const compact_dungeon *c)
+{
+  return hash_bytes((const uint8_t *) c,
+                    offsetof(compact_dungeon, stairs) + sizeof (c->stairs));
+} // compact_hash
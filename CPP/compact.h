@@ -0,0 +1,39 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stdint.h>
+
+#include "dungeon.h"
+#include "hash.h"
+
+struct dungeon_metrics;
+
+/* Words in a bit plane: one bit per cell, in row order */
+const uint32_t PLANE_WORDS = (DUNGEON_X * DUNGEON_Y + 63) / 64;
+/* Hardness is kept to 16 levels, 17 apart */
+const uint32_t HARDNESS_STEP = 17;
+
+/*
+ * A dungeon cut down for holding by the million: which cells are
+ * walkable and which of those are room floor, one bit each, and the
+ * hardness to within HARDNESS_STEP, four bits each.  About 1.3KB,
+ * against 3.4KB and the rooms for a dungeon.  Rooms, the border and
+ * the terrain of floor that isn't room are implied by the planes;
+ * stairs and the PC are kept as positions.  Read only: it is made
+ * from a dungeon and unpacked back into one to edit.
+ */
+struct compact_dungeon {
+  uint64_t walk[PLANE_WORDS];
+  uint64_t room[PLANE_WORDS];
+  uint8_t hard[DUNGEON_X * DUNGEON_Y / 2];
+  uint8_t pc_x, pc_y;
+  uint8_t stairs[4];
+};
+
+void pack_dungeon(dungeon *d, compact_dungeon *c);
+void unpack_dungeon(const compact_dungeon *c, dungeon *d);
+uint32_t compact_components(const compact_dungeon *c);
+void compact_metrics(const compact_dungeon *c, dungeon_metrics *m);
+hash128 compact_hash(const compact_dungeon *c);
+
+#endif
@@ -0,0 +1,953 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "convert.h"
+#include "corpus.h"
+#include "hash.h"
+#include "io.h"
+#include "room.h"
+#include "utils.h"
+
+/*
+ * Dungeons as text, for tools and for people.
+ *
+ * The ASCII map is the dungeon as the editor draws it: 21 lines of 80
+ * glyphs from io.h.  Rooms aren't stored; they are rebuilt from the
+ * room floor when the map is read.
+ *
+ * The JSON form holds what a save holds (the PC, stairs, rooms and
+ * hardness) plus the ASCII map as an array of strings for people to
+ * look at.  The map is ignored when reading.
+ *
+ * Writers stream a row at a time.  Parsers make one pass over the text
+ * without allocating and produce a save, which decode_dungeon then
+ * checks and loads like any other.
+ */
+
+const char *map_format_name[num_map_formats] = {
+  "rlg",
+  "json",
+  "ascii"
+};
+
+static const char *map_format_ext[num_map_formats] = {
+  ".rlg",
+  ".json",
+  ".txt"
+};
+
+/*
+ * Looks up a format by name.  Returns 1 if there is none.
+ */
+int parse_map_format(const char *name, map_format *format)
+{
+  uint32_t i;
+
+  for (i = 0; i < num_map_formats; i++) {
+    if (!strcmp(name, map_format_name[i])) {
+      *format = (map_format) i;
+      return 0;
+    }
+  }
+  return 1;
+} // parse_map_format
+
+/*
+ * Guesses the format of a dungeon from its first bytes
+ */
+map_format sniff_format(const uint8_t *buf, size_t len)
+{
+  size_t i;
+
+  if (len >= strlen(DUNGEON_SAVE_SEMANTIC) &&
+      !memcmp(buf, DUNGEON_SAVE_SEMANTIC, strlen(DUNGEON_SAVE_SEMANTIC))) {
+    return format_rlg;
+  }
+  for (i = 0; i < len && (buf[i] == ' ' || buf[i] == '\t' ||
+                          buf[i] == '\r' || buf[i] == '\n'); i++)
+    ;
+  return i < len && buf[i] == '{' ? format_json : format_ascii;
+} // sniff_format
+
+/*
+ * The glyph the editor draws for a cell
+ */
+static char cell_glyph(dungeon *d, uint32_t x, uint32_t y)
+{
+  if (x == (*d).get_pcx() && y == (*d).get_pcy()) {
+    return PC_CHAR;
+  }
+  switch (dmapxy(x, y)) {
+  case ter_wall:
+    return WALL_CHAR;
+  case ter_wall_immutable:
+    return !y || y == DUNGEON_Y - 1 ? HORIZ_BORDER_CHAR : VERT_BORDER_CHAR;
+  case ter_floor_room:
+    return ROOM_CHAR;
+  case ter_floor:
+  case ter_floor_hall:
+    return HALL_CHAR;
+  case ter_stairs_up:
+    return STAIRS_UP_CHAR;
+  case ter_stairs_down:
+    return STAIRS_DOWN_CHAR;
+  default:
+    return UNKNOWN_CHAR;
+  }
+} // cell_glyph
+
+static void map_row(dungeon *d, uint32_t y, char row[DUNGEON_X])
+{
+  uint32_t x;
+
+  for (x = 0; x < DUNGEON_X; x++) {
+    row[x] = cell_glyph(d, x, y);
+  }
+} // map_row
+
+/*
+ * Writes the dungeon as an ASCII map.  Returns 1 on a write error.
+ */
+int write_ascii(dungeon *d, FILE *f)
+{
+  char row[DUNGEON_X + 1];
+  uint32_t y;
+
+  row[DUNGEON_X] = '\n';
+  for (y = 0; y < DUNGEON_Y; y++) {
+    map_row(d, y, row);
+    fwrite(row, sizeof (row), 1, f);
+  }
+  return ferror(f) ? 1 : 0;
+} // write_ascii
+
+static char *put_uint(char *p, uint32_t v)
+{
+  char digits[10];
+  uint32_t n;
+
+  n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n) {
+    *p++ = digits[--n];
+  }
+  return p;
+} // put_uint
+
+/*
+ * Writes the dungeon as JSON.  Returns 1 on a write error.
+ */
+int write_json(dungeon *d, FILE *f)
+{
+  /* The widest row is the hardness: "    [" then 80 "255, " and "],\n" */
+  char row[8 + DUNGEON_X * 5];
+  uint8_t stairs[4];
+  uint32_t i, x, y;
+  char *p;
+
+  std::fprintf(f, "{\n  \"format\": \"%s\",\n  \"width\": %u,\n"
+               "  \"height\": %u,\n", DUNGEON_SAVE_SEMANTIC,
+               DUNGEON_X, DUNGEON_Y);
+  if ((*d).get_pcx() && (*d).get_pcy()) {
+    std::fprintf(f, "  \"pc\": [%u, %u],\n", (*d).get_pcx(), (*d).get_pcy());
+  } else {
+    std::fputs("  \"pc\": null,\n", f);
+  }
+  if (find_stairs(d, stairs)) {
+    std::fprintf(f, "  \"stairs\": {\"up\": [%u, %u], \"down\": [%u, %u]},\n",
+                 stairs[0], stairs[1], stairs[2], stairs[3]);
+  } else {
+    std::fputs("  \"stairs\": null,\n", f);
+  }
+
+  std::fputs("  \"rooms\": [", f);
+  for (i = 0; i < d->rooms.size(); i++) {
+    std::fprintf(f, "%s\n    [%u, %u, %u, %u]", i ? "," : "",
+                 (*d->rooms[i]).get_x(), (*d->rooms[i]).get_y(),
+                 (*d->rooms[i]).get_xsize(), (*d->rooms[i]).get_ysize());
+  }
+  std::fputs(d->rooms.empty() ? "],\n" : "\n  ],\n", f);
+
+  std::fputs("  \"map\": [\n", f);
+  for (y = 0; y < DUNGEON_Y; y++) {
+    p = row;
+    p = (char *) memcpy(p, "    \"", 5) + 5;
+    map_row(d, y, p);
+    p += DUNGEON_X;
+    *p++ = '"';
+    if (y < DUNGEON_Y - 1) {
+      *p++ = ',';
+    }
+    *p++ = '\n';
+    fwrite(row, p - row, 1, f);
+  }
+  std::fputs("  ],\n", f);
+
+  std::fputs("  \"hardness\": [\n", f);
+  for (y = 0; y < DUNGEON_Y; y++) {
+    p = row;
+    p = (char *) memcpy(p, "    [", 5) + 5;
+    for (x = 0; x < DUNGEON_X; x++) {
+      if (x) {
+        *p++ = ',';
+        *p++ = ' ';
+      }
+      p = put_uint(p, hmapxy(x, y));
+    }
+    *p++ = ']';
+    if (y < DUNGEON_Y - 1) {
+      *p++ = ',';
+    }
+    *p++ = '\n';
+    fwrite(row, p - row, 1, f);
+  }
+  std::fputs("  ]\n}\n", f);
+
+  return ferror(f) ? 1 : 0;
+} // write_json
+
+/*
+ * Fills in the header of a save whose map and rooms are in place, and
+ * appends the stairs if there are any.  Returns the save's length.
+ */
+static size_t finish_save(uint8_t *save, uint8_t pc_x, uint8_t pc_y,
+                          uint32_t num_rooms, const uint8_t *stairs)
+{
+  uint32_t be32;
+  size_t len;
+
+  len = 22 + DUNGEON_X * DUNGEON_Y + num_rooms * 4;
+  if (stairs) {
+    memcpy(save + len, stairs, 4);
+    len += 4;
+  }
+  memcpy(save, DUNGEON_SAVE_SEMANTIC, strlen(DUNGEON_SAVE_SEMANTIC));
+  be32 = htobe32(stairs ? DUNGEON_SAVE_VERSION_STAIRS : DUNGEON_SAVE_VERSION);
+  memcpy(save + 12, &be32, 4);
+  be32 = htobe32(len);
+  memcpy(save + 16, &be32, 4);
+  save[20] = pc_x;
+  save[21] = pc_y;
+
+  return len;
+} // finish_save
+
+static bool map_glyph(char c)
+{
+  return c == WALL_CHAR || c == ROOM_CHAR || c == HALL_CHAR ||
+         c == PC_CHAR || c == STAIRS_UP_CHAR || c == STAIRS_DOWN_CHAR ||
+         c == HORIZ_BORDER_CHAR || c == VERT_BORDER_CHAR;
+} // map_glyph
+
+/*
+ * Turns an ASCII map into a save.  Short rows are padded with wall and
+ * the border is always immutable, whatever is drawn there, though a PC
+ * or stairs drawn on it are an error.  Walls get random hardness, as in
+ * a new dungeon, from a generator seeded by the map's text: the same
+ * map always gives the same save, whichever worker converts it.
+ *
+ * Room floor is cut into rooms greedily: the first uncovered room cell
+ * in reading order starts a room, which grows right and then down as
+ * far as room floor goes.  The PC and stairs hide the floor under
+ * them, so they count as room floor when two or more of their
+ * neighbors are.
+ *
+ * Returns 1 and points err at the problem, and line at its line, if
+ * the map can't be read.
+ */
+int parse_ascii(const char *buf, size_t len, uint8_t *save, size_t *save_len,
+                const char **err, uint32_t *line)
+{
+  char cells[DUNGEON_Y][DUNGEON_X];
+  bool floor[DUNGEON_Y][DUNGEON_X], used[DUNGEON_Y][DUNGEON_X];
+  uint8_t stairs[4], pc[2], *hardness, *rooms;
+  uint32_t x, y, i, w, h, n, num_rooms;
+  std::minstd_rand rng(hash_bytes((const uint8_t *) buf, len).lo);
+  const char *end;
+  char c;
+
+  memset(cells, WALL_CHAR, sizeof (cells));
+  memset(stairs, 0, sizeof (stairs));
+  memset(pc, 0, sizeof (pc));
+  *line = 1;
+  x = y = 0;
+  for (end = buf + len; buf < end; buf++) {
+    if ((c = *buf) == '\n') {
+      y++;
+      x = 0;
+      (*line)++;
+      continue;
+    }
+    if (c == '\r' || ((y >= DUNGEON_Y || x >= DUNGEON_X) && c == ' ')) {
+      continue;
+    }
+    if (y >= DUNGEON_Y) {
+      *err = "Map is more than 21 rows.";
+      return 1;
+    }
+    if (x >= DUNGEON_X) {
+      *err = "Row is more than 80 columns.";
+      return 1;
+    }
+    if (!map_glyph(c)) {
+      *err = "Unknown map glyph.";
+      return 1;
+    }
+    cells[y][x++] = c;
+  }
+  if (y + (x > 0) < DUNGEON_Y) {
+    *err = "Map is less than 21 rows.";
+    return 1;
+  }
+
+  /* The border is rebuilt, so nothing may stand on it */
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x += (y && y < DUNGEON_Y - 1) ?
+                                    DUNGEON_X - 1 : 1) {
+      if (cells[y][x] == PC_CHAR || cells[y][x] == STAIRS_UP_CHAR ||
+          cells[y][x] == STAIRS_DOWN_CHAR) {
+        *line = y + 1;
+        *err = "PC or stairs on the border.";
+        return 1;
+      }
+    }
+  }
+
+  /* Find the PC and stairs, and what lies under them */
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      floor[y][x] = cells[y][x] == ROOM_CHAR;
+      if (cells[y][x] != PC_CHAR && cells[y][x] != STAIRS_UP_CHAR &&
+          cells[y][x] != STAIRS_DOWN_CHAR) {
+        continue;
+      }
+      *line = y + 1;
+      n = (cells[y - 1][x] == ROOM_CHAR) + (cells[y + 1][x] == ROOM_CHAR) +
+          (cells[y][x - 1] == ROOM_CHAR) + (cells[y][x + 1] == ROOM_CHAR);
+      floor[y][x] = n >= 2;
+      if (cells[y][x] == PC_CHAR) {
+        if (pc[0]) {
+          *err = "More than one PC.";
+          return 1;
+        }
+        pc[0] = x;
+        pc[1] = y;
+      } else {
+        i = cells[y][x] == STAIRS_UP_CHAR ? 0 : 2;
+        if (stairs[i]) {
+          *err = "More than one up or down staircase.";
+          return 1;
+        }
+        stairs[i] = x;
+        stairs[i + 1] = y;
+      }
+    }
+  }
+  if (!stairs[0] != !stairs[2]) {
+    *line = (stairs[0] ? stairs[1] : stairs[3]) + 1;
+    *err = "Map needs both stairs or neither.";
+    return 1;
+  }
+
+  hardness = save + 22;
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x++, hardness++) {
+      if (!y || y == DUNGEON_Y - 1 || !x || x == DUNGEON_X - 1) {
+        *hardness = MAX_HARDNESS_VALUE;
+      } else if (cells[y][x] == WALL_CHAR || cells[y][x] == HORIZ_BORDER_CHAR ||
+                 cells[y][x] == VERT_BORDER_CHAR) {
+        *hardness = 1 + rng() % (MAX_HARDNESS_VALUE - 1);
+      } else {
+        *hardness = 0;
+      }
+    }
+  }
+
+  memset(used, 0, sizeof (used));
+  rooms = save + 22 + DUNGEON_X * DUNGEON_Y;
+  num_rooms = 0;
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (!floor[y][x] || used[y][x]) {
+        continue;
+      }
+      for (w = 1; x + w < DUNGEON_X - 1 && floor[y][x + w] &&
+                  !used[y][x + w]; w++)
+        ;
+      for (h = 1; y + h < DUNGEON_Y - 1; h++) {
+        for (i = 0; i < w && floor[y + h][x + i] && !used[y + h][x + i]; i++)
+          ;
+        if (i < w) {
+          break;
+        }
+      }
+      *line = y + 1;
+      if (w < MIN_ROOM_XSIZE || h < MIN_ROOM_YSIZE) {
+        *err = "Room is smaller than 3 by 2.";
+        return 1;
+      }
+      if (num_rooms == MAX_TEXT_ROOMS) {
+        *err = "Too many rooms.";
+        return 1;
+      }
+      for (i = 0; i < h; i++) {
+        memset(&used[y + i][x], true, w);
+      }
+      rooms[num_rooms * 4] = x;
+      rooms[num_rooms * 4 + 1] = y;
+      rooms[num_rooms * 4 + 2] = w;
+      rooms[num_rooms * 4 + 3] = h;
+      num_rooms++;
+    }
+  }
+
+  *save_len = finish_save(save, pc[0], pc[1], num_rooms,
+                          stairs[0] ? stairs : nullptr);
+  return 0;
+} // parse_ascii
+
+/*
+ * Where the JSON parser is
+ */
+struct json_in {
+  const char *p, *end;
+  uint32_t line;
+  const char *err;
+};
+
+/* Deepest nesting skip_value follows */
+static const uint32_t JSON_MAX_DEPTH = 64;
+
+static void skip_ws(json_in *in)
+{
+  for (; in->p < in->end; in->p++) {
+    if (*in->p == '\n') {
+      in->line++;
+    } else if (*in->p != ' ' && *in->p != '\t' && *in->p != '\r') {
+      break;
+    }
+  }
+} // skip_ws
+
+/*
+ * Consumes c if it is next
+ */
+static bool eat(json_in *in, char c)
+{
+  skip_ws(in);
+  if (in->p < in->end && *in->p == c) {
+    in->p++;
+    return true;
+  }
+  return false;
+} // eat
+
+static int expect(json_in *in, char c)
+{
+  if (eat(in, c)) {
+    return 0;
+  }
+  in->err = "Malformed JSON.";
+  return 1;
+} // expect
+
+static bool eat_null(json_in *in)
+{
+  skip_ws(in);
+  if (in->end - in->p >= 4 && !memcmp(in->p, "null", 4)) {
+    in->p += 4;
+    return true;
+  }
+  return false;
+} // eat_null
+
+static int parse_uint(json_in *in, uint32_t max, uint32_t *v)
+{
+  skip_ws(in);
+  if (in->p == in->end || *in->p < '0' || *in->p > '9') {
+    in->err = "Expected a number.";
+    return 1;
+  }
+  for (*v = 0; in->p < in->end && *in->p >= '0' && *in->p <= '9'; in->p++) {
+    *v = *v * 10 + (*in->p - '0');
+    if (*v > max) {
+      in->err = "Number out of range.";
+      return 1;
+    }
+  }
+  return 0;
+} // parse_uint
+
+/*
+ * Points key at the text of a string, escapes and all
+ */
+static int parse_string(json_in *in, const char **key, size_t *len)
+{
+  if (expect(in, '"')) {
+    return 1;
+  }
+  for (*key = in->p; in->p < in->end && *in->p != '"'; in->p++) {
+    if (*in->p == '\\') {
+      in->p++;
+    } else if (*in->p == '\n') {
+      break;
+    }
+  }
+  if (in->p >= in->end || *in->p != '"') {
+    in->err = "Unterminated string.";
+    return 1;
+  }
+  *len = in->p++ - *key;
+  return 0;
+} // parse_string
+
+static int skip_value(json_in *in, uint32_t depth)
+{
+  const char *s;
+  size_t len;
+  char close;
+
+  skip_ws(in);
+  if (in->p == in->end) {
+    in->err = "Malformed JSON.";
+    return 1;
+  }
+  if (*in->p == '"') {
+    return parse_string(in, &s, &len);
+  }
+  if (*in->p != '[' && *in->p != '{') {
+    /* A number, true, false or null */
+    for (s = in->p; in->p < in->end && *in->p != ',' && *in->p != ']' &&
+                    *in->p != '}' && *in->p != ' ' && *in->p != '\n' &&
+                    *in->p != '\t' && *in->p != '\r'; in->p++)
+      ;
+    if (in->p == s) {
+      in->err = "Malformed JSON.";
+      return 1;
+    }
+    return 0;
+  }
+  if (depth == JSON_MAX_DEPTH) {
+    in->err = "JSON nested too deeply.";
+    return 1;
+  }
+
+  close = *in->p++ == '[' ? ']' : '}';
+  if (eat(in, close)) {
+    return 0;
+  }
+  do {
+    if (close == '}' && (parse_string(in, &s, &len) || expect(in, ':'))) {
+      return 1;
+    }
+    if (skip_value(in, depth + 1)) {
+      return 1;
+    }
+  } while (eat(in, ','));
+  return expect(in, close);
+} // skip_value
+
+/*
+ * Parses [x, y] inside the border, or null for 0, 0
+ */
+static int parse_point(json_in *in, uint8_t xy[2])
+{
+  uint32_t x, y;
+
+  if (eat_null(in)) {
+    xy[0] = xy[1] = 0;
+    return 0;
+  }
+  if (expect(in, '[') || parse_uint(in, DUNGEON_X - 2, &x) ||
+      expect(in, ',') || parse_uint(in, DUNGEON_Y - 2, &y) ||
+      expect(in, ']')) {
+    return 1;
+  }
+  if (!x || !y) {
+    in->err = "Point is on the border.";
+    return 1;
+  }
+  xy[0] = x;
+  xy[1] = y;
+  return 0;
+} // parse_point
+
+static bool is_key(const char *key, size_t len, const char *name)
+{
+  return len == strlen(name) && !memcmp(key, name, len);
+} // is_key
+
+/*
+ * Parses {"up": [x, y], "down": [x, y]}, or null for no stairs
+ */
+static int parse_stairs(json_in *in, uint8_t stairs[4])
+{
+  const char *key;
+  size_t len;
+
+  memset(stairs, 0, 4);
+  if (eat_null(in)) {
+    return 0;
+  }
+  if (expect(in, '{')) {
+    return 1;
+  }
+  if (eat(in, '}')) {
+    return 0;
+  }
+  do {
+    if (parse_string(in, &key, &len) || expect(in, ':')) {
+      return 1;
+    }
+    if (is_key(key, len, "up")) {
+      if (parse_point(in, stairs)) {
+        return 1;
+      }
+    } else if (is_key(key, len, "down")) {
+      if (parse_point(in, stairs + 2)) {
+        return 1;
+      }
+    } else if (skip_value(in, 1)) {
+      return 1;
+    }
+  } while (eat(in, ','));
+  return expect(in, '}');
+} // parse_stairs
+
+static int parse_rooms(json_in *in, uint8_t *rooms, uint32_t *num_rooms)
+{
+  uint32_t i, v;
+
+  *num_rooms = 0;
+  if (expect(in, '[')) {
+    return 1;
+  }
+  if (eat(in, ']')) {
+    return 0;
+  }
+  do {
+    if (*num_rooms == MAX_TEXT_ROOMS) {
+      in->err = "Too many rooms.";
+      return 1;
+    }
+    if (expect(in, '[')) {
+      return 1;
+    }
+    for (i = 0; i < 4; i++) {
+      if ((i && expect(in, ',')) ||
+          parse_uint(in, i & 1 ? DUNGEON_Y : DUNGEON_X, &v)) {
+        return 1;
+      }
+      *rooms++ = v;
+    }
+    if (expect(in, ']')) {
+      return 1;
+    }
+    (*num_rooms)++;
+  } while (eat(in, ','));
+  return expect(in, ']');
+} // parse_rooms
+
+/*
+ * Parses 21 rows of 80 hardness values.  The border must be immutable
+ * rock, 255, like the border of every dungeon.
+ */
+static int parse_hardness(json_in *in, uint8_t *hardness)
+{
+  uint32_t x, y, v;
+
+  if (expect(in, '[')) {
+    return 1;
+  }
+  for (y = 0; y < DUNGEON_Y; y++) {
+    if ((y && expect(in, ',')) || expect(in, '[')) {
+      if (in->p < in->end && *in->p == ']') {
+        in->err = "Hardness must have 21 rows.";
+      }
+      return 1;
+    }
+    for (x = 0; x < DUNGEON_X; x++) {
+      if ((x && expect(in, ',')) || parse_uint(in, MAX_HARDNESS_VALUE, &v)) {
+        if (in->p < in->end && *in->p == ']') {
+          in->err = "Hardness rows must have 80 values.";
+        }
+        return 1;
+      }
+      if (v != MAX_HARDNESS_VALUE &&
+          (!y || y == DUNGEON_Y - 1 || !x || x == DUNGEON_X - 1)) {
+        in->err = "Border hardness must be 255.";
+        return 1;
+      }
+      *hardness++ = v;
+    }
+    if (expect(in, ']')) {
+      in->err = "Hardness rows must have 80 values.";
+      return 1;
+    }
+  }
+  if (expect(in, ']')) {
+    in->err = "Hardness must have 21 rows.";
+    return 1;
+  }
+  return 0;
+} // parse_hardness
+
+/*
+ * Turns JSON into a save.  The hardness is required; the PC, stairs
+ * and rooms default to none.  Unknown keys and the map are skipped.
+ * Returns 1 and points err at the problem, and line at its line, if
+ * the JSON can't be read.
+ */
+int parse_json(const char *buf, size_t len, uint8_t *save, size_t *save_len,
+               const char **err, uint32_t *line)
+{
+  json_in in;
+  const char *key;
+  size_t key_len;
+  uint8_t pc[2], stairs[4];
+  uint32_t num_rooms, v;
+  bool have_hardness;
+
+  in.p = buf;
+  in.end = buf + len;
+  in.line = 1;
+  in.err = nullptr;
+  memset(pc, 0, sizeof (pc));
+  memset(stairs, 0, sizeof (stairs));
+  num_rooms = 0;
+  have_hardness = false;
+
+  if (expect(&in, '{')) {
+    goto fail;
+  }
+  if (!eat(&in, '}')) {
+    do {
+      if (parse_string(&in, &key, &key_len) || expect(&in, ':')) {
+        goto fail;
+      }
+      if (is_key(key, key_len, "width") || is_key(key, key_len, "height")) {
+        if (parse_uint(&in, UINT16_MAX, &v)) {
+          goto fail;
+        }
+        if (v != (*key == 'w' ? DUNGEON_X : DUNGEON_Y)) {
+          in.err = "Dungeons must be 80 by 21.";
+          goto fail;
+        }
+      } else if (is_key(key, key_len, "pc")) {
+        if (parse_point(&in, pc)) {
+          goto fail;
+        }
+      } else if (is_key(key, key_len, "stairs")) {
+        if (parse_stairs(&in, stairs)) {
+          goto fail;
+        }
+      } else if (is_key(key, key_len, "rooms")) {
+        if (parse_rooms(&in, save + 22 + DUNGEON_X * DUNGEON_Y, &num_rooms)) {
+          goto fail;
+        }
+      } else if (is_key(key, key_len, "hardness")) {
+        if (parse_hardness(&in, save + 22)) {
+          goto fail;
+        }
+        have_hardness = true;
+      } else if (skip_value(&in, 0)) {
+        goto fail;
+      }
+    } while (eat(&in, ','));
+    if (expect(&in, '}')) {
+      goto fail;
+    }
+  }
+  skip_ws(&in);
+  if (in.p != in.end) {
+    in.err = "Unexpected data after JSON.";
+    goto fail;
+  }
+  if (!have_hardness) {
+    in.err = "No hardness in JSON.";
+    goto fail;
+  }
+  if (!stairs[0] != !stairs[2]) {
+    in.err = "Stairs need both up and down.";
+    goto fail;
+  }
+
+  *save_len = finish_save(save, pc[0], pc[1], num_rooms,
+                          stairs[0] ? stairs : nullptr);
+  return 0;
+
+ fail:
+  *err = in.err;
+  *line = in.line;
+  return 1;
+} // parse_json
+
+/*
+ * Loads a dungeon from a save, JSON or ASCII file, whichever it is.
+ * Returns 1 and prints why if it can't be loaded.
+ */
+int read_any_dungeon(dungeon *d, const char *file)
+{
+  std::vector<uint8_t> buf;
+  uint8_t text_save[MAX_TEXT_SAVE];
+  const uint8_t *save;
+  const char *err;
+  size_t len;
+  uint32_t line;
+  int ret;
+
+  if (read_save_file(file, buf)) {
+    std::perror(file);
+    return 1;
+  }
+  save = buf.empty() ? nullptr : &buf[0];
+  len = buf.size();
+  switch (sniff_format(save, len)) {
+  case format_rlg:
+    ret = 0;
+    break;
+  case format_json:
+    ret = parse_json((const char *) save, len, text_save, &len, &err, &line);
+    save = text_save;
+    break;
+  default:
+    ret = parse_ascii((const char *) save, len, text_save, &len, &err, &line);
+    save = text_save;
+  }
+  if (ret) {
+    std::fprintf(stderr, "%s:%u: %s\n", file, line, err);
+    return 1;
+  }
+  if (decode_dungeon(d, save, len, &err)) {
+    std::fprintf(stderr, "%s: %s\n", file, err);
+    return 1;
+  }
+  return 0;
+} // read_any_dungeon
+
+/*
+ * Writes one converted dungeon.  Returns 1 and sets errno on failure.
+ */
+static int write_converted(dungeon *d, const uint8_t *save, size_t len,
+                           map_format format, const char *file)
+{
+  FILE *f;
+  int ret, err;
+
+  if (!(f = fopen(file, "w"))) {
+    return 1;
+  }
+  switch (format) {
+  case format_rlg:
+    ret = fwrite(save, len, 1, f) != 1;
+    break;
+  case format_json:
+    ret = write_json(d, f);
+    break;
+  default:
+    ret = write_ascii(d, f);
+  }
+  err = errno;
+  if (fclose(f) || ret) {
+    errno = ret ? err : errno;
+    return 1;
+  }
+  return 0;
+} // write_converted
+
+/*
+ * Converts every dungeon in a directory or archive, whatever its
+ * format, to dir/<name>.rlg, .json or .txt, on jobs threads.  Files
+ * that can't be read or parsed are reported and skipped.  Returns 1
+ * if any dungeon wasn't converted.
+ */
+int convert_files(const char *src, const char *dir, map_format format,
+                  uint32_t jobs)
+{
+  corpus c;
+  std::atomic<uint32_t> failed(0);
+  uint64_t start;
+
+  if (c.open(src)) {
+    return 1;
+  }
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    std::perror(dir);
+    return 1;
+  }
+
+  start = now_usec();
+  parallel_for(c.size(), jobs, [&](uint32_t i) {
+    dungeon d;
+    std::vector<uint8_t> buf;
+    uint8_t text_save[MAX_TEXT_SAVE];
+    std::string name, out;
+    const uint8_t *data, *save;
+    const char *err;
+    size_t len, save_len;
+    uint32_t line, j;
+    int ret;
+
+    name = c.name(i);
+    if (c.get(i, buf, &data, &len)) {
+      std::fprintf(stderr, "%s: %s\n", name.c_str(), strerror(errno));
+      failed++;
+      return;
+    }
+    save = text_save;
+    switch (sniff_format(data, len)) {
+    case format_rlg:
+      save = data;
+      save_len = len;
+      ret = 0;
+      break;
+    case format_json:
+      ret = parse_json((const char *) data, len, text_save, &save_len,
+                       &err, &line);
+      break;
+    default:
+      ret = parse_ascii((const char *) data, len, text_save, &save_len,
+                        &err, &line);
+    }
+    if (ret) {
+      std::fprintf(stderr, "%s:%u: %s\n", name.c_str(), line, err);
+      failed++;
+      return;
+    }
+    if (decode_dungeon(&d, save, save_len, &err)) {
+      std::fprintf(stderr, "%s: %s\n", name.c_str(), err);
+      failed++;
+      return;
+    }
+
+    for (j = 0; j < num_map_formats; j++) {
+      if (name.size() > strlen(map_format_ext[j]) &&
+          !name.compare(name.size() - strlen(map_format_ext[j]),
+                        std::string::npos, map_format_ext[j])) {
+        name.erase(name.size() - strlen(map_format_ext[j]));
+        break;
+      }
+    }
+    out = std::string(dir) + "/" + name + map_format_ext[format];
+    if (write_converted(&d, save, save_len, format, out.c_str())) {
+      std::perror(out.c_str());
+      failed++;
+    }
+    del_dungeon(&d);
+  });
+
+  std::fprintf(stderr, "Converted %u dungeons to %s in %s, %.1f us each\n",
+               c.size() - failed, map_format_name[format], dir,
+               c.size() ? (double) (now_usec() - start) / c.size() : 0.0);
+
+  return failed ? 1 : 0;
+} // convert_files
@@ -0,0 +1,38 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <cstdio>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dungeon.h"
+
+/* The formats dungeons convert between */
+enum map_format {
+  format_rlg,
+  format_json,
+  format_ascii,
+  num_map_formats
+};
+
+/* Most rooms a text map may hold */
+const uint32_t MAX_TEXT_ROOMS = 128;
+/* Largest save a text map can turn into */
+const size_t MAX_TEXT_SAVE = 22 + DUNGEON_X * DUNGEON_Y +
+                             MAX_TEXT_ROOMS * 4 + 4;
+
+extern const char *map_format_name[num_map_formats];
+
+int parse_map_format(const char *name, map_format *format);
+map_format sniff_format(const uint8_t *buf, size_t len);
+int write_ascii(dungeon *d, FILE *f);
+int write_json(dungeon *d, FILE *f);
+int parse_ascii(const char *buf, size_t len, uint8_t *save, size_t *save_len,
+                const char **err, uint32_t *line);
+int parse_json(const char *buf, size_t len, uint8_t *save, size_t *save_len,
+               const char **err, uint32_t *line);
+int read_any_dungeon(dungeon *d, const char *file);
+int convert_files(const char *src, const char *dir, map_format format,
+                  uint32_t jobs);
+
+#endif
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "dungeon.h"
+
+/* Bytes before the map: the marker, version, size and PC position */
+static const size_t SAVE_HEADER = 22;
+
+corpus::~corpus()
+{
+  if (map) {
+    munmap((void *) map, map_len);
+  }
+}
+
+static bool ends_with(const std::string& s, const char *suffix)
+{
+  size_t n = strlen(suffix);
+
+  return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+} // ends_with
+
+/*
+ * Opens a directory, an archive or a single file.  In a directory
+ * every regular file is taken as a save, except hidden files, journals
+ * and the temporaries that saves and journals are written to
+ * (name.tmpXXXXXX) before being renamed into place.  Returns 1 and
+ * prints why if path can't be used.
+ */
+int corpus::open(const char *path)
+{
+  struct stat st;
+  struct dirent *de;
+  std::string file;
+  DIR *dir;
+  uint32_t size;
+  size_t at;
+  int fd;
+
+  src = path;
+  if (stat(path, &st)) {
+    std::perror(path);
+    return 1;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if (!(dir = opendir(path))) {
+      std::perror(path);
+      return 1;
+    }
+    while ((de = readdir(dir))) {
+      file = src + "/" + de->d_name;
+      if (de->d_name[0] == '.' || strstr(de->d_name, ".tmp") ||
+          ends_with(de->d_name, ".journal") ||
+          stat(file.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      files.push_back(de->d_name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return 0;
+  }
+
+  archive = true;
+  if ((fd = ::open(path, O_RDONLY)) < 0) {
+    std::perror(path);
+    return 1;
+  }
+  map_len = st.st_size;
+  if (map_len) {
+    map = (const uint8_t *) mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE,
+                                 fd, 0);
+    if (map == MAP_FAILED) {
+      map = nullptr;
+      std::perror(path);
+      close(fd);
+      return 1;
+    }
+    madvise((void *) map, map_len, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  if (map_len < SAVE_HEADER ||
+      memcmp(map, DUNGEON_SAVE_SEMANTIC, strlen(DUNGEON_SAVE_SEMANTIC))) {
+    single = true;
+    offsets.push_back(0);
+    offsets.push_back(map_len);
+    return 0;
+  }
+
+  /* Walk the saves by their recorded sizes to find where each starts */
+  for (at = 0; at < map_len; at += size) {
+    offsets.push_back(at);
+    if (map_len - at < SAVE_HEADER ||
+        memcmp(map + at, DUNGEON_SAVE_SEMANTIC,
+               strlen(DUNGEON_SAVE_SEMANTIC))) {
+      std::fprintf(stderr, "%s: No save at byte %zu.\n", path, at);
+      return 1;
+    }
+    memcpy(&size, map + at + 16, 4);
+    size = be32toh(size);
+    if (size < SAVE_HEADER || size > map_len - at) {
+      std::fprintf(stderr, "%s: Bad save size at byte %zu.\n", path, at);
+      return 1;
+    }
+  }
+  offsets.push_back(at);
+  single = offsets.size() == 2;
+
+  return 0;
+} // open
+
+/*
+ * The name of save i: its file name, or the file's name without
+ * extension if it is alone, or for an archive the archive's name and
+ * the save's number
+ */
+std::string corpus::name(uint32_t i)
+{
+  std::string base;
+  char num[16];
+
+  if (!archive) {
+    return files[i];
+  }
+  base = src.substr(src.rfind('/') == std::string::npos ?
+                    0 : src.rfind('/') + 1);
+  if (base.rfind('.') != std::string::npos && base.rfind('.')) {
+    base.erase(base.rfind('.'));
+  }
+  if (single) {
+    return base;
+  }
+  std::snprintf(num, sizeof (num), "_%06u", i);
+  return base + num;
+} // name
+
+/*
+ * Points data and len at save i.  Archived saves are used in place;
+ * files are read into buf.  Returns 1 and sets errno if a file can't
+ * be read.  Safe to call from several threads with different bufs.
+ */
+int corpus::get(uint32_t i, std::vector<uint8_t>& buf,
+                const uint8_t **data, size_t *len)
+{
+  if (archive) {
+    *data = map + offsets[i];
+    *len = offsets[i + 1] - offsets[i];
+    return 0;
+  }
+  if (read_save_file((src + "/" + files[i]).c_str(), buf)) {
+    return 1;
+  }
+  *data = buf.empty() ? nullptr : &buf[0];
+  *len = buf.size();
+  return 0;
+} // get
+
+/*
+ * One worker per hardware thread
+ */
+uint32_t default_jobs(void)
+{
+  uint32_t n = std::thread::hardware_concurrency();
+
+  return n ? n : 1;
+} // default_jobs
+
+/*
+ * Calls fn(worker, i) for every i in [0, count) on jobs threads, the
+ * calling thread being worker 0.  Threads take the next index as they
+ * finish, so uneven work still spreads evenly.  Workers are numbered
+ * below jobs, so each can keep its own results without locking.
+ */
+void parallel_for_workers(uint32_t count, uint32_t jobs,
+                          const std::function<void(uint32_t worker,
+                                                   uint32_t i)>& fn)
+{
+  std::vector<std::thread> workers;
+  std::atomic<uint32_t> next(0);
+  uint32_t i;
+  auto work = [&](uint32_t worker) {
+    uint32_t j;
+
+    while ((j = next.fetch_add(1, std::memory_order_relaxed)) < count) {
+      fn(worker, j);
+    }
+  };
+
+  if (jobs > count) {
+    jobs = count;
+  }
+  for (i = 1; i < jobs; i++) {
+    workers.push_back(std::thread(work, i));
+  }
+  work(0);
+  for (i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+} // parallel_for_workers
+
+/*
+ * Calls fn(i) for every i in [0, count) on jobs threads
+ */
+void parallel_for(uint32_t count, uint32_t jobs,
+                  const std::function<void(uint32_t i)>& fn)
+{
+  parallel_for_workers(count, jobs, [&](uint32_t, uint32_t i) {
+    fn(i);
+  });
+} // parallel_for
@@ -0,0 +1,62 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * A set of saved dungeons to work through in bulk: either a directory
+ * of save files or an archive, which is save files concatenated into
+ * one (cat dungeons/dungeon_* > dungeons.rlg).  Each save records its
+ * size, so the archive needs no index.  Archives are mapped, not read.
+ * Any other file, such as a text map, is a corpus of one.
+ */
+class corpus {
+ private:
+  std::string src;
+  bool archive;
+  bool single;
+  std::vector<std::string> files;
+  const uint8_t *map;
+  size_t map_len;
+  std::vector<size_t> offsets;  /* Start of each save in an archive */
+
+ public:
+  corpus() : src(), archive(false), single(false), files(), map(nullptr),
+             map_len(0),
+             offsets() {}
+  ~corpus();
+
+  int open(const char *path);
+  uint32_t size(void)
+  {
+    return archive ? offsets.size() - 1 : files.size();
+  }
+  const char *source(void)
+  {
+    return src.c_str();
+  }
+  /* True if each save is a file of its own, named by name() */
+  bool directory(void)
+  {
+    return !archive;
+  }
+  std::string name(uint32_t i);
+  int get(uint32_t i, std::vector<uint8_t>& buf,
+          const uint8_t **data, size_t *len);
+};
+
+/* Most threads -j can ask for */
+const uint32_t MAX_JOBS = 1024;
+
+uint32_t default_jobs(void);
+void parallel_for_workers(uint32_t count, uint32_t jobs,
+                          const std::function<void(uint32_t worker,
+                                                   uint32_t i)>& fn);
+void parallel_for(uint32_t count, uint32_t jobs,
+                  const std::function<void(uint32_t i)>& fn);
+
+#endif
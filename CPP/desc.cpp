@@ -0,0 +1,666 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "desc.h"
+#include "dungeon.h"
+#include "utils.h"
+
+/*
+ * Monster and object description files, as the game reads them:
+ *
+ *   RLG327 MONSTER DESCRIPTION 1
+ *
+ *   BEGIN MONSTER
+ *   NAME Junior Barbarian
+ *   SYMB p
+ *   COLOR BLUE
+ *   DESC
+ *   A few lines of at most 77 characters,
+ *   ended by a line holding a single dot.
+ *   .
+ *   SPEED 7+1d4
+ *   DAM 0+1d4
+ *   HP 12+2d6
+ *   ABIL SMART
+ *   RRTY 100
+ *   END
+ *
+ * Objects are the same with BEGIN OBJECT and their own fields.  Each
+ * field appears exactly once, in any order.  An entry with a bad,
+ * repeated or missing field is reported with its line and skipped, as
+ * the game skips it, and the rest of the file is still read.
+ *
+ * The file is mapped and read in one pass, a line at a time.  Strings
+ * are interned into the set's arena, so the descriptions are a few
+ * large blocks however many entries there are.
+ */
+
+/* Size of an arena block; longer strings get a block of their own */
+static const size_t ARENA_BLOCK = 64 * 1024;
+
+/* Colors by name, in ncurses order, so bit n is ncurses color n */
+static const char *color_name[] = {
+  "BLACK", "RED", "GREEN", "YELLOW", "BLUE", "MAGENTA", "CYAN", "WHITE"
+};
+
+/* Abilities by name, bit n is the nth */
+static const char *ability_name[] = {
+  "SMART", "TELE", "TUNNEL", "ERRATIC", "PASS", "PICKUP", "DESTROY", "UNIQ",
+  "BOSS"
+};
+
+static const char *object_type_name[num_object_types] = {
+  "WEAPON", "OFFHAND", "RANGED", "ARMOR", "HELMET", "CLOAK", "GLOVES",
+  "BOOTS", "RING", "AMULET", "LIGHT", "SCROLL", "BOOK", "FLASK", "GOLD",
+  "AMMUNITION", "FOOD", "WAND", "CONTAINER"
+};
+
+enum monster_field {
+  mf_name, mf_desc, mf_color, mf_speed, mf_abil, mf_hp, mf_dam, mf_symb,
+  mf_rrty, num_monster_fields
+};
+
+static const char *monster_field_name[num_monster_fields] = {
+  "NAME", "DESC", "COLOR", "SPEED", "ABIL", "HP", "DAM", "SYMB", "RRTY"
+};
+
+enum object_field {
+  of_name, of_desc, of_type, of_color, of_hit, of_dam, of_dodge, of_def,
+  of_weight, of_speed, of_attr, of_val, of_art, of_rrty, num_object_fields
+};
+
+static const char *object_field_name[num_object_fields] = {
+  "NAME", "DESC", "TYPE", "COLOR", "HIT", "DAM", "DODGE", "DEF", "WEIGHT",
+  "SPEED", "ATTR", "VAL", "ART", "RRTY"
+};
+
+string_arena::~string_arena()
+{
+  uint32_t i;
+
+  for (i = 0; i < blocks.size(); i++) {
+    delete[] blocks[i];
+  }
+}
+
+char *string_arena::alloc(size_t len)
+{
+  char *p;
+
+  if (len > left) {
+    left = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+    next = new char[left];
+    blocks.push_back(next);
+  }
+  p = next;
+  next += len;
+  left -= len;
+  return p;
+} // alloc
+
+/*
+ * FNV-1a, plenty for a table of short strings
+ */
+static inline uint64_t hash_string(const char *s, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t) s[i]) * 1099511628211ULL;
+  }
+  return h;
+} // hash_string
+
+void string_arena::grow(void)
+{
+  std::vector<const char *> old;
+  size_t i, j, mask;
+
+  old.swap(table);
+  table.assign(old.empty() ? 1024 : 2 * old.size(), nullptr);
+  mask = table.size() - 1;
+  for (i = 0; i < old.size(); i++) {
+    if (old[i]) {
+      for (j = hash_string(old[i], strlen(old[i])) & mask; table[j];
+           j = (j + 1) & mask)
+        ;
+      table[j] = old[i];
+    }
+  }
+} // grow
+
+/*
+ * The arena's copy of the len bytes at s, NUL terminated, made the
+ * first time they are seen
+ */
+const char *string_arena::intern(const char *s, size_t len)
+{
+  size_t i, mask;
+  char *p;
+
+  if (2 * (count + 1) > table.size()) {
+    grow();
+  }
+  mask = table.size() - 1;
+  for (i = hash_string(s, len) & mask; table[i]; i = (i + 1) & mask) {
+    if (!strncmp(table[i], s, len) && !table[i][len]) {
+      return table[i];
+    }
+  }
+  p = alloc(len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  table[i] = p;
+  count++;
+  return p;
+} // intern
+
+/*
+ * Where the parser is
+ */
+struct desc_in {
+  const char *p, *end;
+  uint32_t line;
+  const char *err;
+  char msg[32];
+  /* The DESC being gathered; kept to reuse its memory */
+  std::string text;
+};
+
+/* Also starts the next entry, so it isn't skipped with the bad one */
+static const char BEGIN_BEFORE_END[] = "BEGIN before END.";
+
+/*
+ * Reads the next line, without its line ending.  Returns false at the
+ * end of the file.
+ */
+static bool next_line(desc_in *in, const char **s, size_t *len)
+{
+  const char *e;
+
+  if (in->p >= in->end) {
+    return false;
+  }
+  if (!(e = (const char *) memchr(in->p, '\n', in->end - in->p))) {
+    e = in->end;
+  }
+  *s = in->p;
+  *len = e - in->p;
+  if (*len && (*s)[*len - 1] == '\r') {
+    (*len)--;
+  }
+  in->p = e < in->end ? e + 1 : e;
+  in->line++;
+  return true;
+} // next_line
+
+static bool is_text(const char *s, size_t len, const char *text)
+{
+  return len == strlen(text) && !memcmp(s, text, len);
+} // is_text
+
+/*
+ * Index of the word s in names, or -1
+ */
+static int32_t find_word(const char *s, size_t len, const char *const *names,
+                         uint32_t n)
+{
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    if (is_text(s, len, names[i])) {
+      return i;
+    }
+  }
+  return -1;
+} // find_word
+
+static int parse_uint(desc_in *in, const char **s, const char *end,
+                      uint32_t max, uint32_t *v)
+{
+  if (*s == end || **s < '0' || **s > '9') {
+    in->err = "Expected a number.";
+    return 1;
+  }
+  for (*v = 0; *s < end && **s >= '0' && **s <= '9'; (*s)++) {
+    *v = *v * 10 + (**s - '0');
+    if (*v > max) {
+      in->err = "Number out of range.";
+      return 1;
+    }
+  }
+  return 0;
+} // parse_uint
+
+/*
+ * A whole value that is a number from min to max
+ */
+static int parse_number(desc_in *in, const char *s, size_t len, uint32_t min,
+                        uint32_t max, uint32_t *v)
+{
+  const char *end = s + len;
+
+  if (parse_uint(in, &s, end, max, v)) {
+    return 1;
+  }
+  if (s != end) {
+    in->err = "Expected a number.";
+    return 1;
+  }
+  if (*v < min) {
+    in->err = "Number out of range.";
+    return 1;
+  }
+  return 0;
+} // parse_number
+
+/*
+ * Dice written base+numberdsides, where the base may be negative
+ */
+static int parse_dice(desc_in *in, const char *s, size_t len, dice *d)
+{
+  const char *end = s + len;
+  uint32_t base, number, sides;
+  bool negative;
+
+  if ((negative = s < end && *s == '-')) {
+    s++;
+  }
+  if (parse_uint(in, &s, end, INT32_MAX, &base) ||
+      s == end || *s++ != '+' ||
+      parse_uint(in, &s, end, UINT16_MAX, &number) ||
+      s == end || *s++ != 'd' ||
+      parse_uint(in, &s, end, UINT16_MAX, &sides) || s != end) {
+    in->err = "Expected dice, like 7+1d4.";
+    return 1;
+  }
+  d->base = negative ? -(int32_t) base : base;
+  d->number = number;
+  d->sides = sides;
+  return 0;
+} // parse_dice
+
+/*
+ * A list of words from names separated by spaces, as a bit mask
+ */
+static int parse_flags(desc_in *in, const char *s, size_t len,
+                       const char *const *names, uint32_t n, uint32_t *mask)
+{
+  const char *end = s + len, *w;
+  int32_t i;
+
+  for (*mask = 0; s < end; ) {
+    for (w = s; s < end && *s != ' '; s++)
+      ;
+    if (s > w) {
+      if ((i = find_word(w, s - w, names, n)) < 0) {
+        in->err = "Unknown word in list.";
+        return 1;
+      }
+      *mask |= 1 << i;
+    }
+    for (; s < end && *s == ' '; s++)
+      ;
+  }
+  return 0;
+} // parse_flags
+
+/*
+ * Reads the lines of a DESC up to the one holding a dot, and interns
+ * them joined by newlines
+ */
+static const char *read_desc(desc_in *in, desc_set *set)
+{
+  const char *s;
+  size_t len;
+
+  in->text.clear();
+  while (next_line(in, &s, &len)) {
+    if (len == 1 && s[0] == '.') {
+      if (!in->text.empty()) {
+        in->text.resize(in->text.size() - 1);
+      }
+      return set->strings.intern(in->text.data(), in->text.size());
+    }
+    if (len > MAX_DESC_LINE) {
+      in->err = "DESC line longer than 77 characters.";
+      return nullptr;
+    }
+    in->text.append(s, len);
+    in->text += '\n';
+  }
+  in->err = "DESC not ended by a '.' line.";
+  return nullptr;
+} // read_desc
+
+/*
+ * Parses the value of one monster field into m
+ */
+static int parse_field(desc_in *in, uint32_t field, const char *s, size_t len,
+                       monster_desc *m, desc_set *set)
+{
+  uint32_t v;
+
+  switch (field) {
+  case mf_name:
+    if (!len) {
+      in->err = "NAME is empty.";
+      return 1;
+    }
+    m->name = set->strings.intern(s, len);
+    return 0;
+  case mf_desc:
+    return len ? (in->err = "DESC takes no value.", 1) :
+           !(m->desc = read_desc(in, set));
+  case mf_color:
+    if (parse_flags(in, s, len, color_name, 8, &v)) {
+      return 1;
+    }
+    m->colors = v;
+    return !v && (in->err = "COLOR is empty.");
+  case mf_speed:
+    return parse_dice(in, s, len, &m->speed);
+  case mf_abil:
+    if (parse_flags(in, s, len, ability_name, 9, &v)) {
+      return 1;
+    }
+    m->abilities = v;
+    return 0;
+  case mf_hp:
+    return parse_dice(in, s, len, &m->hp);
+  case mf_dam:
+    return parse_dice(in, s, len, &m->damage);
+  case mf_symb:
+    if (len != 1 || s[0] == ' ') {
+      in->err = "SYMB is one character.";
+      return 1;
+    }
+    m->symbol = s[0];
+    return 0;
+  case mf_rrty:
+    if (parse_number(in, s, len, 1, 100, &v)) {
+      return 1;
+    }
+    m->rarity = v;
+    return 0;
+  }
+  return 1;
+} // parse_field
+
+/*
+ * Parses the value of one object field into o
+ */
+static int parse_field(desc_in *in, uint32_t field, const char *s, size_t len,
+                       object_desc *o, desc_set *set)
+{
+  uint32_t v;
+
+  switch (field) {
+  case of_name:
+    if (!len) {
+      in->err = "NAME is empty.";
+      return 1;
+    }
+    o->name = set->strings.intern(s, len);
+    return 0;
+  case of_desc:
+    return len ? (in->err = "DESC takes no value.", 1) :
+           !(o->desc = read_desc(in, set));
+  case of_type:
+    if (parse_flags(in, s, len, object_type_name, num_object_types,
+                    &o->types)) {
+      return 1;
+    }
+    return !o->types && (in->err = "TYPE is empty.");
+  case of_color:
+    if (parse_flags(in, s, len, color_name, 8, &v)) {
+      return 1;
+    }
+    o->colors = v;
+    return !v && (in->err = "COLOR is empty.");
+  case of_hit:
+    return parse_dice(in, s, len, &o->hit);
+  case of_dam:
+    return parse_dice(in, s, len, &o->damage);
+  case of_dodge:
+    return parse_dice(in, s, len, &o->dodge);
+  case of_def:
+    return parse_dice(in, s, len, &o->defence);
+  case of_weight:
+    return parse_dice(in, s, len, &o->weight);
+  case of_speed:
+    return parse_dice(in, s, len, &o->speed);
+  case of_attr:
+    return parse_dice(in, s, len, &o->attribute);
+  case of_val:
+    return parse_dice(in, s, len, &o->value);
+  case of_art:
+    if (is_text(s, len, "TRUE") || is_text(s, len, "FALSE")) {
+      o->artifact = s[0] == 'T';
+      return 0;
+    }
+    in->err = "ART is TRUE or FALSE.";
+    return 1;
+  case of_rrty:
+    if (parse_number(in, s, len, 1, 100, &v)) {
+      return 1;
+    }
+    o->rarity = v;
+    return 0;
+  }
+  return 1;
+} // parse_field
+
+static void add_desc(desc_set *set, const monster_desc &m)
+{
+  set->monsters.push_back(m);
+} // add_desc
+
+static void add_desc(desc_set *set, const object_desc &o)
+{
+  set->objects.push_back(o);
+} // add_desc
+
+/*
+ * Parses one entry, after its BEGIN line, up to its END.  Returns 1 and
+ * sets err if it is bad; the rest of it is left for the caller to skip.
+ */
+template <class T>
+static int parse_entry(desc_in *in, const char *begin,
+                       const char *const *fields, uint32_t num_fields,
+                       T *e, desc_set *set)
+{
+  const char *s, *v, *end;
+  size_t len;
+  uint32_t seen, i;
+  int32_t f;
+
+  for (seen = 0; next_line(in, &s, &len); ) {
+    if (!len) {
+      continue;
+    }
+    if (is_text(s, len, "END")) {
+      for (i = 0; i < num_fields; i++) {
+        if (!(seen & 1 << i)) {
+          std::snprintf(in->msg, sizeof (in->msg), "Missing %s.", fields[i]);
+          in->err = in->msg;
+          return 1;
+        }
+      }
+      return 0;
+    }
+    if (is_text(s, len, begin)) {
+      in->err = BEGIN_BEFORE_END;
+      return 1;
+    }
+    end = s + len;
+    for (v = s; v < end && *v != ' '; v++)
+      ;
+    if ((f = find_word(s, v - s, fields, num_fields)) < 0) {
+      in->err = "Unknown field.";
+      return 1;
+    }
+    if (seen & 1 << f) {
+      in->err = "Field given twice.";
+      return 1;
+    }
+    seen |= 1 << f;
+    for (; v < end && *v == ' '; v++)
+      ;
+    if (parse_field(in, f, v, end - v, e, set)) {
+      return 1;
+    }
+  }
+  in->err = "File ends before END.";
+  return 1;
+} // parse_entry
+
+/*
+ * Maps a whole file read only.  Returns 1 and prints why on error.
+ */
+static int map_file(const char *file, const char **map, size_t *len)
+{
+  struct stat st;
+  void *m;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st)) {
+    std::perror(file);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  *len = st.st_size;
+  *map = nullptr;
+  if (*len) {
+    m = mmap(nullptr, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+      std::perror(file);
+      close(fd);
+      return 1;
+    }
+    madvise(m, *len, MADV_SEQUENTIAL);
+    *map = (const char *) m;
+  }
+  close(fd);
+  return 0;
+} // map_file
+
+/*
+ * Loads the entries of a description file into set.  Bad entries are
+ * reported on stderr with their line and counted in skipped.  Returns 1
+ * if the file can't be read or doesn't start with semantic.
+ */
+template <class T>
+static int load_desc(const char *file, const char *semantic,
+                     const char *begin, const char *const *fields,
+                     uint32_t num_fields, desc_set *set, uint32_t *skipped)
+{
+  desc_in in;
+  const char *map, *s;
+  size_t len, map_len;
+  bool skipping;
+  T e;
+
+  *skipped = 0;
+  if (map_file(file, &map, &map_len)) {
+    return 1;
+  }
+  in.p = map;
+  in.end = map + map_len;
+  in.line = 0;
+  if (!next_line(&in, &s, &len) || !is_text(s, len, semantic)) {
+    std::fprintf(stderr, "%s:1: Expected \"%s\".\n", file, semantic);
+    if (map) {
+      munmap((void *) map, map_len);
+    }
+    return 1;
+  }
+
+  for (skipping = false; next_line(&in, &s, &len); ) {
+    if (!is_text(s, len, begin)) {
+      if (len && !skipping) {
+        std::fprintf(stderr, "%s:%u: Expected \"%s\".\n", file, in.line,
+                     begin);
+        (*skipped)++;
+        skipping = true;
+      }
+      continue;
+    }
+    /* A bad entry is dropped from where it went wrong to its END */
+    for (;;) {
+      memset(&e, 0, sizeof (e));
+      e.line = in.line;
+      if (!parse_entry(&in, begin, fields, num_fields, &e, set)) {
+        add_desc(set, e);
+        skipping = false;
+        break;
+      }
+      std::fprintf(stderr, "%s:%u: %s\n", file, in.line, in.err);
+      (*skipped)++;
+      /* A missing field is only found at the END, so nothing is left */
+      skipping = in.err != in.msg;
+      if (in.err != BEGIN_BEFORE_END) {
+        break;
+      }
+    }
+  }
+  if (map) {
+    munmap((void *) map, map_len);
+  }
+  return 0;
+} // load_desc
+
+int load_monster_desc(const char *file, desc_set *s, uint32_t *skipped)
+{
+  return load_desc<monster_desc>(file, MONSTER_DESC_SEMANTIC,
+                                 "BEGIN MONSTER", monster_field_name,
+                                 num_monster_fields, s, skipped);
+} // load_monster_desc
+
+int load_object_desc(const char *file, desc_set *s, uint32_t *skipped)
+{
+  return load_desc<object_desc>(file, OBJECT_DESC_SEMANTIC, "BEGIN OBJECT",
+                                object_field_name, num_object_fields, s,
+                                skipped);
+} // load_object_desc
+
+/*
+ * Loads both description files (default MONSTER_DESC_FILE and
+ * OBJECT_DESC_FILE) and prints what was found in each and how long it
+ * took.  Returns 1 if either can't be read.
+ */
+int show_descriptions(const char *monster_file, const char *object_file)
+{
+  desc_set set;
+  uint64_t start, took;
+  uint32_t skipped;
+
+  monster_file = monster_file ? monster_file : MONSTER_DESC_FILE;
+  object_file = object_file ? object_file : OBJECT_DESC_FILE;
+
+  start = now_usec();
+  if (load_monster_desc(monster_file, &set, &skipped)) {
+    return 1;
+  }
+  took = now_usec() - start;
+  std::printf("%s: %zu monsters, %u skipped, %.1f ms\n", monster_file,
+              set.monsters.size(), skipped, took / 1000.0);
+
+  start = now_usec();
+  if (load_object_desc(object_file, &set, &skipped)) {
+    return 1;
+  }
+  took = now_usec() - start;
+  std::printf("%s: %zu objects, %u skipped, %.1f ms\n", object_file,
+              set.objects.size(), skipped, took / 1000.0);
+  return 0;
+} // show_descriptions
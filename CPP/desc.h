@@ -0,0 +1,116 @@
+#ifndef DESC_H
+#define DESC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+const char* const MONSTER_DESC_SEMANTIC = "RLG327 MONSTER DESCRIPTION 1";
+const char* const OBJECT_DESC_SEMANTIC = "RLG327 OBJECT DESCRIPTION 1";
+/* Longest line of a DESC */
+const uint32_t MAX_DESC_LINE = 77;
+
+/* A roll of base plus number dice of sides each, written 7+1d4 */
+struct dice {
+  int32_t base;
+  uint16_t number, sides;
+};
+
+enum monster_ability {
+  ability_smart   = 1 << 0,
+  ability_tele    = 1 << 1,
+  ability_tunnel  = 1 << 2,
+  ability_erratic = 1 << 3,
+  ability_pass    = 1 << 4,
+  ability_pickup  = 1 << 5,
+  ability_destroy = 1 << 6,
+  ability_uniq    = 1 << 7,
+  ability_boss    = 1 << 8
+};
+
+enum object_type {
+  object_weapon,
+  object_offhand,
+  object_ranged,
+  object_armor,
+  object_helmet,
+  object_cloak,
+  object_gloves,
+  object_boots,
+  object_ring,
+  object_amulet,
+  object_light,
+  object_scroll,
+  object_book,
+  object_flask,
+  object_gold,
+  object_ammunition,
+  object_food,
+  object_wand,
+  object_container,
+  num_object_types
+};
+
+/*
+ * Descriptions as parsed.  Strings point into the owning desc_set's
+ * arena; colors has bit n set for ncurses color n, and types bit n for
+ * object_type n.
+ */
+struct monster_desc {
+  const char *name, *desc;
+  dice speed, damage, hp;
+  uint16_t abilities;
+  uint8_t colors;
+  char symbol;
+  uint8_t rarity;
+  uint32_t line;            /* Of its BEGIN */
+};
+
+struct object_desc {
+  const char *name, *desc;
+  dice hit, damage, dodge, defence, weight, speed, attribute, value;
+  uint32_t types;
+  uint8_t colors;
+  bool artifact;
+  uint8_t rarity;
+  uint32_t line;
+};
+
+/*
+ * Storage for strings that lives as long as the arena, with each
+ * distinct string stored once.  Strings are carved from large blocks,
+ * so tens of thousands cost a handful of allocations.
+ */
+class string_arena {
+ private:
+  std::vector<char *> blocks;
+  char *next;
+  size_t left;
+  /* Open addressed, a power of two in size, never more than half full */
+  std::vector<const char *> table;
+  size_t count;
+
+  char *alloc(size_t len);
+  void grow(void);
+ public:
+  string_arena() : blocks(), next(nullptr), left(0), table(), count(0) {}
+  string_arena(const string_arena &) = delete;
+  string_arena &operator=(const string_arena &) = delete;
+  ~string_arena();
+
+  const char *intern(const char *s, size_t len);
+};
+
+/* Everything loaded from the description files */
+class desc_set {
+ public:
+  string_arena strings;
+  std::vector<monster_desc> monsters;
+  std::vector<object_desc> objects;
+};
+
+int load_monster_desc(const char *file, desc_set *s, uint32_t *skipped);
+int load_object_desc(const char *file, desc_set *s, uint32_t *skipped);
+int show_descriptions(const char *monster_file, const char *object_file);
+
+#endif
@@ -2,27 +2,166 @@
 #include <cstdlib>
 #include <string.h>
 #include <ctime>
+#include <errno.h>
+#include <string>
+#include <unistd.h>
 
+#include "brush.h"
+#include "convert.h"
+#include "corpus.h"
+#include "desc.h"
 #include "dungeon.h"
+#include "hash.h"
+#include "history.h"
+#include "image.h"
 #include "io.h"
+#include "journal.h"
+#include "metrics.h"
+#include "publish.h"
 #include "room.h"
+#include "save.h"
+#include "script.h"
+#include "serve.h"
+#include "similar.h"
+#include "stats.h"
+#include "utils.h"
+#include "world.h"
+
+/* Batch files are numbered with six digits */
+const uint32_t MAX_BATCH_COUNT = 999999;
 
 void usage(char *name)
 {
   std::fprintf(stderr,
-	       "Usage: %s [-l|--load [<file>]]\n",
+	       "Usage: %s [-l|--load [<file>]] [-b|--batch <count> [<dir>]]\n"
+	       "          [-s|--script <file>|-] [-r|--record <file>]\n"
+	       "          [-u|--undo-budget <bytes>] [-m|--smooth <passes>]\n"
+	       "          [-R|--recover [<file>]] [--stats [<src>]]\n"
+	       "          [-e|--export <kind> <src> [<dir>]] [--scale <n>]\n"
+	       "          [-c|--convert <format> <src> [<dir>]] [-j|--jobs <n>]\n"
+	       "          [-d|--dedupe <src> [<index>]] [--drop]\n"
+	       "          [-i|--index <src> <index>]\n"
+	       "          [--similar <file> <index>] [--top <n>]\n"
+	       "          [--serve <socket>] [--pool <n>] [--fetch <socket> [<file>]]\n"
+	       "          [--load-test <socket> <count>]\n"
+	       "          [--new-world <file> <width> <height>]\n"
+	       "          [--world <file> <x> <y>]\n"
+	       "          [--publish <name>] [--watch <name>]\n"
+	       "          [--desc [<monster file> [<object file>]]]\n",
 	       name);
   std::exit(EXIT_FAILURE);
 }
 
+/*
+ * Parses a whole decimal argument from min to max.  Returns 1 if it
+ * isn't one.
+ */
+static int parse_count(const char *s, uint32_t min, uint32_t max,
+                       uint32_t *v)
+{
+  unsigned long n;
+  char *end;
+
+  if (*s < '0' || *s > '9') {
+    return 1;
+  }
+  errno = 0;
+  n = strtoul(s, &end, 10);
+  if (*end || errno || n < min || n > max) {
+    return 1;
+  }
+  *v = n;
+  return 0;
+} // parse_count
+
+/*
+ * Generate count dungeons without a terminal and save each one
+ * to dir as dungeon_NNNNNN.  The wall hardness of each is smoothed
+ * with the given number of passes.
+ */
+int batch_generate(uint32_t count, const char *dir, uint32_t smooth)
+{
+  dungeon d;
+  uint32_t i;
+  uint64_t start, gen;
+  char name[32];
+  std::string path;
+
+  gen = 0;
+  for (i = 0; i < count; i++) {
+    start = now_usec();
+    gen_dungeon(&d);
+    smooth_hardness(&d, smooth);
+    gen += now_usec() - start;
+
+    std::snprintf(name, sizeof (name), "/%s_%06u", DUNGEON_SAVE_FILE, i);
+    path = dir;
+    path += name;
+    if (write_dungeon(&d, path.c_str(), false)) {
+      del_dungeon(&d);
+      return 1;
+    }
+  }
+  del_dungeon(&d);
+
+  std::fprintf(stderr, "Generated %u dungeons in %s, %.1f us per dungeon\n",
+               count, dir, count ? (double) gen / count : 0.0);
+
+  return 0;
+}
+
+/*
+ * Writes the timing histograms as JSON to stderr, which is free for
+ * it even when the editor had the terminal
+ */
+static void dump_stats(void)
+{
+  stats_dump(stderr);
+}
+
 int main(int argc, char *argv[])
 {
   dungeon d;
   uint32_t long_arg;
-  uint8_t i, load;
-  const char *load_file;
+  uint8_t i, load, batch, recover;
+  const char *load_file, *batch_dir, *script_file, *record_file;
+  const char *export_src, *export_dir, *convert_src, *convert_dir;
+  const char *dedupe_src, *dedupe_index;
+  const char *index_src, *index_file, *similar_file, *stats_src;
+  const char *serve_socket, *fetch_socket, *fetch_file, *test_socket;
+  const char *world_file, *new_world, *publish_name, *watch_name;
+  const char *monster_file, *object_file;
+  bool drop, desc;
+  uint32_t batch_count, seed, smooth, scale, jobs, top, pool, test_count;
+  uint32_t world_x, world_y;
+  image_kind kind;
+  map_format format;
+  size_t undo_budget;
+  int ret;
+  std::string save_msg, journal_file;
+  bool save_failed;
+  journal jrnl;
+  uint32_t replayed;
 
-  load = 0;
+  load = batch = recover = 0;
+  smooth = 0;
+  undo_budget = DEFAULT_HISTORY_BUDGET;
+  load_file = script_file = record_file = nullptr;
+  export_src = convert_src = dedupe_src = dedupe_index = nullptr;
+  export_dir = convert_dir = nullptr;
+  index_src = index_file = similar_file = stats_src = nullptr;
+  serve_socket = fetch_socket = fetch_file = test_socket = nullptr;
+  pool = DEFAULT_POOL_SIZE;
+  test_count = 0;
+  world_file = new_world = nullptr;
+  publish_name = watch_name = nullptr;
+  monster_file = object_file = nullptr;
+  desc = false;
+  world_x = world_y = 0;
+  drop = false;
+  top = DEFAULT_SIMILAR_TOP;
+  scale = DEFAULT_IMAGE_SCALE;
+  jobs = default_jobs();
   
   if(argc > 1) {
     for (i = 1, long_arg = 0; i < argc; i++, long_arg = 0) {
@@ -31,8 +170,22 @@ int main(int argc, char *argv[])
 	  argv[i]++;    /* Make the argument have a single dash so we can */
 	  long_arg = 1; /* handle long and short args at the same place.  */
 	}
+	/* --recover starts with the same letter as --record */
+	if(long_arg && !strcmp(argv[i], "-recover")) {
+	  argv[i] = (char *) "-R";
+	  long_arg = 0;
+	}
 	switch(argv[i][1]) {
 	case 'l':
+	  if (long_arg && !strcmp(argv[i], "-load-test")) {
+	    if (argc <= i + 2 ||
+		parse_count(argv[i + 2], 1, UINT32_MAX, &test_count)) {
+	      usage(argv[0]);
+	    }
+	    test_socket = argv[i + 1];
+	    i += 2;
+	    break;
+	  }
 	  if ((!long_arg && argv[i][2]) ||
 	      (long_arg && strcmp(argv[i], "-load"))) {
 	    usage(argv[0]);
@@ -46,6 +199,221 @@ int main(int argc, char *argv[])
 	    load_file = nullptr;
 	  }
 	  break;
+	case 'R':
+	  if (argv[i][2]) {
+	    usage(argv[0]);
+	  }
+	  load = recover = 1;
+	  if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	    load_file = argv[++i];
+	  } else {
+	    load_file = nullptr;
+	  }
+	  break;
+	case 'b':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-batch")) ||
+	      argc <= i + 1 ||
+	      parse_count(argv[++i], 1, MAX_BATCH_COUNT, &batch_count)) {
+	    usage(argv[0]);
+	  }
+	  batch = 1;
+	  if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	    batch_dir = argv[++i];
+	  } else {
+	    batch_dir = ".";
+	  }
+	  break;
+	case 's':
+	  if (long_arg && !strcmp(argv[i], "-stats")) {
+	    if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	      /* Measure the dungeons in a directory or archive */
+	      stats_src = argv[++i];
+	      break;
+	    }
+	    /* Time the hot paths and dump the histograms on exit */
+	    stats_enabled = true;
+	    std::atexit(dump_stats);
+	    break;
+	  }
+	  if (long_arg && !strcmp(argv[i], "-scale")) {
+	    if (argc <= i + 1 || !(scale = atoi(argv[++i])) ||
+		scale > MAX_IMAGE_SCALE) {
+	      usage(argv[0]);
+	    }
+	    break;
+	  }
+	  if (long_arg && !strcmp(argv[i], "-serve")) {
+	    if (argc <= i + 1) {
+	      usage(argv[0]);
+	    }
+	    serve_socket = argv[++i];
+	    break;
+	  }
+	  if (long_arg && !strcmp(argv[i], "-similar")) {
+	    if (argc <= i + 2) {
+	      usage(argv[0]);
+	    }
+	    similar_file = argv[++i];
+	    index_file = argv[++i];
+	    break;
+	  }
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-script")) ||
+	      argc <= i + 1) {
+	    usage(argv[0]);
+	  }
+	  script_file = argv[++i];
+	  break;
+	case 'r':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-record")) ||
+	      argc <= i + 1) {
+	    usage(argv[0]);
+	  }
+	  record_file = argv[++i];
+	  break;
+	case 'u':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-undo-budget")) ||
+	      argc <= i + 1) {
+	    usage(argv[0]);
+	  }
+	  undo_budget = strtoull(argv[++i], nullptr, 0);
+	  break;
+	case 'm':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-smooth")) ||
+	      argc <= i + 1 ||
+	      parse_count(argv[++i], 0, MAX_SMOOTH_PASSES, &smooth)) {
+	    usage(argv[0]);
+	  }
+	  break;
+	case 'e':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-export")) ||
+	      argc <= i + 2 || parse_image_kind(argv[i + 1], &kind)) {
+	    usage(argv[0]);
+	  }
+	  export_src = argv[i + 2];
+	  i += 2;
+	  if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	    export_dir = argv[++i];
+	  } else {
+	    export_dir = ".";
+	  }
+	  break;
+	case 'c':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-convert")) ||
+	      argc <= i + 2 || parse_map_format(argv[i + 1], &format)) {
+	    usage(argv[0]);
+	  }
+	  convert_src = argv[i + 2];
+	  i += 2;
+	  if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	    convert_dir = argv[++i];
+	  } else {
+	    convert_dir = ".";
+	  }
+	  break;
+	case 'd':
+	  if (long_arg && !strcmp(argv[i], "-desc")) {
+	    desc = true;
+	    if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	      monster_file = argv[++i];
+	      if ((argc > i + 1) && argv[i + 1][0] != '-') {
+		object_file = argv[++i];
+	      }
+	    }
+	    break;
+	  }
+	  if (long_arg && !strcmp(argv[i], "-drop")) {
+	    drop = true;
+	    break;
+	  }
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-dedupe")) ||
+	      argc <= i + 1) {
+	    usage(argv[0]);
+	  }
+	  dedupe_src = argv[++i];
+	  if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	    dedupe_index = argv[++i];
+	  }
+	  break;
+	case 'i':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-index")) ||
+	      argc <= i + 2) {
+	    usage(argv[0]);
+	  }
+	  index_src = argv[++i];
+	  index_file = argv[++i];
+	  break;
+	case 't':
+	  if (!long_arg || strcmp(argv[i], "-top") ||
+	      argc <= i + 1 || !(top = atoi(argv[++i]))) {
+	    usage(argv[0]);
+	  }
+	  break;
+	case 'f':
+	  if (!long_arg || strcmp(argv[i], "-fetch") || argc <= i + 1) {
+	    usage(argv[0]);
+	  }
+	  fetch_socket = argv[++i];
+	  if ((argc > i + 1) && argv[i + 1][0] != '-') {
+	    fetch_file = argv[++i];
+	  } else {
+	    fetch_file = DUNGEON_SAVE_FILE;
+	  }
+	  break;
+	case 'p':
+	  if (long_arg && !strcmp(argv[i], "-publish")) {
+	    if (argc <= i + 1) {
+	      usage(argv[0]);
+	    }
+	    publish_name = argv[++i];
+	    break;
+	  }
+	  if (!long_arg || strcmp(argv[i], "-pool") ||
+	      argc <= i + 1 ||
+	      parse_count(argv[++i], 1, MAX_POOL_SIZE, &pool)) {
+	    usage(argv[0]);
+	  }
+	  break;
+	case 'n':
+	  if (!long_arg || strcmp(argv[i], "-new-world") || argc <= i + 3 ||
+	      parse_count(argv[i + 2], 1, MAX_WORLD_SIZE, &world_x) ||
+	      parse_count(argv[i + 3], 1, MAX_WORLD_SIZE, &world_y)) {
+	    usage(argv[0]);
+	  }
+	  new_world = argv[i + 1];
+	  i += 3;
+	  break;
+	case 'w':
+	  if (long_arg && !strcmp(argv[i], "-watch")) {
+	    if (argc <= i + 1) {
+	      usage(argv[0]);
+	    }
+	    watch_name = argv[++i];
+	    break;
+	  }
+	  if (!long_arg || strcmp(argv[i], "-world") || argc <= i + 3 ||
+	      parse_count(argv[i + 2], 0, MAX_WORLD_SIZE - 1, &world_x) ||
+	      parse_count(argv[i + 3], 0, MAX_WORLD_SIZE - 1, &world_y)) {
+	    usage(argv[0]);
+	  }
+	  world_file = argv[i + 1];
+	  i += 3;
+	  break;
+	case 'j':
+	  if ((!long_arg && argv[i][2]) ||
+	      (long_arg && strcmp(argv[i], "-jobs")) ||
+	      argc <= i + 1 || parse_count(argv[++i], 1, MAX_JOBS, &jobs)) {
+	    usage(argv[0]);
+	  }
+	  break;
 	default:
 	  usage(argv[0]);
 	}     
@@ -54,20 +422,161 @@ int main(int argc, char *argv[])
       }
     }
   }
+
+  /* A world window replaces the loaded dungeon, so they can't mix; *
+   * --recover restores the window from its own journal              */
+  if(world_file && (load_file || (load && !recover))) {
+    usage(argv[0]);
+  }
   
-  std::srand(std::time(nullptr));
-  
-  io_init_terminal();
-  if(load) {
-    read_dungeon(&d, load_file);
+  seed = std::time(nullptr);
+  std::srand(seed);
+
+  history hist(undo_budget);
+  d.hist = &hist;
+
+  if(batch) {
+    return batch_generate(batch_count, batch_dir, smooth) ? EXIT_FAILURE : 0;
+  }
+
+  if(export_src) {
+    return export_images(export_src, export_dir, kind, scale, jobs) ?
+      EXIT_FAILURE : 0;
+  }
+
+  if(convert_src) {
+    return convert_files(convert_src, convert_dir, format, jobs) ?
+      EXIT_FAILURE : 0;
+  }
+
+  if(dedupe_src) {
+    return dedupe_files(dedupe_src, dedupe_index, drop, jobs) ?
+      EXIT_FAILURE : 0;
+  }
+
+  if(index_src) {
+    return build_similar_index(index_src, index_file, jobs) ?
+      EXIT_FAILURE : 0;
+  }
+
+  if(similar_file) {
+    return find_similar(similar_file, index_file, top) ? EXIT_FAILURE : 0;
+  }
+
+  if(stats_src) {
+    return stats_files(stats_src, jobs) ? EXIT_FAILURE : 0;
+  }
+
+  if(serve_socket) {
+    return serve_dungeons(serve_socket, pool, jobs, smooth) ? EXIT_FAILURE : 0;
+  }
+
+  if(fetch_socket) {
+    return fetch_dungeon(fetch_socket, fetch_file) ? EXIT_FAILURE : 0;
+  }
+
+  if(test_socket) {
+    return load_test(test_socket, test_count, jobs) ? EXIT_FAILURE : 0;
+  }
+
+  if(desc) {
+    return show_descriptions(monster_file, object_file) ? EXIT_FAILURE : 0;
+  }
+
+  if(watch_name) {
+    return watch_link(watch_name) ? EXIT_FAILURE : 0;
+  }
+
+  if(new_world) {
+    world w;
+
+    return w.create(new_world, world_x, world_y) ? EXIT_FAILURE : 0;
+  }
+
+  /* Edit a dungeon sized window of a world, written back at the end */
+  world w;
+  if(world_file &&
+     (w.open(world_file) || load_window(&w, &d, world_x, world_y))) {
+    return EXIT_FAILURE;
+  }
+
+  if(script_file) {
+    /* Headless, apply the script and exit */
+    if(load && !world_file) {
+      read_dungeon(&d, load_file);
+    } else if(!world_file) {
+      init_dungeon(&d);
+    }
+    ret = run_script(&d, script_file);
+    if(world_file) {
+      ret |= store_window(&w, &d, world_x, world_y) || w.flush();
+      std::fprintf(stderr, "%s: %llu tiles read, %llu written\n", world_file,
+		   (unsigned long long) w.tiles_read,
+		   (unsigned long long) w.tiles_written);
+    }
+    del_dungeon(&d);
+    return ret ? EXIT_FAILURE : 0;
+  }
+
+  /* Edits are journaled next to the save file, or the world, until *
+   * a clean exit, so a journal left over means the last session      *
+   * crashed.                                                         */
+  if(world_file) {
+    journal_file = window_journal_path(world_file, world_x, world_y);
   } else {
+    journal_file = journal_path(load ? load_file : nullptr);
+  }
+  if(recover) {
+    if(recover_journal(&d, journal_file, &replayed)) {
+      return EXIT_FAILURE;
+    }
+    std::fprintf(stderr, "Recovered %s, %u edits replayed\n",
+		 journal_file.c_str(), replayed);
+  } else if(!access(journal_file.c_str(), F_OK)) {
+    std::fprintf(stderr,
+		 "%s exists, so the last session didn't exit cleanly.\n"
+		 "Run with --recover to restore its edits, or delete it.\n",
+		 journal_file.c_str());
+    return EXIT_FAILURE;
+  } else if(load) {
+    read_dungeon(&d, load_file);
+  } else if(!world_file) {
     init_dungeon(&d);
   }
+  if(jrnl.start(&d, journal_file)) {
+    std::perror(journal_file.c_str());
+    return EXIT_FAILURE;
+  }
+  d.jrnl = &jrnl;
+
+  if(record_file && open_record(record_file, seed, load, load_file)) {
+    return EXIT_FAILURE;
+  }
+  /* Games following the link see the dungeon from the start */
+  if(publish_name) {
+    if(publish_open(publish_name)) {
+      return EXIT_FAILURE;
+    }
+    publish_update(&d);
+  }
   
+  io_init_terminal();
   io_display(&d);
   io_mainloop(&d);
   
   io_reset_terminal();
+  publish_close();
+  if(world_file &&
+     (store_window(&w, &d, world_x, world_y) || w.flush())) {
+    /* Keep the journal, so the edits can still be recovered */
+    del_dungeon(&d);
+    return EXIT_FAILURE;
+  }
+  jrnl.discard();
+  if(save_wait(save_msg, &save_failed) && save_failed) {
+    std::fprintf(stderr, "%s\n", save_msg.c_str());
+  }
+  close_record();
   del_dungeon(&d);
   
   return 0;
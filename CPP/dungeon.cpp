@@ -1,14 +1,22 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <vector>
 
 #include "dungeon.h"
+#include "history.h"
+#include "journal.h"
+#include "path.h"
 #include "room.h"
+#include "stats.h"
 #include "utils.h"
 
 /*
@@ -18,6 +26,7 @@
 void init_dungeon(dungeon *d)
 {
   uint8_t x, x_max, y, y_max;
+  STATS(stat_init_dungeon);
 
   x_max = DUNGEON_X - 1;
   y_max = DUNGEON_Y - 1;
@@ -34,6 +43,7 @@ void init_dungeon(dungeon *d)
     }
   }
   (*d).set_curs(40, 10);
+  (*d).mark_all_dirty();
 }
 
 /*
@@ -46,8 +56,355 @@ void del_dungeon(dungeon *d)
   for(i = 0; i < d->rooms.size(); i++) {
     delete d->rooms[i];
   }
+  d->rooms.clear();
 }
 
+/*
+ * Check if there is a room in the given area
+ * There must be a padding of 1 tile between rooms
+ */
+bool room_present(dungeon *d, uint8_t x, uint8_t y, uint8_t xrng, uint8_t yrng)
+{
+  uint8_t i, j;
+  STATS(stat_room_present);
+
+  for(j = (y - 1); j < (y + yrng + 1); j++) {
+    for(i = (x - 1); i < (x + xrng + 1); i++) {
+      if(dmapxy(i, j) == ter_floor_room) {
+	return true;
+      }
+    }
+  }
+  return false;
+} // room_present
+
+/*
+ * Changes one cell of the dungeon.  All edits go through here so
+ * the changed cells get redrawn, can be undone and are journaled.
+ */
+void set_cell(dungeon *d, uint8_t x, uint8_t y, terrain_type t, uint8_t h)
+{
+  if(d->hist) {
+    (*d->hist).record_cell(y * DUNGEON_X + x, dmapxy(x, y), hmapxy(x, y), t, h);
+  }
+  if(d->jrnl) {
+    (*d->jrnl).record_cell(y * DUNGEON_X + x, t, h);
+  }
+  dmapxy(x, y) = t;
+  hmapxy(x, y) = h;
+  (*d).mark_dirty(x, y);
+} // set_cell
+
+/*
+ * Places a corridor tile.  Returns 1 over rooms and the border.
+ */
+int add_corridor(dungeon *d, uint8_t x, uint8_t y)
+{
+  if(dmapxy(x, y) == ter_wall_immutable || dmapxy(x, y) == ter_floor_room) {
+    return 1;
+  }
+  set_cell(d, x, y, ter_floor_hall, 0);
+  return 0;
+} // add_corridor
+
+/*
+ * Places a wall tile of random hardness.  Returns 1 over rooms and
+ * the border.
+ */
+int add_wall(dungeon *d, uint8_t x, uint8_t y)
+{
+  if(dmapxy(x, y) == ter_wall_immutable || dmapxy(x, y) == ter_floor_room) {
+    return 1;
+  }
+  set_cell(d, x, y, ter_wall, rand_range(1, (MAX_HARDNESS_VALUE - 1)));
+  return 0;
+} // add_wall
+
+/*
+ * Whether bulk fills may change a cell.  Like single tile edits they
+ * leave rooms and the border alone.
+ */
+bool fillable(dungeon *d, uint8_t x, uint8_t y)
+{
+  return dmapxy(x, y) != ter_wall_immutable && dmapxy(x, y) != ter_floor_room;
+} // fillable
+
+/*
+ * The hardness every cell of a fill with t gets, one random value for
+ * walls.  Only call it once the fill is sure to happen, so the random
+ * numbers drawn match between a session and its recording.
+ */
+uint8_t fill_hardness(terrain_type t)
+{
+  return t == ter_wall ? rand_range(1, (MAX_HARDNESS_VALUE - 1)) : 0;
+} // fill_hardness
+
+/*
+ * Sets a run of len cells in one row to the same terrain and hardness.
+ * The row is written with memset rather than a set_cell per cell, and
+ * marked dirty once.
+ */
+static void set_span(dungeon *d, uint8_t x, uint8_t y, uint8_t len,
+		     terrain_type t, uint8_t h)
+{
+  uint8_t i;
+
+  if(d->hist) {
+    for(i = x; i < x + len; i++) {
+      (*d->hist).record_cell(y * DUNGEON_X + i, dmapxy(i, y), hmapxy(i, y), t, h);
+    }
+  }
+  if(d->jrnl) {
+    for(i = x; i < x + len; i++) {
+      (*d->jrnl).record_cell(y * DUNGEON_X + i, t, h);
+    }
+  }
+  memset(&dmapxy(x, y), t, len);
+  memset(&hmapxy(x, y), h, len);
+  (*d).mark_dirty(x, y, len, 1);
+} // set_span
+
+/*
+ * Sets every fillable cell of a rectangle to the given terrain and
+ * hardness.  Returns the number of cells filled.
+ */
+uint32_t fill_rect(dungeon *d, uint8_t x, uint8_t y, uint8_t xsize,
+		   uint8_t ysize, terrain_type t, uint8_t h)
+{
+  uint8_t i, j, x0;
+  uint32_t filled;
+
+  filled = 0;
+  for(j = y; j < y + ysize && j < DUNGEON_Y; j++) {
+    for(i = x; i < x + xsize && i < DUNGEON_X; ) {
+      /* Fill each run of fillable cells in the row at once */
+      for(x0 = i; i < x + xsize && i < DUNGEON_X && fillable(d, i, j); i++)
+	;
+      if(i > x0) {
+	set_span(d, x0, j, i - x0, t, h);
+	filled += i - x0;
+      } else {
+	i++;
+      }
+    }
+  }
+  return filled;
+} // fill_rect
+
+/*
+ * Scanline flood fill.  Sets the region of cells sharing the terrain
+ * at x, y (4-connected) to the given terrain and hardness, a whole row
+ * span at a time.  Each span seeds the spans touching it in the rows
+ * above and below.  Returns the number of cells filled.
+ */
+uint32_t flood_fill(dungeon *d, uint8_t x, uint8_t y, terrain_type t,
+		    uint8_t h)
+{
+  bool seen[DUNGEON_Y][DUNGEON_X];
+  std::vector<uint16_t> seeds;
+  terrain_type match;
+  uint8_t x0, x1, i, ny;
+  uint32_t filled;
+
+  if(!fillable(d, x, y)) {
+    return 0;
+  }
+  match = dmapxy(x, y);
+  memset(seen, 0, sizeof (seen));
+  filled = 0;
+
+  seeds.push_back(cellidx(x, y));
+  while(!seeds.empty()) {
+    x = cellx(seeds.back());
+    y = celly(seeds.back());
+    seeds.pop_back();
+    if(seen[y][x]) {
+      continue;
+    }
+
+    /* The border never matches, so spans stop before leaving the map */
+    for(x0 = x; dmapxy(x0 - 1, y) == match && !seen[y][x0 - 1]; x0--)
+      ;
+    for(x1 = x + 1; dmapxy(x1, y) == match && !seen[y][x1]; x1++)
+      ;
+    memset(&seen[y][x0], true, x1 - x0);
+    set_span(d, x0, y, x1 - x0, t, h);
+    filled += x1 - x0;
+
+    /* Seed the start of each unfilled run above and below the span */
+    for(ny = y - 1; ny <= y + 1; ny += 2) {
+      for(i = x0; i < x1; i++) {
+	if(dmapxy(i, ny) == match && !seen[ny][i] &&
+	   (i == x0 || dmapxy(i - 1, ny) != match || seen[ny][i - 1])) {
+	  seeds.push_back(cellidx(i, ny));
+	}
+      }
+    }
+  }
+  return filled;
+} // flood_fill
+
+/*
+ * Adds a room if it fits inside the border without touching another
+ * room and the room limit isn't reached.  Returns 1 otherwise.
+ */
+int add_room(dungeon *d, uint8_t x, uint8_t y, uint8_t xsize, uint8_t ysize)
+{
+  uint8_t i, j;
+
+  if(d->rooms.size() >= MAX_ROOM_COUNT           ||
+     xsize < MIN_ROOM_XSIZE || ysize < MIN_ROOM_YSIZE ||
+     x < 1 || y < 1                              ||
+     x + xsize >= DUNGEON_X || y + ysize >= DUNGEON_Y ||
+     room_present(d, x, y, xsize, ysize)) {
+    return 1;
+  }
+  d->rooms.push_back(new room(x, y, xsize, ysize));
+  if(d->hist) {
+    (*d->hist).record_room(1, d->rooms.back());
+  }
+  if(d->jrnl) {
+    (*d->jrnl).record_room(1, d->rooms.back());
+  }
+  for(j = y; j < y + ysize; j++) {
+    for(i = x; i < x + xsize; i++) {
+      set_cell(d, i, j, ter_floor_room, 0);
+    }
+  }
+  return 0;
+} // add_room
+
+/*
+ * Deletes the room containing x, y, filling it back in with walls.
+ * Returns 1 if there is no room there.
+ */
+int remove_room(dungeon *d, uint8_t x, uint8_t y)
+{
+  uint8_t i, j;
+  uint32_t n;
+  room *r;
+
+  for(n = 0; n < d->rooms.size(); n++) {
+    if((*d->rooms[n]).contains(x, y)) {
+      r = d->rooms[n];
+      if(d->hist) {
+	(*d->hist).record_room(0, r);
+      }
+      if(d->jrnl) {
+	(*d->jrnl).record_room(0, r);
+      }
+      for(j = (*r).get_y(); j < (*r).get_y() + (*r).get_ysize(); j++) {
+	for(i = (*r).get_x(); i < (*r).get_x() + (*r).get_xsize(); i++) {
+	  set_cell(d, i, j, ter_wall, rand_range(1, (MAX_HARDNESS_VALUE - 1)));
+	}
+      }
+      d->rooms.erase(d->rooms.begin() + n);
+      delete r;
+      return 0;
+    }
+  }
+  return 1;
+} // remove_room
+
+/*
+ * Moves the PC.  Returns 1 unless x, y is a floor cell.
+ */
+int move_pc(dungeon *d, uint8_t x, uint8_t y)
+{
+  if(dmapxy(x, y) <= ter_wall_immutable) {
+    return 1;
+  }
+  if(d->hist) {
+    (*d->hist).record_pc((*d).get_pcx(), (*d).get_pcy(), x, y);
+  }
+  if(d->jrnl) {
+    (*d->jrnl).record_pc(x, y);
+  }
+  (*d).set_pc(x, y);
+  return 0;
+} // move_pc
+
+/*
+ * Orders rooms left to right so corridors between neighbors stay short
+ */
+static bool room_left_of(room *a, room *b)
+{
+  return (*a).get_x() < (*b).get_x();
+}
+
+/*
+ * Digs an L shaped corridor between the centers of two rooms
+ */
+static void dig_corridor(dungeon *d, room *from, room *to)
+{
+  uint8_t x, y, x_end, y_end;
+
+  x = (*from).get_x() + ((*from).get_xsize() >> 1);
+  y = (*from).get_y() + ((*from).get_ysize() >> 1);
+  x_end = (*to).get_x() + ((*to).get_xsize() >> 1);
+  y_end = (*to).get_y() + ((*to).get_ysize() >> 1);
+
+  while(x != x_end || y != y_end) {
+    if(x != x_end) {
+      x += (x < x_end) ? 1 : -1;
+    } else {
+      y += (y < y_end) ? 1 : -1;
+    }
+    if(dmapxy(x, y) == ter_wall) {
+      dmapxy(x, y) = ter_floor_hall;
+      hmapxy(x, y) = 0;
+    }
+  }
+}
+
+/*
+ * Generates a random dungeon.  Rooms are scattered over the map and
+ * joined by corridors, the PC starts in the leftmost room and the
+ * stairs are placed as far from the PC and each other as possible.
+ */
+void gen_dungeon(dungeon *d)
+{
+  uint32_t tries, num_rooms;
+  uint8_t i, j, x, y, xsize, ysize;
+  room *r;
+
+  del_dungeon(d);
+  init_dungeon(d);
+
+  num_rooms = rand_range(MIN_ROOM_COUNT, (MIN_ROOM_COUNT + MAX_ROOM_COUNT) / 2);
+  for(tries = 0; d->rooms.size() < num_rooms && tries < 2000; tries++) {
+    xsize = rand_range(MIN_ROOM_XSIZE + 1, 14);
+    ysize = rand_range(MIN_ROOM_YSIZE + 1, 6);
+    x = rand_range(1, DUNGEON_X - 1 - xsize);
+    y = rand_range(1, DUNGEON_Y - 1 - ysize);
+    if(room_present(d, x, y, xsize, ysize)) {
+      continue;
+    }
+    d->rooms.push_back(new room(x, y, xsize, ysize));
+    for(j = y; j < y + ysize; j++) {
+      for(i = x; i < x + xsize; i++) {
+	dmapxy(i, j) = ter_floor_room;
+	hmapxy(i, j) = 0;
+      }
+    }
+  }
+
+  std::sort(d->rooms.begin(), d->rooms.end(), room_left_of);
+  for(i = 1; i < d->rooms.size(); i++) {
+    dig_corridor(d, d->rooms[i - 1], d->rooms[i]);
+  }
+
+  if(d->rooms.empty()) {
+    return;
+  }
+  r = d->rooms[0];
+  (*d).set_pc(rand_range((*r).get_x(), (*r).get_x() + (*r).get_xsize() - 1),
+	      rand_range((*r).get_y(), (*r).get_y() + (*r).get_ysize() - 1));
+  (*d).set_curs((*d).get_pcx(), (*d).get_pcy());
+
+  place_stairs(d);
+} // gen_dungeon
+
 /*
  * Checks dungeon for compliance issues
  */
@@ -55,6 +412,8 @@ void get_warnings(dungeon *d, std::vector<const char *>& warnings)
 {  
   if(!(*d).get_pcx() || !(*d).get_pcy()) {
     warnings.push_back("PC not yet placed into the dungeon");
+  } else if(dmapxy((*d).get_pcx(), (*d).get_pcy()) < ter_floor) {
+    warnings.push_back("PC is in rock and won't be saved");
   }
   if(d->rooms.size() < MIN_ROOM_COUNT) {
     warnings.push_back("Minimum room count not reached");
@@ -62,128 +421,269 @@ void get_warnings(dungeon *d, std::vector<const char *>& warnings)
 } // get_warnings
 
 /*
- * Writes hardness values to the dungeon
+ * Appends the hardness values to the save buffer
  */
-int write_dungeon_map(dungeon *d, FILE *f)
+int write_dungeon_map(dungeon *d, std::vector<uint8_t>& buf)
 {
-  uint32_t x, y;
-
-  for (y = 0; y < DUNGEON_Y; y++) {
-    for (x = 0; x < DUNGEON_X; x++) {
-      fwrite(&hmapxy(x, y), sizeof (unsigned char), 1, f);
-    }
-  }
+  buf.insert(buf.end(), &hmapxy(0, 0), &hmapxy(0, 0) + DUNGEON_X * DUNGEON_Y);
   return 0;
 }
 
 /*
- * Writes room data to the file given
+ * Appends the room data to the save buffer
  */
-int write_rooms(dungeon *d, FILE *f)
+int write_rooms(dungeon *d, std::vector<uint8_t>& buf)
 {
   uint32_t i;
-  uint8_t p;
 
   for (i = 0; i < d->rooms.size(); i++) {
     /* write order is xpos, ypos, width, height */
-    p = (*d->rooms[i]).get_x();
-    fwrite(&p, 1, 1, f);
-    p = (*d->rooms[i]).get_y();
-    fwrite(&p, 1, 1, f);
-    p = (*d->rooms[i]).get_xsize();
-    fwrite(&p, 1, 1, f);
-    p = (*d->rooms[i]).get_ysize();
-    fwrite(&p, 1, 1, f);
+    buf.push_back((*d->rooms[i]).get_x());
+    buf.push_back((*d->rooms[i]).get_y());
+    buf.push_back((*d->rooms[i]).get_xsize());
+    buf.push_back((*d->rooms[i]).get_ysize());
   }
   return 0;
 }
 
+/*
+ * Rebuilds the room list from the room floor, for maps that keep cells
+ * but not rooms.  Rooms are cut out the way text maps are: greedily,
+ * right then down.  Pieces too small to be rooms are left as they are.
+ */
+void find_rooms(dungeon *d)
+{
+  bool used[DUNGEON_Y][DUNGEON_X];
+  uint32_t x, y, w, h, i;
+
+  memset(used, 0, sizeof (used));
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (dmapxy(x, y) != ter_floor_room || used[y][x]) {
+        continue;
+      }
+      for (w = 1; dmapxy(x + w, y) == ter_floor_room && !used[y][x + w]; w++)
+        ;
+      for (h = 1; h < DUNGEON_Y - 1 - y; h++) {
+        for (i = 0; i < w && dmapxy(x + i, y + h) == ter_floor_room &&
+                    !used[y + h][x + i]; i++)
+          ;
+        if (i < w) {
+          break;
+        }
+      }
+      for (i = 0; i < h; i++) {
+        memset(&used[y + i][x], true, w);
+      }
+      if (w >= MIN_ROOM_XSIZE && h >= MIN_ROOM_YSIZE) {
+        d->rooms.push_back(new room(x, y, w, h));
+      }
+    }
+  }
+} // find_rooms
+
+/*
+ * Finds the up and down stairs.  Returns 1 if the dungeon has both.
+ */
+int find_stairs(dungeon *d, uint8_t stairs[4])
+{
+  uint8_t x, y;
+
+  std::memset(stairs, 0, 4);
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (dmapxy(x, y) == ter_stairs_up) {
+        stairs[0] = x;
+        stairs[1] = y;
+      } else if (dmapxy(x, y) == ter_stairs_down) {
+        stairs[2] = x;
+        stairs[3] = y;
+      }
+    }
+  }
+  return stairs[0] && stairs[2];
+}
+
 /*
  * Calculates size to write to file
  */
-uint32_t calculate_dungeon_size(dungeon *d)
+uint32_t calculate_dungeon_size(dungeon *d, int stairs)
 {
   return (22 /* The semantic, version, size, and PC position*/ +
           (DUNGEON_X * DUNGEON_Y) /* The hardnesses         */ +
-          (d->rooms.size() * 4)   /* Four bytes per room    */ );
+          (d->rooms.size() * 4)   /* Four bytes per room    */ +
+          (stairs ? 4 : 0)        /* Up and down stairs     */ );
 }
 
 /*
- * Writes dungeon data to disc
+ * Serializes the dungeon into buf in the save file format.  The
+ * buffer is a snapshot; saving it doesn't need the dungeon any more.
  */
-int write_dungeon(dungeon *d, const char *file)
+void encode_dungeon(dungeon *d, std::vector<uint8_t>& buf)
 {
-  char *home;
-  char *filename;
-  FILE *f;
-  size_t len;
   uint32_t be32;
-  uint8_t i;
+  uint8_t stairs[4];
+  int has_stairs;
 
-  if (!file) {
-    home = (char *) ".";
-    len = (strlen(home) + strlen(DUNGEON_SAVE_FILE) +
-           1 /* The NULL terminator */              +
-           2 /* The slashes */);
+  buf.clear();
+  has_stairs = find_stairs(d, stairs);
+  buf.reserve(calculate_dungeon_size(d, has_stairs));
 
-    filename = (char *) std::malloc(len * sizeof (*filename));
-    sprintf(filename, "%s/%s", home, DUNGEON_SAVE_FILE);
+  /* The semantic, which is 12 bytes, 0-11 */
+  buf.insert(buf.end(), DUNGEON_SAVE_SEMANTIC,
+             DUNGEON_SAVE_SEMANTIC + strlen(DUNGEON_SAVE_SEMANTIC));
 
-    if (!(f = fopen(filename, "w"))) {
-      std::perror(filename);
-      std::free(filename);
+  /* The version, 4 bytes, 12-15.  Version 0 files stay readable by *
+   * older games, so only bump the version when there are stairs.   */
+  be32 = htobe32(has_stairs ? DUNGEON_SAVE_VERSION_STAIRS :
+                              DUNGEON_SAVE_VERSION);
+  buf.insert(buf.end(), (uint8_t *) &be32, (uint8_t *) &be32 + 4);
 
-      return 1;
-    }
-    std::free(filename);
+  /* The size of the file, 4 bytes, 16-19 */
+  be32 = htobe32(calculate_dungeon_size(d, has_stairs));
+  buf.insert(buf.end(), (uint8_t *) &be32, (uint8_t *) &be32 + 4);
+
+  /* The PC position, 2 bytes, 20-21.  A PC walled in after it was *
+   * placed isn't saved, as loading only takes a PC on the floor.  */
+  if (dmapxy((*d).get_pcx(), (*d).get_pcy()) >= ter_floor) {
+    buf.push_back((*d).get_pcx());
+    buf.push_back((*d).get_pcy());
   } else {
-    if (!(f = fopen(file, "w"))) {
-      std::perror(file);
-      std::exit(EXIT_FAILURE);
-    }
+    buf.push_back(0);
+    buf.push_back(0);
   }
 
-  /* The semantic, which is 12 bytes, 0-11 */
-  fwrite(DUNGEON_SAVE_SEMANTIC, 1, strlen(DUNGEON_SAVE_SEMANTIC), f);
-  
-  /* The version, 4 bytes, 12-15 */
-  be32 = htobe32(DUNGEON_SAVE_VERSION);
-  fwrite(&be32, sizeof (be32), 1, f);
-
-  /* The size of the file, 4 bytes, 16-19 */
-  be32 = htobe32(calculate_dungeon_size(d));
-  fwrite(&be32, sizeof (be32), 1, f);
-  
-  /* The PC position, 2 bytes, 20-21 */
-  i = (*d).get_pcx();
-  fwrite(&i, 1, 1, f);
-  i = (*d).get_pcy();
-  fwrite(&i, 1, 1, f);
-  
   /* The dungeon map, 1680 bytes, 22-1702 */
-  write_dungeon_map(d, f);
-  
+  write_dungeon_map(d, buf);
+
   /* And the rooms, num_rooms * 4 bytes, 1703-end */
-  write_rooms(d, f);
+  write_rooms(d, buf);
+
+  /* Version 1 ends with the up and down stairs positions, 4 bytes */
+  if (has_stairs) {
+    buf.insert(buf.end(), stairs, stairs + 4);
+  }
+}
+
+/*
+ * The path a save goes to, ./dungeon unless a file is given
+ */
+std::string save_path(const char *file)
+{
+  std::string path;
+
+  if (file) {
+    return file;
+  }
+  path = "./";
+  path += DUNGEON_SAVE_FILE;
+  return path;
+}
+
+/*
+ * Writes an encoded dungeon to disc.  The data goes to a temporary
+ * file that is renamed over the save, so a crash or full disk never
+ * leaves a partly written save behind.  The temporary file has a
+ * unique name, so saves racing to the same file never share it, and
+ * takes the mode of the save it replaces.  Durable writes are also
+ * synced before the rename and after it; bulk output that can be
+ * regenerated skips that.  Returns 1 and sets errno on failure.
+ */
+int write_save_file(const char *file, const std::vector<uint8_t>& buf,
+                    bool durable)
+{
+  std::string tmp, dir;
+  struct stat st;
+  mode_t mode;
+  size_t done;
+  ssize_t n;
+  int fd, err;
+
+  mode = stat(file, &st) ? 0644 : st.st_mode & 07777;
+  /* .tmp marks it for corpus::open to skip while it's being written */
+  tmp = file;
+  tmp += ".tmpXXXXXX";
+  if ((fd = mkstemp(&tmp[0])) < 0) {
+    return 1;
+  }
+  if (fchmod(fd, mode)) {
+    err = errno;
+    close(fd);
+    unlink(tmp.c_str());
+    errno = err;
+    return 1;
+  }
+  for (done = 0; done < buf.size(); done += n) {
+    if ((n = write(fd, &buf[done], buf.size() - done)) < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      break;
+    }
+  }
+  if (done < buf.size() || (durable && fsync(fd))) {
+    err = errno;
+    close(fd);
+    unlink(tmp.c_str());
+    errno = err;
+    return 1;
+  }
+  if (close(fd) || rename(tmp.c_str(), file)) {
+    err = errno;
+    unlink(tmp.c_str());
+    errno = err;
+    return 1;
+  }
+
+  /* Sync the directory so the rename itself survives a crash */
+  if (!durable) {
+    return 0;
+  }
+  dir = file;
+  dir = dir.find('/') == std::string::npos ? "." :
+        dir.substr(0, dir.rfind('/') + 1);
+  if ((fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY)) >= 0) {
+    fsync(fd);
+    close(fd);
+  }
 
-  fclose(f);
-  
   return 0;
 }
 
 /*
- * Read in the stored hardness values
+ * Writes dungeon data to disc, durably unless it is bulk output.
+ * Returns 1 if the save failed.
  */
-int read_dungeon_map(dungeon *d, FILE *f)
+int write_dungeon(dungeon *d, const char *file, bool durable)
+{
+  std::vector<uint8_t> buf;
+  std::string path;
+  STATS(stat_write_dungeon);
+
+  encode_dungeon(d, buf);
+  path = save_path(file);
+  if (write_save_file(path.c_str(), buf, durable)) {
+    std::perror(path.c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Rebuilds the terrain from the stored hardness values.  Room cells
+ * can't be recognized until the rooms are placed, so all floor starts
+ * out as corridor.
+ */
+void decode_dungeon_map(dungeon *d, const uint8_t *hardness)
 {
   uint32_t x, y;
 
   for (y = 0; y < DUNGEON_Y; y++) {
     for (x = 0; x < DUNGEON_X; x++) {
-      fread(&hmapxy(x, y), sizeof (hmapxy(x, y)), 1, f);
+      hmapxy(x, y) = *hardness++;
       if (hmapxy(x, y) == 0) {
-        /* Mark it as a corridor.  We can't recognize room cells until *
-         * after we've read the room array, which we haven't done yet. */
         dmapxy(x, y) = ter_floor_hall;
       } else if (hmapxy(x, y) == 255) {
         dmapxy(x, y) = ter_wall_immutable;
@@ -192,156 +692,220 @@ int read_dungeon_map(dungeon *d, FILE *f)
       }
     }
   }
-  return 0;
 }
 
 /*
- * Read in the room data and error check
+ * Checks a stored room fits inside the border
  */
-int read_rooms(dungeon *d, uint8_t num_rooms, FILE *f)
+static const char *check_room(const uint8_t *r)
 {
-  uint32_t i;
-  uint8_t x, y, xsize, ysize;
- 
-  for (i = 0; i < num_rooms; i++) {
-    fread(&x, 1, 1, f);
-    fread(&y, 1, 1, f);
-    fread(&xsize, 1, 1, f);
-    fread(&ysize, 1, 1, f);
-    d->rooms.push_back(new room(x, y, xsize, ysize));
-    
-    if (xsize < MIN_ROOM_XSIZE   ||
-        ysize < MIN_ROOM_YSIZE   ||
-        xsize > DUNGEON_X - 1    ||
-        ysize > DUNGEON_Y - 1)    {
-      std::fprintf(stderr, "Invalid room size in restored dungeon.\n");
-
-      del_dungeon(d);
-      std::exit(EXIT_FAILURE);
-    }
+  if (r[2] < MIN_ROOM_XSIZE   ||
+      r[3] < MIN_ROOM_YSIZE   ||
+      r[2] > DUNGEON_X - 1    ||
+      r[3] > DUNGEON_Y - 1)    {
+    return "Invalid room size in restored dungeon.";
+  }
+  if (r[0] < 1                    ||
+      r[1] < 1                    ||
+      r[0] > DUNGEON_X - 1        ||
+      r[1] > DUNGEON_Y - 1        ||
+      r[0] + r[2] > DUNGEON_X - 1 ||
+      r[1] + r[3] > DUNGEON_Y - 1) {
+    return "Invalid room position in restored dungeon.";
+  }
+  return nullptr;
+}
 
-    if (x < 1                     ||
-        y < 1                     ||
-        x > DUNGEON_X - 1         ||
-        y > DUNGEON_Y - 1         ||
-        x + xsize > DUNGEON_X - 1 ||
-        x + xsize < 1             ||
-        y + ysize > DUNGEON_Y - 1 ||
-        y + ysize < 1)             {
-      std::fprintf(stderr, "Invalid room position in restored dungeon.\n");
-
-      del_dungeon(d);
-      std::exit(EXIT_FAILURE);
-    }
-        
-    /* After reading each room, we need to reconstruct them in the dungeon. */
-    for (y = (*d->rooms[i]).get_y();
-         y < (*d->rooms[i]).get_y() + (*d->rooms[i]).get_ysize();
-         y++) {
-      for (x = (*d->rooms[i]).get_x();
-	   x < (*d->rooms[i]).get_x() + (*d->rooms[i]).get_xsize();
-	   x++) {
-        dmapxy(x, y) = ter_floor_room;
+/*
+ * Checks the stored border is all immutable rock
+ */
+static const char *check_border(const uint8_t *hardness)
+{
+  uint32_t x, y;
+
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x++) {
+      if ((!x || !y || x == DUNGEON_X - 1 || y == DUNGEON_Y - 1) &&
+          hardness[y * DUNGEON_X + x] != MAX_HARDNESS_VALUE) {
+        return "Invalid border in restored dungeon.";
       }
     }
   }
-  return 0;
+  return nullptr;
 }
 
-
 /*
- * Calculate the number of rooms written to file
+ * Checks a stored cell is inside the border and on the floor: open in
+ * the hardness map or inside one of the stored rooms
  */
-int calculate_num_rooms(uint32_t dungeon_bytes)
+static bool floor_at(const uint8_t *hardness, const uint8_t *rooms,
+                     uint32_t num_rooms, uint32_t x, uint32_t y)
 {
-  return ((dungeon_bytes -
-          (20 /* The semantic, version, and size */       +
-           (DUNGEON_X * DUNGEON_Y) /* The hardnesses */)) /
-          4 /* Four bytes per room */);
+  uint32_t i;
+
+  if (!x || x >= DUNGEON_X - 1 || !y || y >= DUNGEON_Y - 1) {
+    return false;
+  }
+  if (!hardness[y * DUNGEON_X + x]) {
+    return true;
+  }
+  for (i = 0; i < num_rooms; i++, rooms += 4) {
+    if (x >= rooms[0] && x < (uint32_t) rooms[0] + rooms[2] &&
+        y >= rooms[1] && y < (uint32_t) rooms[1] + rooms[3]) {
+      return true;
+    }
+  }
+  return false;
 }
 
 /*
- * Read in dungeon information from disc
+ * Decodes a dungeon in the save file format from memory.  Everything
+ * is checked before the dungeon is touched, so on error the dungeon is
+ * left as it was.  Returns 1 and points err at the problem if the data
+ * isn't a valid save.
  */
-int read_dungeon(dungeon *d, const char *file)
+int decode_dungeon(dungeon *d, const uint8_t *buf, size_t len,
+                   const char **err)
 {
-  char semantic[strlen(DUNGEON_SAVE_SEMANTIC) + 1];
-  uint32_t be32;
-  FILE *f;
-  char *home;
-  size_t len;
-  char *filename;
-  struct stat buf;
-  uint8_t num_rooms, pcx, pcy;
-
-  if (!file) {
-    home = (char *) ".";
-    len = (strlen(home) + strlen(DUNGEON_SAVE_FILE) +
-           1 /* The NULL terminator */              +
-           2 /* The slashes */);
-
-    filename = (char *) std::malloc(len * sizeof (*filename));
-    sprintf(filename, "%s/%s", home, DUNGEON_SAVE_FILE);
-
-    if (!(f = fopen(filename, "r"))) {
-      std::perror(filename);
-      std::free(filename);
-      std::exit(EXIT_FAILURE);
-    }
+  uint32_t be32, version, num_rooms, i, x, y;
+  size_t body;
+  const uint8_t *rooms, *stairs;
+
+  if (len < 22 ||
+      memcmp(buf, DUNGEON_SAVE_SEMANTIC, strlen(DUNGEON_SAVE_SEMANTIC))) {
+    *err = "Not an RLG327 save file.";
+    return 1;
+  }
+  memcpy(&be32, buf + 12, 4);
+  version = be32toh(be32);
+  if (version != DUNGEON_SAVE_VERSION &&
+      version != DUNGEON_SAVE_VERSION_STAIRS) {
+    *err = "File version mismatch.";
+    return 1;
+  }
+  memcpy(&be32, buf + 16, 4);
+  body = 22 + DUNGEON_X * DUNGEON_Y +
+         (version == DUNGEON_SAVE_VERSION_STAIRS ? 4 : 0);
+  /* Exactly the map, whole rooms and the stairs; anything over would *
+   * shift where the stairs are read from                            */
+  if (len != be32toh(be32) || len < body || (len - body) % 4) {
+    *err = "File size mismatch.";
+    return 1;
+  }
 
-    if (stat(filename, &buf)) {
-      std::perror(filename);
-      std::exit(EXIT_FAILURE);
+  /* The rooms follow the map, four bytes each */
+  rooms = buf + 22 + DUNGEON_X * DUNGEON_Y;
+  num_rooms = (len - body) / 4;
+  for (i = 0; i < num_rooms; i++) {
+    if ((*err = check_room(rooms + i * 4))) {
+      return 1;
+    }
+  }
+  if ((*err = check_border(buf + 22))) {
+    return 1;
+  }
+  stairs = nullptr;
+  if (version == DUNGEON_SAVE_VERSION_STAIRS) {
+    stairs = buf + len - 4;
+    if (!floor_at(buf + 22, rooms, num_rooms, stairs[0], stairs[1]) ||
+        !floor_at(buf + 22, rooms, num_rooms, stairs[2], stairs[3])) {
+      *err = "Invalid stairs position in restored dungeon.";
+      return 1;
     }
+  }
+  /* The PC may be missing, but if not it stands on the floor */
+  if ((buf[20] || buf[21]) &&
+      !floor_at(buf + 22, rooms, num_rooms, buf[20], buf[21])) {
+    *err = "Invalid PC position in restored dungeon.";
+    return 1;
+  }
 
-    std::free(filename);
+  del_dungeon(d);
+  (*d).set_pc(buf[20], buf[21]);
+  if (buf[20] && buf[21]) {
+    (*d).set_curs(buf[20], buf[21]);
   } else {
-    if (!(f = fopen(file, "r"))) {
-      std::perror(file);
-      std::exit(EXIT_FAILURE);
-    }
-    if (stat(file, &buf)) {
-      std::perror(file);
-      std::exit(EXIT_FAILURE);
+    (*d).set_curs(40, 10);
+  }
+  decode_dungeon_map(d, buf + 22);
+  for (i = 0; i < num_rooms; i++, rooms += 4) {
+    d->rooms.push_back(new room(rooms[0], rooms[1], rooms[2], rooms[3]));
+    for (y = rooms[1]; y < (uint32_t) rooms[1] + rooms[3]; y++) {
+      for (x = rooms[0]; x < (uint32_t) rooms[0] + rooms[2]; x++) {
+        dmapxy(x, y) = ter_floor_room;
+      }
     }
   }
+  if (stairs) {
+    dmapxy(stairs[0], stairs[1]) = ter_stairs_up;
+    dmapxy(stairs[2], stairs[3]) = ter_stairs_down;
+  }
+  (*d).mark_all_dirty();
+
+  return 0;
+}
 
-  num_rooms = 0;
+/*
+ * Reads a whole file into buf.  Returns 1 and sets errno on failure.
+ */
+int read_save_file(const char *file, std::vector<uint8_t>& buf)
+{
+  struct stat st;
+  size_t done;
+  ssize_t n;
+  int fd, err;
 
-  fread(semantic, strlen(DUNGEON_SAVE_SEMANTIC), 1, f);
-  semantic[strlen(DUNGEON_SAVE_SEMANTIC)] = '\0';
-  if (strncmp(semantic, DUNGEON_SAVE_SEMANTIC,
-	      strlen(DUNGEON_SAVE_SEMANTIC))) {
-    std::fprintf(stderr, "Not an RLG327 save file.\n");
-    std::exit(EXIT_FAILURE);
+  if ((fd = open(file, O_RDONLY)) < 0) {
+    return 1;
   }
-  fread(&be32, sizeof (be32), 1, f);
-  if (be32toh(be32) != 0) { /* Since we expect zero, be32toh() is a no-op. */
-    std::fprintf(stderr, "File version mismatch.\n");
-    std::exit(EXIT_FAILURE);
+  if (fstat(fd, &st)) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return 1;
   }
-  fread(&be32, sizeof (be32), 1, f);
-  if (buf.st_size != be32toh(be32)) {
-    std::fprintf(stderr, "File size mismatch.\n");
-    std::exit(EXIT_FAILURE);
+  buf.resize(st.st_size);
+  n = 0;
+  for (done = 0; done < buf.size(); done += n) {
+    if ((n = read(fd, &buf[done], buf.size() - done)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      break;
+    }
+  }
+  err = errno;
+  close(fd);
+  if (done < buf.size()) {
+    errno = n ? err : EIO;
+    return 1;
   }
 
-  fread(&pcx, 1, 1, f);
-  (*d).set_pcx(pcx);
-  fread(&pcy, 1, 1, f);
-  (*d).set_pcy(pcy);
-  if(pcx && pcy) {
-    (*d).set_curs(pcx, pcy);
-  } else {
-    (*d).set_curs(40, 10);
+  return 0;
+}
+
+/*
+ * Read in dungeon information from disc
+ */
+int read_dungeon(dungeon *d, const char *file)
+{
+  std::vector<uint8_t> buf;
+  std::string path;
+  const char *err;
+  STATS(stat_read_dungeon);
+
+  path = save_path(file);
+  if (read_save_file(path.c_str(), buf)) {
+    std::perror(path.c_str());
+    std::exit(EXIT_FAILURE);
   }
-  
-  read_dungeon_map(d, f);
-  num_rooms = calculate_num_rooms(buf.st_size);
-  
-  read_rooms(d, num_rooms, f);
 
-  fclose(f);
+  if (decode_dungeon(d, buf.empty() ? nullptr : &buf[0], buf.size(), &err)) {
+    std::fprintf(stderr, "%s\n", err);
+    del_dungeon(d);
+    std::exit(EXIT_FAILURE);
+  }
 
   return 0;
 }
@@ -1,11 +1,17 @@
 #ifndef DUNGEON_H
 #define DUNGEON_H
 
+#include <memory>
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 #include "room.h"
 
+class history;
+class journal;
+struct dungeon_snapshot;
+
 #define dmapxy(x, y) (d->d_map[y][x])
 #define hmapxy(x, y) (d->h_map[y][x])
 
@@ -17,8 +23,9 @@ const uint32_t MAX_ROOM_COUNT = 15;
 const char* const DUNGEON_SAVE_FILE = "dungeon";
 const char* const DUNGEON_SAVE_SEMANTIC = "RLG327-F2018";
 const uint32_t DUNGEON_SAVE_VERSION = 0;
-//const char* const MONSTER_DESC_FILE = "monster_desc.txt";
-//const char* const OBJECT_DESC_FILE = "object_desc.txt";
+const uint32_t DUNGEON_SAVE_VERSION_STAIRS = 1;
+const char* const MONSTER_DESC_FILE = "monster_desc.txt";
+const char* const OBJECT_DESC_FILE = "object_desc.txt";
 
 enum __attribute__ ((__packed__)) terrain_type {
   ter_debug,
@@ -37,12 +44,26 @@ class dungeon {
  private:
   uint8_t pc_x, pc_y;
   uint32_t curs_x, curs_y;
+  /* Columns [dirty_x0, dirty_x1) of each row changed since last drawn */
+  uint8_t dirty_x0[DUNGEON_Y], dirty_x1[DUNGEON_Y];
  public:
   std::vector<room*> rooms;
   terrain_type d_map[DUNGEON_Y][DUNGEON_X];
   uint8_t h_map[DUNGEON_Y][DUNGEON_X];
+  /* Where edits are recorded for undo, if anywhere */
+  history *hist;
+  /* Where edits are logged for crash recovery, if anywhere */
+  journal *jrnl;
+  /* The last snapshot taken, and a bit per row changed since */
+  std::shared_ptr<const dungeon_snapshot> snap;
+  uint32_t snap_rows;
   dungeon() : pc_x(0), pc_y(0), curs_x(0), curs_y(0),
-              rooms(), d_map{ter_wall}, h_map{0} {}
+              rooms(), d_map{ter_wall}, h_map{0}, hist(nullptr),
+              jrnl(nullptr), snap(), snap_rows(0)
+  {
+    clear_dirty();
+    mark_all_dirty();
+  }
 
   uint8_t get_pcx(void)
   {
@@ -64,20 +85,27 @@ class dungeon {
     return curs_y;
   }
 
-  void set_pcx(uint8_t x)
+  /* Each returns 1, leaving the PC alone, if it would be off the map */
+  int set_pcx(uint8_t x)
   {
-    pc_x = x;
+    return set_pc(x, pc_y);
   }
 
-  void set_pcy(uint8_t y)
+  int set_pcy(uint8_t y)
   {
-    pc_y = y;
+    return set_pc(pc_x, y);
   }
 
-  void set_pc(uint8_t x, uint8_t y)
+  int set_pc(uint8_t x, uint8_t y)
   {
+    if(x >= DUNGEON_X || y >= DUNGEON_Y) {
+      return 1;
+    }
+    mark_dirty(pc_x, pc_y);
     pc_x = x;
     pc_y = y;
+    mark_dirty(pc_x, pc_y);
+    return 0;
   }
 
   void set_cursx(uint32_t x)
@@ -95,12 +123,93 @@ class dungeon {
     curs_x = x;
     curs_y = y;
   }
+
+  bool row_dirty(uint32_t y)
+  {
+    return dirty_x0[y] < dirty_x1[y];
+  }
+
+  uint8_t get_dirtyx0(uint32_t y)
+  {
+    return dirty_x0[y];
+  }
+
+  uint8_t get_dirtyx1(uint32_t y)
+  {
+    return dirty_x1[y];
+  }
+
+  /* Rows off the map are ignored and columns clamped to it */
+  void mark_dirty(uint32_t x, uint32_t y)
+  {
+    if(y >= DUNGEON_Y) {
+      return;
+    }
+    if(x >= DUNGEON_X) {
+      x = DUNGEON_X - 1;
+    }
+    if(x < dirty_x0[y]) {
+      dirty_x0[y] = x;
+    }
+    if(x >= dirty_x1[y]) {
+      dirty_x1[y] = x + 1;
+    }
+    snap_rows |= 1 << y;
+  }
+
+  void mark_dirty(uint32_t x, uint32_t y, uint32_t xsize, uint32_t ysize)
+  {
+    uint32_t j;
+
+    for(j = y; j < y + ysize && j < DUNGEON_Y; j++) {
+      mark_dirty(x, j);
+      mark_dirty(x + xsize - 1, j);
+    }
+  }
+
+  void mark_all_dirty(void)
+  {
+    mark_dirty(0, 0, DUNGEON_X, DUNGEON_Y);
+  }
+
+  void clear_dirty(void)
+  {
+    uint32_t y;
+
+    for(y = 0; y < DUNGEON_Y; y++) {
+      dirty_x0[y] = DUNGEON_X;
+      dirty_x1[y] = 0;
+    }
+  }
 };
 
 void init_dungeon(dungeon *d);
+void gen_dungeon(dungeon *d);
 void del_dungeon(dungeon *d);
+bool room_present(dungeon *d, uint8_t x, uint8_t y, uint8_t xrng, uint8_t yrng);
+void set_cell(dungeon *d, uint8_t x, uint8_t y, terrain_type t, uint8_t h);
+int add_corridor(dungeon *d, uint8_t x, uint8_t y);
+int add_wall(dungeon *d, uint8_t x, uint8_t y);
+bool fillable(dungeon *d, uint8_t x, uint8_t y);
+uint8_t fill_hardness(terrain_type t);
+uint32_t fill_rect(dungeon *d, uint8_t x, uint8_t y, uint8_t xsize,
+                   uint8_t ysize, terrain_type t, uint8_t h);
+uint32_t flood_fill(dungeon *d, uint8_t x, uint8_t y, terrain_type t,
+                    uint8_t h);
+int add_room(dungeon *d, uint8_t x, uint8_t y, uint8_t xsize, uint8_t ysize);
+int remove_room(dungeon *d, uint8_t x, uint8_t y);
+int move_pc(dungeon *d, uint8_t x, uint8_t y);
 void get_warnings(dungeon *d, std::vector<const char *>& warnings);
-int write_dungeon(dungeon *d, const char *file);
+int find_stairs(dungeon *d, uint8_t stairs[4]);
+void find_rooms(dungeon *d);
+void encode_dungeon(dungeon *d, std::vector<uint8_t>& buf);
+std::string save_path(const char *file);
+int write_save_file(const char *file, const std::vector<uint8_t>& buf,
+                    bool durable = true);
+int write_dungeon(dungeon *d, const char *file, bool durable = true);
+int read_save_file(const char *file, std::vector<uint8_t>& buf);
+int decode_dungeon(dungeon *d, const uint8_t *buf, size_t len,
+                   const char **err);
 int read_dungeon(dungeon *d, const char *file);
 
 #endif
@@ -0,0 +1,242 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Largest side of a grid, so x and y pack into 16 bits each */
+const uint32_t GRID_MAX_SIDE = 1 << 15;
+/* Side of a tile in tiled_layout: 64 one byte cells, a cache line */
+const uint32_t GRID_TILE = 8;
+/* Distance of a cell grid_dist hasn't reached */
+const uint8_t GRID_UNREACHED = UINT8_MAX;
+
+/*
+ * Cell layouts for maps too big to stay in cache.  A layout turns x, y
+ * into an offset in a grid's storage.  Row-major, as in d_map, puts the
+ * cells above and below a whole row away, a page or more on a big map,
+ * so flood fills, distance maps and blurs touch three rows' worth of
+ * cache lines and pages at once.  The other layouts keep each 2-D
+ * neighborhood in a few lines.
+ *
+ * The dungeon doesn't use these: at 80x21 it sits in L1 in any layout,
+ * and world files are already stored in tiles.  They are here for maps
+ * that outgrow both, and the grid_ benchmarks in dgen_bench compare
+ * them.
+ */
+
+/*
+ * Cell x, y at y * width + x
+ */
+class row_major_layout {
+ private:
+  uint32_t width, height;
+ public:
+  row_major_layout(uint32_t w = 0, uint32_t h = 0) : width(w), height(h) {}
+
+  size_t cells(void) const
+  {
+    return (size_t) width * height;
+  }
+
+  size_t index(uint32_t x, uint32_t y) const
+  {
+    return (size_t) y * width + x;
+  }
+};
+
+/*
+ * Z-order: the bits of x and y interleaved, so every aligned power of
+ * two square is contiguous.  Sides are rounded up to one square power
+ * of two, which wastes space on long thin maps.
+ */
+class morton_layout {
+ private:
+  uint32_t side;
+
+  static uint64_t spread(uint32_t v)
+  {
+    uint64_t s = v;
+
+    s = (s | s << 8) & 0x00ff00ff;
+    s = (s | s << 4) & 0x0f0f0f0f;
+    s = (s | s << 2) & 0x33333333;
+    s = (s | s << 1) & 0x55555555;
+    return s;
+  }
+ public:
+  morton_layout(uint32_t w = 0, uint32_t h = 0) : side(1)
+  {
+    while (side < w || side < h) {
+      side <<= 1;
+    }
+  }
+
+  size_t cells(void) const
+  {
+    return (size_t) side * side;
+  }
+
+  size_t index(uint32_t x, uint32_t y) const
+  {
+    return spread(x) | spread(y) << 1;
+  }
+};
+
+/*
+ * GRID_TILE square tiles, row-major within a tile and between tiles
+ */
+class tiled_layout {
+ private:
+  uint32_t tiles_x, tiles_y;
+ public:
+  tiled_layout(uint32_t w = 0, uint32_t h = 0) :
+    tiles_x((w + GRID_TILE - 1) / GRID_TILE),
+    tiles_y((h + GRID_TILE - 1) / GRID_TILE) {}
+
+  size_t cells(void) const
+  {
+    return (size_t) tiles_x * tiles_y * GRID_TILE * GRID_TILE;
+  }
+
+  size_t index(uint32_t x, uint32_t y) const
+  {
+    return ((size_t) (y / GRID_TILE) * tiles_x + x / GRID_TILE) *
+           GRID_TILE * GRID_TILE + y % GRID_TILE * GRID_TILE + x % GRID_TILE;
+  }
+};
+
+/*
+ * A width by height map of cells stored in layout L.  Cells are only
+ * reached through at(), so algorithms written against it run on any
+ * layout.
+ */
+template <class T, class L>
+class cell_grid {
+ private:
+  uint32_t width, height;
+  L layout;
+  std::vector<T> cells;
+ public:
+  cell_grid() : width(0), height(0), layout(), cells() {}
+
+  /*
+   * Sizes the grid, filling every cell with fill.  Returns 1, leaving
+   * the grid alone, if a side is 0 or over GRID_MAX_SIDE.
+   */
+  int resize(uint32_t w, uint32_t h, T fill)
+  {
+    if (!w || !h || w > GRID_MAX_SIDE || h > GRID_MAX_SIDE) {
+      return 1;
+    }
+    width = w;
+    height = h;
+    layout = L(w, h);
+    cells.assign(layout.cells(), fill);
+    return 0;
+  }
+
+  /* Gives the storage back */
+  void clear(void)
+  {
+    width = height = 0;
+    std::vector<T>().swap(cells);
+  }
+
+  uint32_t get_width(void) const
+  {
+    return width;
+  }
+
+  uint32_t get_height(void) const
+  {
+    return height;
+  }
+
+  T &at(uint32_t x, uint32_t y)
+  {
+    return cells[layout.index(x, y)];
+  }
+};
+
+/*
+ * Walking distances from x, y over the open (zero) cells of ter,
+ * 8-connected, out to limit moves.  dist must be GRID_UNREACHED
+ * everywhere; reached cells get their distance and are listed in
+ * queue as x | y << 16, so the caller can reset just those.  Returns
+ * how many cells were reached.
+ */
+template <class L>
+uint32_t grid_dist(cell_grid<uint8_t, L> &ter, cell_grid<uint8_t, L> &dist,
+                   uint32_t x, uint32_t y, uint8_t limit,
+                   std::vector<uint32_t> &queue)
+{
+  uint32_t head, cx, cy, nx, ny;
+  int32_t i, j;
+  uint8_t cd;
+
+  queue.clear();
+  if (ter.at(x, y)) {
+    return 0;
+  }
+  dist.at(x, y) = 0;
+  queue.push_back(x | y << 16);
+  for (head = 0; head < queue.size(); head++) {
+    cx = queue[head] & 0xffff;
+    cy = queue[head] >> 16;
+    if ((cd = dist.at(cx, cy)) == limit) {
+      continue;
+    }
+    for (j = -1; j <= 1; j++) {
+      for (i = -1; i <= 1; i++) {
+        nx = cx + i;
+        ny = cy + j;
+        /* Off the edge wraps around to a huge unsigned value */
+        if (nx >= ter.get_width() || ny >= ter.get_height() ||
+            ter.at(nx, ny) || dist.at(nx, ny) != GRID_UNREACHED) {
+          continue;
+        }
+        dist.at(nx, ny) = cd + 1;
+        queue.push_back(nx | ny << 16);
+      }
+    }
+  }
+  return queue.size();
+} // grid_dist
+
+/*
+ * 3x3 box blur of the walls (non-zero cells) of the w by h window at
+ * x, y, each wall averaging only the walls around it as in
+ * smooth_hardness.  Open cells stay zero.  The results go to out in
+ * row order.  The window must keep a cell clear of the edge.
+ */
+template <class L>
+void grid_blur(cell_grid<uint8_t, L> &hard, uint32_t x, uint32_t y,
+               uint32_t w, uint32_t h, std::vector<uint8_t> &out)
+{
+  uint32_t i, j, val, wt;
+  int32_t dx, dy;
+  uint8_t c;
+
+  out.resize((size_t) w * h);
+  for (j = 0; j < h; j++) {
+    for (i = 0; i < w; i++) {
+      if (!hard.at(x + i, y + j)) {
+        out[(size_t) j * w + i] = 0;
+        continue;
+      }
+      for (val = wt = 0, dy = -1; dy <= 1; dy++) {
+        for (dx = -1; dx <= 1; dx++) {
+          if ((c = hard.at(x + i + dx, y + j + dy))) {
+            val += c;
+            wt++;
+          }
+        }
+      }
+      out[(size_t) j * w + i] = (val + (wt >> 1)) / wt;
+    }
+  }
+} // grid_blur
+
+#endif
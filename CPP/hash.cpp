@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include "corpus.h"
+#include "dungeon.h"
+#include "loader.h"
+#include "hash.h"
+#include "utils.h"
+
+/*
+ * 128 bit content hash in the style of XXH3.  Input is consumed in 64
+ * byte stripes by eight 64 bit lanes; each lane adds the product of the
+ * two halves of its keyed word, plus its neighbor's word, so every byte
+ * reaches two lanes.  Every HASH_BLOCK stripes the lanes are scrambled.
+ * The SSE2 and scalar versions give the same hash.
+ */
+
+static const size_t HASH_STRIPE = 64;
+static const size_t HASH_BLOCK = 16;
+static const uint64_t PRIME32_1 = 0x9E3779B1U;
+static const uint64_t PRIME32_2 = 0x85EBCA77U;
+static const uint64_t PRIME32_3 = 0xC2B2AE3DU;
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+/* Key material: the first hex digits of pi */
+alignas(16) static const uint64_t hash_key[8] = {
+  0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL,
+  0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+  0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL,
+  0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL
+};
+
+/* Magic at the start of a dedupe index */
+static const char HASH_INDEX_MAGIC[] = "DGNH";
+
+static inline uint64_t read64(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, 8);
+  return le64toh(v);
+} // read64
+
+static void accumulate(uint64_t acc[8], const uint8_t *stripe)
+{
+#if defined(__SSE2__) && __BYTE_ORDER == __LITTLE_ENDIAN
+  __m128i *a = (__m128i *) acc;
+  __m128i data, key;
+  uint32_t j;
+
+  for (j = 0; j < 4; j++) {
+    data = _mm_loadu_si128((const __m128i *) (stripe + 16 * j));
+    key = _mm_xor_si128(data, _mm_load_si128((const __m128i *) hash_key + j));
+    a[j] = _mm_add_epi64(a[j], _mm_add_epi64(
+             _mm_mul_epu32(key, _mm_srli_epi64(key, 32)),
+             _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+  }
+#else
+  uint64_t data, key;
+  uint32_t i;
+
+  for (i = 0; i < 8; i++) {
+    data = read64(stripe + 8 * i);
+    key = data ^ hash_key[i];
+    acc[i ^ 1] += data;
+    acc[i] += (key & 0xffffffff) * (key >> 32);
+  }
+#endif
+} // accumulate
+
+static void scramble(uint64_t acc[8])
+{
+#if defined(__SSE2__) && __BYTE_ORDER == __LITTLE_ENDIAN
+  __m128i *a = (__m128i *) acc;
+  const __m128i prime = _mm_set1_epi32(PRIME32_1);
+  __m128i v;
+  uint32_t j;
+
+  for (j = 0; j < 4; j++) {
+    v = _mm_xor_si128(a[j], _mm_srli_epi64(a[j], 47));
+    v = _mm_xor_si128(v, _mm_load_si128((const __m128i *) hash_key + j));
+    a[j] = _mm_add_epi64(_mm_mul_epu32(v, prime),
+             _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), prime), 32));
+  }
+#else
+  uint32_t i;
+
+  for (i = 0; i < 8; i++) {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= hash_key[i];
+    acc[i] *= PRIME32_1;
+  }
+#endif
+} // scramble
+
+static inline uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  return h ^ (h >> 32);
+} // avalanche
+
+static inline uint64_t fold64(uint64_t a, uint64_t b)
+{
+  unsigned __int128 p = (unsigned __int128) a * b;
+
+  return (uint64_t) p ^ (uint64_t) (p >> 64);
+} // fold64
+
+/*
+ * Hashes len bytes
+ */
+hash128 hash_bytes(const uint8_t *buf, size_t len)
+{
+  alignas(16) uint64_t acc[8] = {
+    PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+    PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+  };
+  uint8_t tail[HASH_STRIPE];
+  hash128 h;
+  size_t n, stripes;
+  uint32_t i;
+
+  for (n = 0, stripes = 0; n + HASH_STRIPE <= len; n += HASH_STRIPE) {
+    accumulate(acc, buf + n);
+    if (++stripes % HASH_BLOCK == 0) {
+      scramble(acc);
+    }
+  }
+  if (n < len) {
+    memset(tail, 0, sizeof (tail));
+    memcpy(tail, buf + n, len - n);
+    accumulate(acc, tail);
+  }
+
+  h.lo = len * PRIME64_1;
+  h.hi = ~(len * PRIME64_2);
+  for (i = 0; i < 4; i++) {
+    h.lo += fold64(acc[2 * i] ^ hash_key[2 * i],
+                   acc[2 * i + 1] ^ hash_key[2 * i + 1]);
+    h.hi += fold64(acc[2 * i] ^ hash_key[7 - 2 * i],
+                   acc[2 * i + 1] ^ hash_key[6 - 2 * i]);
+  }
+  h.lo = avalanche(h.lo);
+  h.hi = avalanche(h.hi);
+
+  return h;
+} // hash_bytes
+
+/*
+ * Hashes what makes a dungeon what it is: the hardness, which also
+ * fixes the corridors, the PC and stairs, and the rooms in position
+ * order, so the order they were made in doesn't matter.
+ */
+hash128 hash_dungeon(dungeon *d)
+{
+  std::vector<uint32_t> rooms;
+  std::vector<uint8_t> buf;
+  uint8_t stairs[4];
+  uint32_t i;
+
+  buf.reserve(DUNGEON_X * DUNGEON_Y + 6 + d->rooms.size() * 4);
+  buf.insert(buf.end(), &d->h_map[0][0],
+             &d->h_map[0][0] + DUNGEON_X * DUNGEON_Y);
+  buf.push_back((*d).get_pcx());
+  buf.push_back((*d).get_pcy());
+  find_stairs(d, stairs);
+  buf.insert(buf.end(), stairs, stairs + 4);
+
+  for (i = 0; i < d->rooms.size(); i++) {
+    rooms.push_back((*d->rooms[i]).get_y() << 24 |
+                    (*d->rooms[i]).get_x() << 16 |
+                    (*d->rooms[i]).get_ysize() << 8 |
+                    (*d->rooms[i]).get_xsize());
+  }
+  std::sort(rooms.begin(), rooms.end());
+  for (i = 0; i < rooms.size(); i++) {
+    buf.push_back(rooms[i] >> 16);
+    buf.push_back(rooms[i] >> 24);
+    buf.push_back(rooms[i]);
+    buf.push_back(rooms[i] >> 8);
+  }
+
+  return hash_bytes(&buf[0], buf.size());
+} // hash_dungeon
+
+/*
+ * Loads and hashes a save.  Returns 1 if it can't be read or decoded.
+ */
+static int hash_file(const std::string& file, hash128 *h)
+{
+  std::vector<uint8_t> buf;
+  dungeon d;
+  const char *err;
+
+  if (read_save_file(file.c_str(), buf) ||
+      decode_dungeon(&d, buf.empty() ? nullptr : &buf[0], buf.size(), &err)) {
+    return 1;
+  }
+  *h = hash_dungeon(&d);
+  del_dungeon(&d);
+  return 0;
+} // hash_file
+
+struct index_entry {
+  hash128 hash;
+  std::string name;
+  bool checked;         /* Known to still hold this dungeon */
+};
+
+/*
+ * Reads a dedupe index: "DGNH", then per dungeon its hash (lo, hi,
+ * host order) and its name (two byte length, then the bytes).  A
+ * missing index is an empty one.  Returns 1 if it can't be read.
+ */
+static int read_index(const char *file, std::vector<index_entry>& entries)
+{
+  std::vector<uint8_t> buf;
+  index_entry e;
+  size_t at;
+  uint16_t len;
+
+  if (read_save_file(file, buf)) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    std::perror(file);
+    return 1;
+  }
+  if (buf.size() < 4 || memcmp(&buf[0], HASH_INDEX_MAGIC, 4)) {
+    std::fprintf(stderr, "%s: Not a dedupe index.\n", file);
+    return 1;
+  }
+  e.checked = false;
+  for (at = 4; at < buf.size(); at += 18 + len) {
+    if (buf.size() - at < 18) {
+      break;
+    }
+    memcpy(&e.hash.lo, &buf[at], 8);
+    memcpy(&e.hash.hi, &buf[at + 8], 8);
+    memcpy(&len, &buf[at + 16], 2);
+    if (buf.size() - at - 18 < len) {
+      break;
+    }
+    e.name.assign((const char *) &buf[at + 18], len);
+    entries.push_back(e);
+  }
+  if (at != buf.size()) {
+    std::fprintf(stderr, "%s: Index is cut short.\n", file);
+    return 1;
+  }
+  return 0;
+} // read_index
+
+static int write_index(const char *file,
+                       const std::vector<index_entry>& entries)
+{
+  std::vector<uint8_t> buf;
+  size_t at;
+  uint16_t len;
+  uint32_t i;
+
+  at = 4;
+  for (i = 0; i < entries.size(); i++) {
+    at += 18 + entries[i].name.size();
+  }
+  buf.resize(at);
+  memcpy(&buf[0], HASH_INDEX_MAGIC, 4);
+  for (at = 4, i = 0; i < entries.size(); i++) {
+    len = entries[i].name.size();
+    memcpy(&buf[at], &entries[i].hash.lo, 8);
+    memcpy(&buf[at + 8], &entries[i].hash.hi, 8);
+    memcpy(&buf[at + 16], &len, 2);
+    memcpy(&buf[at + 18], entries[i].name.data(), len);
+    at += 18 + len;
+  }
+  if (write_save_file(file, buf)) {
+    std::perror(file);
+    return 1;
+  }
+  return 0;
+} // write_index
+
+/*
+ * Finds dungeons in a directory or archive that duplicate one seen
+ * before, either earlier in this run or in an earlier run recorded in
+ * the index (default <dir>/.dedupe or <archive>.dedupe).  Duplicates
+ * are printed to stdout as "name<TAB>original", and with drop, deleted
+ * from a directory.  Dungeons are hashed on jobs threads, then checked
+ * against the index in order, so the first copy is always the one
+ * kept.  Returns 1 on error.
+ */
+int dedupe_files(const char *src, const char *index, bool drop,
+                 uint32_t jobs)
+{
+  corpus c;
+  struct stat st;
+  std::string index_file, dir, name;
+  std::vector<index_entry> entries;
+  std::unordered_map<hash128, uint32_t, hash128_hasher> seen;
+  std::vector<hash128> hashes;
+  std::vector<uint8_t> ok;
+  index_entry e;
+  hash128 h;
+  uint32_t i, j, dups, failed;
+  bool is_dir;
+  uint64_t start;
+
+  if (stat(src, &st)) {
+    std::perror(src);
+    return 1;
+  }
+  is_dir = S_ISDIR(st.st_mode);
+  if (drop && !is_dir) {
+    std::fprintf(stderr, "%s: Duplicates can only be dropped from a "
+                 "directory.\n", src);
+    return 1;
+  }
+  dir = src;
+  index_file = index ? index : dir + (is_dir ? "/.dedupe" : ".dedupe");
+  if (c.open(src) || read_index(index_file.c_str(), entries)) {
+    return 1;
+  }
+  for (i = 0; i < entries.size(); i++) {
+    seen[entries[i].hash] = i;
+  }
+
+  start = now_usec();
+  hashes.resize(c.size());
+  ok.resize(c.size());
+  load_dungeons(c, jobs, [&](uint32_t, uint32_t i, dungeon *d) {
+    hashes[i] = hash_dungeon(d);
+    ok[i] = 1;
+  });
+
+  dups = failed = 0;
+  e.checked = true;
+  for (i = 0; i < c.size(); i++) {
+    if (!ok[i]) {
+      failed++;
+      continue;
+    }
+    name = c.name(i);
+    if (seen.find(hashes[i]) == seen.end()) {
+      e.hash = hashes[i];
+      e.name = name;
+      seen[e.hash] = entries.size();
+      entries.push_back(e);
+      continue;
+    }
+    j = seen[hashes[i]];
+    if (entries[j].name == name) {
+      entries[j].checked = true;
+      continue;
+    }
+    /* A file from an earlier run may since have been changed or  *
+     * deleted; if so, this one becomes the original.             */
+    if (is_dir && !entries[j].checked) {
+      if (hash_file(dir + "/" + entries[j].name, &h) || !(h == hashes[i])) {
+        entries[j].name = name;
+        entries[j].checked = true;
+        continue;
+      }
+      entries[j].checked = true;
+    }
+    std::printf("%s\t%s\n", name.c_str(), entries[j].name.c_str());
+    dups++;
+    if (drop && unlink((dir + "/" + name).c_str())) {
+      std::perror(name.c_str());
+      failed++;
+    }
+  }
+
+  std::fprintf(stderr, "%u dungeons, %u duplicates%s, %.1f us per dungeon\n",
+               c.size(), dups, drop ? " dropped" : "",
+               c.size() ? (double) (now_usec() - start) / c.size() : 0.0);
+
+  return write_index(index_file.c_str(), entries) || failed ? 1 : 0;
+} // dedupe_files
@@ -0,0 +1,32 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class dungeon;
+
+struct hash128 {
+  uint64_t lo, hi;
+
+  bool operator==(const hash128& h) const
+  {
+    return lo == h.lo && hi == h.hi;
+  }
+};
+
+/* For keying hash tables by a hash128 */
+struct hash128_hasher {
+  size_t operator()(const hash128& h) const
+  {
+    return h.lo;
+  }
+};
+
+hash128 hash_bytes(const uint8_t *buf, size_t len);
+hash128 hash_dungeon(dungeon *d);
+int dedupe_files(const char *src, const char *index, bool drop,
+                 uint32_t jobs);
+
+#endif
@@ -0,0 +1,286 @@
+#include <cstring>
+
+#include "dungeon.h"
+#include "history.h"
+#include "journal.h"
+#include "room.h"
+
+/*
+ * Starts an edit, or joins the one already in progress
+ */
+void history::begin(void)
+{
+  if (!depth++) {
+    recording = false;
+    run_at = pc_at = SIZE_MAX;
+  }
+} // begin
+
+/*
+ * Ends an edit.  Once the outermost group ends, old edits are
+ * forgotten if the log is over budget.
+ */
+void history::end(void)
+{
+  if (!depth || --depth) {
+    return;
+  }
+  if (recording) {
+    trim();
+  }
+  recording = false;
+} // end
+
+/*
+ * Called before the first change of an edit is recorded.  Anything
+ * that could be redone is dropped and the edit starts at the end of
+ * the log.
+ */
+void history::start_record(void)
+{
+  if (recording) {
+    return;
+  }
+  if (undone) {
+    log.resize(edits[edits.size() - undone]);
+    edits.resize(edits.size() - undone);
+    undone = 0;
+  }
+  edits.push_back(log.size());
+  recording = true;
+} // start_record
+
+/*
+ * Forgets the oldest edits until the log fits the budget.  The space
+ * they used is reclaimed once it is at least half the log.
+ */
+void history::trim(void)
+{
+  uint32_t i;
+
+  while (log.size() - base > budget && !edits.empty()) {
+    edits.pop_front();
+    base = edits.empty() ? log.size() : edits.front();
+  }
+  if (base && base >= (log.size() >> 1)) {
+    log.erase(log.begin(), log.begin() + base);
+    for (i = 0; i < edits.size(); i++) {
+      edits[i] -= base;
+    }
+    base = 0;
+  }
+} // trim
+
+/*
+ * Forgets all edits
+ */
+void history::clear(void)
+{
+  log.clear();
+  edits.clear();
+  base = 0;
+  undone = 0;
+  depth = 0;
+  recording = false;
+} // clear
+
+/*
+ * Records a cell change, extending the last run when the cell follows it
+ */
+void history::record_cell(uint16_t i, terrain_type old_t, uint8_t old_h,
+                          terrain_type new_t, uint8_t new_h)
+{
+  uint16_t start, len;
+  uint8_t rec[5];
+
+  if (!depth || (old_t == new_t && old_h == new_h)) {
+    return;
+  }
+  start_record();
+
+  if (run_at != SIZE_MAX) {
+    std::memcpy(&start, &log[run_at + 1], 2);
+    std::memcpy(&len, &log[run_at + 3], 2);
+  }
+  if (run_at != SIZE_MAX && start + len == i && len < UINT16_MAX) {
+    len++;
+    std::memcpy(&log[run_at + 3], &len, 2);
+  } else {
+    run_at = log.size();
+    len = 1;
+    rec[0] = 'C';
+    std::memcpy(&rec[1], &i, 2);
+    std::memcpy(&rec[3], &len, 2);
+    log.insert(log.end(), rec, rec + 5);
+  }
+  log.push_back(old_t);
+  log.push_back(old_h);
+  log.push_back(new_t);
+  log.push_back(new_h);
+} // record_cell
+
+void history::record_room(uint8_t added, room *r)
+{
+  if (!depth) {
+    return;
+  }
+  start_record();
+
+  log.push_back('R');
+  log.push_back(added);
+  log.push_back((*r).get_x());
+  log.push_back((*r).get_y());
+  log.push_back((*r).get_xsize());
+  log.push_back((*r).get_ysize());
+  run_at = SIZE_MAX;
+} // record_room
+
+/*
+ * Records a PC move.  An edit keeps a single PC record going from
+ * where the PC was before the edit to where it is after.
+ */
+void history::record_pc(uint8_t old_x, uint8_t old_y,
+                        uint8_t new_x, uint8_t new_y)
+{
+  if (!depth) {
+    return;
+  }
+  start_record();
+
+  if (pc_at == SIZE_MAX) {
+    pc_at = log.size();
+    log.push_back('P');
+    log.push_back(old_x);
+    log.push_back(old_y);
+    log.push_back(new_x);
+    log.push_back(new_y);
+    run_at = SIZE_MAX;
+  } else {
+    log[pc_at + 3] = new_x;
+    log[pc_at + 4] = new_y;
+  }
+} // record_pc
+
+/*
+ * Offset just past edit i
+ */
+size_t history::edit_end(uint32_t i)
+{
+  return i + 1 < edits.size() ? edits[i + 1] : log.size();
+} // edit_end
+
+/*
+ * Writes the old (undo) or new (redo) side of the edit in
+ * log[from, to) back into the dungeon.  Undo walks the edit backwards
+ * so cells changed more than once end up with their first old value.
+ * The cursor goes to the first changed cell.
+ */
+void history::apply(dungeon *d, size_t from, size_t to, bool undo)
+{
+  std::vector<size_t> recs;
+  uint16_t start, len;
+  uint32_t n, k, i;
+  uint8_t *r, *v, add;
+  size_t at;
+  bool curs;
+
+  for (at = from; at < to; ) {
+    recs.push_back(at);
+    if (log[at] == 'C') {
+      std::memcpy(&len, &log[at + 3], 2);
+      at += 5 + (len << 2);
+    } else if (log[at] == 'R') {
+      at += 6;
+    } else {
+      at += 5;
+    }
+  }
+
+  curs = false;
+  for (n = 0; n < recs.size(); n++) {
+    r = &log[recs[undo ? recs.size() - 1 - n : n]];
+    switch (r[0]) {
+    case 'C':
+      std::memcpy(&start, &r[1], 2);
+      std::memcpy(&len, &r[3], 2);
+      for (k = 0; k < len; k++) {
+        i = undo ? len - 1 - k : k;
+        v = &r[5 + (i << 2)];
+        i += start;
+        /* Outside a group, so this isn't recorded again */
+        set_cell(d, i % DUNGEON_X, i / DUNGEON_X, (terrain_type) v[undo ? 0 : 2],
+                 v[undo ? 1 : 3]);
+      }
+      (*d).set_curs(start % DUNGEON_X, start / DUNGEON_X);
+      curs = true;
+      break;
+    case 'R':
+      add = undo ? !r[1] : r[1];
+      if (add) {
+        d->rooms.push_back(new room(r[2], r[3], r[4], r[5]));
+        if (d->jrnl) {
+          (*d->jrnl).record_room(1, d->rooms.back());
+        }
+        break;
+      }
+      for (i = 0; i < d->rooms.size(); i++) {
+        if ((*d->rooms[i]).get_x() == r[2] && (*d->rooms[i]).get_y() == r[3]) {
+          if (d->jrnl) {
+            (*d->jrnl).record_room(0, d->rooms[i]);
+          }
+          delete d->rooms[i];
+          d->rooms.erase(d->rooms.begin() + i);
+          break;
+        }
+      }
+      break;
+    case 'P':
+      if (undo) {
+        (*d).set_pc(r[1], r[2]);
+      } else {
+        (*d).set_pc(r[3], r[4]);
+      }
+      if (d->jrnl) {
+        (*d->jrnl).record_pc((*d).get_pcx(), (*d).get_pcy());
+      }
+      if (!curs) {
+        (*d).set_curs((*d).get_pcx(), (*d).get_pcy());
+      }
+      break;
+    }
+  }
+} // apply
+
+/*
+ * Undoes the last edit.  Returns 1 if there is nothing to undo.
+ */
+int history::undo(dungeon *d)
+{
+  uint32_t i;
+
+  if (edits.size() == undone || depth) {
+    return 1;
+  }
+  i = edits.size() - undone - 1;
+  apply(d, edits[i], edit_end(i), true);
+  undone++;
+
+  return 0;
+} // undo
+
+/*
+ * Redoes the last undone edit.  Returns 1 if there is nothing to redo.
+ */
+int history::redo(dungeon *d)
+{
+  uint32_t i;
+
+  if (!undone || depth) {
+    return 1;
+  }
+  i = edits.size() - undone;
+  apply(d, edits[i], edit_end(i), false);
+  undone--;
+
+  return 0;
+} // redo
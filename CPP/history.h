@@ -0,0 +1,70 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "dungeon.h"
+
+const size_t DEFAULT_HISTORY_BUDGET = 1 << 20;
+
+/*
+ * Undo and redo built on cell level diffs.
+ *
+ * Edits are encoded one after another in a byte log, oldest first.
+ * Each edit is a sequence of records:
+ *   'C' start(2) len(2), then per cell old terrain, old hardness,
+ *       new terrain, new hardness: a run of consecutive changed cells
+ *   'R' added x y xsize ysize: a room added (added = 1) or removed
+ *   'P' old_x old_y new_x new_y: the PC moved
+ * The last few edits in the log may have been undone.  They are redone
+ * by replaying them, and dropped as soon as a new edit is recorded.
+ *
+ * Changes are grouped into edits between begin() and end(), which nest.
+ * Changes made outside a group are not recorded.  The oldest edits are
+ * forgotten once the log holds more than the byte budget.
+ */
+class history {
+ private:
+  std::vector<uint8_t> log;
+  std::deque<size_t> edits; /* Offset of each edit in the log      */
+  size_t base;              /* Offset of the oldest edit kept      */
+  uint32_t undone;          /* Edits at the end that were undone   */
+  uint32_t depth;
+  bool recording;           /* The current edit changed something  */
+  size_t run_at, pc_at;     /* Current edit's last run, PC records */
+  size_t budget;
+
+  void start_record(void);
+  void trim(void);
+  size_t edit_end(uint32_t i);
+  void apply(dungeon *d, size_t from, size_t to, bool undo);
+ public:
+  history(size_t b) : log(), edits(), base(0), undone(0), depth(0),
+                      recording(false), run_at(SIZE_MAX), pc_at(SIZE_MAX),
+                      budget(b) {}
+
+  void begin(void);
+  void end(void);
+  void clear(void);
+  void record_cell(uint16_t i, terrain_type old_t, uint8_t old_h,
+                   terrain_type new_t, uint8_t new_h);
+  void record_room(uint8_t added, room *r);
+  void record_pc(uint8_t old_x, uint8_t old_y, uint8_t new_x, uint8_t new_y);
+  int undo(dungeon *d);
+  int redo(dungeon *d);
+
+  size_t get_used(void)
+  {
+    return log.size() - base;
+  }
+
+  size_t get_budget(void)
+  {
+    return budget;
+  }
+};
+
+#endif
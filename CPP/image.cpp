@@ -0,0 +1,311 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "corpus.h"
+#include "dungeon.h"
+#include "image.h"
+#include "path.h"
+#include "utils.h"
+
+/*
+ * Headless rendering of dungeons to binary PPM (P6) images, one cell to
+ * a scale x scale block of pixels.  Each kind of image maps a cell to
+ * one byte, which indexes a 256 entry color table; a pixel row is built
+ * once and written scale times.
+ */
+
+const char *image_kind_name[num_image_kinds] = {
+  "terrain",
+  "hardness",
+  "distance"
+};
+
+/* Distance image entries for walls and cells out of reach */
+static const uint8_t DIST_WALL = 0;
+static const uint8_t DIST_UNREACHABLE = 255;
+/* Terrain image entry for the PC, past the last terrain type */
+static const uint8_t TERRAIN_PC = ter_stairs_down + 1;
+
+static uint8_t palette[num_image_kinds][256][3];
+
+/*
+ * Linear blend through n evenly spaced colors, at t out of max
+ */
+static void ramp(const uint8_t stops[][3], uint32_t n, uint32_t t,
+                 uint32_t max, uint8_t out[3])
+{
+  uint32_t seg, pos, c;
+
+  pos = t * (n - 1) * 256 / max;
+  seg = pos >> 8;
+  if (seg >= n - 1) {
+    memcpy(out, stops[n - 1], 3);
+    return;
+  }
+  pos &= 0xff;
+  for (c = 0; c < 3; c++) {
+    out[c] = (stops[seg][c] * (256 - pos) + stops[seg + 1][c] * pos) >> 8;
+  }
+} // ramp
+
+static void set_color(uint8_t out[3], uint8_t r, uint8_t g, uint8_t b)
+{
+  out[0] = r;
+  out[1] = g;
+  out[2] = b;
+} // set_color
+
+/*
+ * Fills the color tables
+ */
+static void init_palette(void)
+{
+  static const uint8_t heat[][3] = {
+    { 0, 0, 160 }, { 0, 200, 255 }, { 0, 200, 0 },
+    { 255, 230, 0 }, { 220, 0, 0 }
+  };
+  static const uint8_t near_far[][3] = {
+    { 255, 255, 200 }, { 255, 170, 0 }, { 200, 0, 60 },
+    { 90, 0, 140 }, { 0, 0, 80 }
+  };
+  uint32_t i;
+  uint8_t (*p)[3];
+
+  p = palette[image_terrain];
+  for (i = 0; i < 256; i++) {
+    set_color(p[i], 255, 0, 255);
+  }
+  set_color(p[ter_unknown], 0, 0, 0);
+  set_color(p[ter_wall], 90, 90, 90);
+  set_color(p[ter_wall_immutable], 160, 160, 160);
+  set_color(p[ter_floor], 150, 120, 80);
+  set_color(p[ter_floor_hall], 150, 120, 80);
+  set_color(p[ter_floor_room], 215, 205, 175);
+  set_color(p[ter_stairs], 0, 200, 255);
+  set_color(p[ter_stairs_up], 0, 230, 0);
+  set_color(p[ter_stairs_down], 255, 80, 0);
+  set_color(p[TERRAIN_PC], 255, 255, 0);
+
+  /* Floor is black and the border white, walls run cold to hot */
+  p = palette[image_hardness];
+  set_color(p[0], 0, 0, 0);
+  for (i = 1; i < MAX_HARDNESS_VALUE; i++) {
+    ramp(heat, 5, i - 1, MAX_HARDNESS_VALUE - 2, p[i]);
+  }
+  set_color(p[MAX_HARDNESS_VALUE], 255, 255, 255);
+
+  /* Near cells are bright, far ones dark */
+  p = palette[image_distance];
+  set_color(p[DIST_WALL], 40, 40, 40);
+  for (i = 1; i < DIST_UNREACHABLE; i++) {
+    ramp(near_far, 5, i - 1, DIST_UNREACHABLE - 2, p[i]);
+  }
+  set_color(p[DIST_UNREACHABLE], 110, 0, 0);
+} // init_palette
+
+/* The tables are filled before main, so threads only ever read them */
+static struct palette_init {
+  palette_init()
+  {
+    init_palette();
+  }
+} palette_init;
+
+/*
+ * Checks the PC is placed and inside the border.  A decoded save
+ * guarantees it, but an image is plotted into a fixed array on a
+ * worker's stack, so it is checked again.
+ */
+static bool pc_inside(dungeon *d)
+{
+  return (*d).get_pcx() && (*d).get_pcx() < DUNGEON_X - 1 &&
+         (*d).get_pcy() && (*d).get_pcy() < DUNGEON_Y - 1;
+} // pc_inside
+
+/*
+ * Distances are measured from the PC, or without one from the up
+ * stairs, or failing that from the first floor cell
+ */
+static void distance_cells(dungeon *d, uint8_t cells[DUNGEON_Y][DUNGEON_X])
+{
+  uint16_t dist[DUNGEON_Y][DUNGEON_X];
+  uint16_t src, far, max;
+  uint32_t x, y;
+
+  src = DIST_INFINITY;
+  if (pc_inside(d) && walkable(d, (*d).get_pcx(), (*d).get_pcy())) {
+    src = cellidx((*d).get_pcx(), (*d).get_pcy());
+  }
+  for (y = 1; y < DUNGEON_Y - 1 && src == DIST_INFINITY; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (dmapxy(x, y) == ter_stairs_up) {
+        src = cellidx(x, y);
+        break;
+      }
+    }
+  }
+  for (y = 1; y < DUNGEON_Y - 1 && src == DIST_INFINITY; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (walkable(d, x, y)) {
+        src = cellidx(x, y);
+        break;
+      }
+    }
+  }
+  if (src == DIST_INFINITY) {
+    memset(cells, DIST_WALL, DUNGEON_X * DUNGEON_Y);
+    return;
+  }
+
+  if ((far = dist_map(d, &src, 1, dist)) == DIST_INFINITY) {
+    memset(cells, DIST_WALL, DUNGEON_X * DUNGEON_Y);
+    return;
+  }
+  max = dist[celly(far)][cellx(far)];
+  if (!max) {
+    max = 1;
+  }
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x++) {
+      if (!walkable(d, x, y)) {
+        cells[y][x] = DIST_WALL;
+      } else if (dist[y][x] == DIST_INFINITY) {
+        cells[y][x] = DIST_UNREACHABLE;
+      } else {
+        cells[y][x] = 1 + dist[y][x] * (DIST_UNREACHABLE - 2) / max;
+      }
+    }
+  }
+} // distance_cells
+
+/*
+ * Writes an image of the dungeon to file.  Returns 1 and sets errno
+ * on failure.
+ */
+int write_image(dungeon *d, image_kind kind, uint32_t scale,
+                const char *file)
+{
+  uint8_t cells[DUNGEON_Y][DUNGEON_X];
+  std::vector<uint8_t> row;
+  uint32_t x, y, i;
+  uint8_t *px;
+  FILE *f;
+  int err;
+
+  switch (kind) {
+  case image_terrain:
+    for (y = 0; y < DUNGEON_Y; y++) {
+      for (x = 0; x < DUNGEON_X; x++) {
+        cells[y][x] = dmapxy(x, y);
+      }
+    }
+    if (pc_inside(d)) {
+      cells[(*d).get_pcy()][(*d).get_pcx()] = TERRAIN_PC;
+    }
+    break;
+  case image_hardness:
+    memcpy(cells, d->h_map, sizeof (cells));
+    break;
+  default:
+    distance_cells(d, cells);
+  }
+
+  if (!(f = fopen(file, "w"))) {
+    return 1;
+  }
+  std::fprintf(f, "P6\n%u %u\n255\n", DUNGEON_X * scale, DUNGEON_Y * scale);
+  row.resize(DUNGEON_X * scale * 3);
+  for (y = 0; y < DUNGEON_Y; y++) {
+    px = &row[0];
+    for (x = 0; x < DUNGEON_X; x++) {
+      for (i = 0; i < scale; i++, px += 3) {
+        memcpy(px, palette[kind][cells[y][x]], 3);
+      }
+    }
+    for (i = 0; i < scale; i++) {
+      if (fwrite(&row[0], row.size(), 1, f) != 1) {
+        err = errno;
+        fclose(f);
+        errno = err;
+        return 1;
+      }
+    }
+  }
+
+  return fclose(f) ? 1 : 0;
+} // write_image
+
+/*
+ * Writes an image of every dungeon in a directory or archive to dir,
+ * as <name>.ppm, on jobs threads.  Saves that can't be read or decoded
+ * are reported and skipped.  Returns 1 if any image wasn't written.
+ */
+int export_images(const char *src, const char *dir, image_kind kind,
+                  uint32_t scale, uint32_t jobs)
+{
+  corpus c;
+  std::atomic<uint32_t> failed(0);
+  uint64_t start;
+
+  if (c.open(src)) {
+    return 1;
+  }
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    std::perror(dir);
+    return 1;
+  }
+
+  start = now_usec();
+  parallel_for(c.size(), jobs, [&](uint32_t i) {
+    dungeon d;
+    std::vector<uint8_t> buf;
+    std::string out;
+    const uint8_t *data;
+    const char *err;
+    size_t len;
+
+    if (c.get(i, buf, &data, &len)) {
+      std::fprintf(stderr, "%s: %s\n", c.name(i).c_str(), strerror(errno));
+      failed++;
+      return;
+    }
+    if (decode_dungeon(&d, data, len, &err)) {
+      std::fprintf(stderr, "%s: %s\n", c.name(i).c_str(), err);
+      failed++;
+      return;
+    }
+    out = std::string(dir) + "/" + c.name(i) + ".ppm";
+    if (write_image(&d, kind, scale, out.c_str())) {
+      std::perror(out.c_str());
+      failed++;
+    }
+    del_dungeon(&d);
+  });
+
+  std::fprintf(stderr, "Exported %u %s images to %s, %.1f us per dungeon\n",
+               c.size() - failed, image_kind_name[kind], dir,
+               c.size() ? (double) (now_usec() - start) / c.size() : 0.0);
+
+  return failed ? 1 : 0;
+} // export_images
+
+/*
+ * Looks up an image kind by name.  Returns 1 if there is none.
+ */
+int parse_image_kind(const char *name, image_kind *kind)
+{
+  uint32_t i;
+
+  for (i = 0; i < num_image_kinds; i++) {
+    if (!strcmp(name, image_kind_name[i])) {
+      *kind = (image_kind) i;
+      return 0;
+    }
+  }
+  return 1;
+} // parse_image_kind
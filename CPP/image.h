@@ -0,0 +1,28 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+
+class dungeon;
+
+/* What an exported image shows */
+enum image_kind {
+  image_terrain,
+  image_hardness,
+  image_distance,
+  num_image_kinds
+};
+
+/* Pixels per cell along each side */
+const uint32_t DEFAULT_IMAGE_SCALE = 2;
+const uint32_t MAX_IMAGE_SCALE = 16;
+
+extern const char *image_kind_name[num_image_kinds];
+
+int parse_image_kind(const char *name, image_kind *kind);
+int write_image(dungeon *d, image_kind kind, uint32_t scale,
+                const char *file);
+int export_images(const char *src, const char *dir, image_kind kind,
+                  uint32_t scale, uint32_t jobs);
+
+#endif
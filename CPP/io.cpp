@@ -1,19 +1,176 @@
+#include <algorithm>
 #include <iostream>
 #include <ncurses.h>
 #include <string>
 #include <unistd.h>
 
+#include "brush.h"
 #include "dungeon.h"
+#include "history.h"
 #include "io.h"
+#include "journal.h"
+#include "metrics.h"
+#include "mip.h"
+#include "path.h"
+#include "publish.h"
 #include "room.h"
+#include "save.h"
+#include "script.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "utils.h"
 
+static char hardness_to_char[] =
+  "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+enum display_mode {
+  display_none,
+  display_terrain,
+  display_hardness
+};
+
+static display_mode current_display = display_none;
+
+/* Shortest time between two paints, caps the frame rate at 60 Hz */
+static const uint64_t IO_FRAME_USEC = 1000000 / 60;
+
+/* How often to check on a background save while no keys arrive */
+static const int IO_SAVE_POLL_MSEC = 50;
+
+/* The part of the map visible on screen.  The message line is the *
+ * screen row just below it.                                       */
+static uint32_t view_x, view_y, view_w, view_h;
+
+static bool show_minimap = false;
+static bool minimap_stale = true;
+static mip_pyramid minimap;
+static uint32_t minimap_level;
+
+static bool show_stats = false;
+/* The layout as last measured in the background, and from which *
+ * snapshot version (0 before the first)                          */
+static dungeon_metrics layout;
+static uint64_t layout_version = 0;
+
+static const chtype minimap_glyph[] = {
+  WALL_CHAR,      /* mip_wall   */
+  HALL_CHAR,      /* mip_hall   */
+  ROOM_CHAR,      /* mip_room   */
+  STAIRS_DOWN_CHAR /* mip_stairs */
+};
+
+/* While set, moving the cursor stretches a selection rectangle from *
+ * the anchor cell to the cursor                                     */
+static bool select_mode = false;
+static uint32_t select_x, select_y;
+
+/* Glyphs for each terrain type, indexed [border row][terrain] */
+static chtype terrain_glyph[2][ter_stairs_down + 1];
+/* Glyphs for each hardness value */
+static chtype hardness_glyph[MAX_HARDNESS_VALUE + 1];
+
+/*
+ * Precompute the terrain and hardness glyphs so drawing a row is
+ * a table lookup per cell
+ */
+static void init_glyphs(void)
+{
+  uint32_t i, b;
+
+  for (b = 0; b < 2; b++) {
+    for (i = 0; i <= ter_stairs_down; i++) {
+      terrain_glyph[b][i] = UNKNOWN_CHAR;
+    }
+    terrain_glyph[b][ter_wall] = WALL_CHAR;
+    terrain_glyph[b][ter_floor_room] = ROOM_CHAR;
+    terrain_glyph[b][ter_floor] = HALL_CHAR;
+    terrain_glyph[b][ter_floor_hall] = HALL_CHAR;
+    terrain_glyph[b][ter_stairs_up] = STAIRS_UP_CHAR;
+    terrain_glyph[b][ter_stairs_down] = STAIRS_DOWN_CHAR;
+  }
+  /* Only the border is immutable, so rows are either all horizontal *
+   * border or have vertical border at both ends.                    */
+  terrain_glyph[0][ter_wall_immutable] = VERT_BORDER_CHAR;
+  terrain_glyph[1][ter_wall_immutable] = HORIZ_BORDER_CHAR;
+
+  /* Maximum hardness is 255.  We have 62 values to display it, but *
+   * we only want one zero value, so we need to cover [1,255] with  *
+   * 61 values, which gives us a divisor of 254 / 61 = 4.164.       *
+   * Generally, we want to avoid floating point math, but this is   *
+   * not gameplay, so we'll make an exception here to get maximal   *
+   * hardness display resolution.                                   */
+  hardness_glyph[0] = ' ';
+  for (i = 1; i <= MAX_HARDNESS_VALUE; i++) {
+    hardness_glyph[i] = hardness_to_char[1 + (int)(i / 4.2)];
+  }
+} // init_glyphs
+
+/*
+ * Size the view to the terminal, leaving a row for messages
+ */
+static void fit_view(void)
+{
+  view_w = (uint32_t) COLS < DUNGEON_X ? COLS : DUNGEON_X;
+  view_h = (uint32_t) LINES - 1 < DUNGEON_Y ? LINES - 1 : DUNGEON_Y;
+  if (!view_w) {
+    view_w = 1;
+  }
+  if (!view_h) {
+    view_h = 1;
+  }
+  if (view_x + view_w > DUNGEON_X) {
+    view_x = DUNGEON_X - view_w;
+  }
+  if (view_y + view_h > DUNGEON_Y) {
+    view_y = DUNGEON_Y - view_h;
+  }
+} // fit_view
+
+/*
+ * Scroll the view so the cursor is on screen, leaving a quarter of
+ * the view as margin so walking along doesn't scroll every step.
+ * Returns true if the view moved.
+ */
+static bool follow_cursor(dungeon *d)
+{
+  uint32_t curs_x, curs_y, old_x, old_y;
+
+  curs_x = (*d).get_cursx();
+  curs_y = (*d).get_cursy();
+  old_x = view_x;
+  old_y = view_y;
+
+  if (curs_x < view_x) {
+    view_x = curs_x > (view_w >> 2) ? curs_x - (view_w >> 2) : 0;
+  } else if (curs_x >= view_x + view_w) {
+    view_x = curs_x + (view_w >> 2) + 1 - view_w;
+  }
+  if (curs_y < view_y) {
+    view_y = curs_y > (view_h >> 2) ? curs_y - (view_h >> 2) : 0;
+  } else if (curs_y >= view_y + view_h) {
+    view_y = curs_y + (view_h >> 2) + 1 - view_h;
+  }
+  fit_view();
+
+  return view_x != old_x || view_y != old_y;
+} // follow_cursor
+
 /*
  * Initialize terminal for ncurses
  */
 void io_init_terminal(void)
 {
   initscr();
+  io_init_screen();
+} // io_init_terminal
+
+/*
+ * Set up the current ncurses screen for drawing dungeons.  Split out
+ * so screens made with newterm, like the benchmarks' headless one,
+ * get the same setup.
+ */
+void io_init_screen(void)
+{
   raw();
   noecho();
   curs_set(1);
@@ -26,7 +183,9 @@ void io_init_terminal(void)
   init_pair(COLOR_MAGENTA, COLOR_MAGENTA, COLOR_BLACK);
   init_pair(COLOR_CYAN, COLOR_CYAN, COLOR_BLACK);
   init_pair(COLOR_WHITE, COLOR_WHITE, COLOR_BLACK);
-} // io_init_terminal
+  init_glyphs();
+  fit_view();
+} // io_init_screen
 
 /*
  * Deinitialize ncurses
@@ -42,7 +201,7 @@ void io_reset_terminal(void)
 void print_message(const char *msg)
 {
   attron(COLOR_PAIR(COLOR_CYAN));
-  mvprintw(21, 1, "%s", msg);
+  mvprintw(view_h, 1, "%s", msg);
   attroff(COLOR_PAIR(COLOR_CYAN));
 } // print_message
 
@@ -52,7 +211,7 @@ void print_message(const char *msg)
 void print_error(const char *err)
 {
   attron(COLOR_PAIR(COLOR_RED));
-  mvprintw(21, 1, "%s", err);
+  mvprintw(view_h, 1, "%s", err);
   attroff(COLOR_PAIR(COLOR_RED));
 } // print_message
 
@@ -63,85 +222,270 @@ void clear_message(void)
 {
   uint8_t x;
 
-  for(x = 0; x < DUNGEON_X; x++) {
-    mvaddch(21, x, ' ');
+  for(x = 0; x < view_w; x++) {
+    mvaddch(view_h, x, ' ');
   }
 } // clear_message
 
-static char hardness_to_char[] =
-  "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+/*
+ * Draw the minimap in the top right corner of the screen.  Cells
+ * inside the view are highlighted when the map doesn't fit.
+ */
+static void draw_minimap(dungeon *d, display_mode mode)
+{
+  mip_level *level;
+  uint32_t x, y, x0, y0, scale, lx0, lx1, ly0, ly1;
+  chtype c;
+
+  if (minimap_stale) {
+    minimap.build(d);
+    minimap_stale = false;
+  } else {
+    for (y = 0; y < DUNGEON_Y; y++) {
+      for (x = (*d).get_dirtyx0(y); x < (*d).get_dirtyx1(y); x++) {
+        minimap.update(d, x, y);
+      }
+    }
+  }
+
+  minimap_level = minimap.fit_level(view_w >> 2, view_h >> 1);
+  level = &minimap.levels[minimap_level];
+  scale = minimap_level;
+  x0 = view_w - level->width;
+  y0 = 0;
+  lx0 = view_x >> scale;
+  lx1 = (view_x + view_w - 1) >> scale;
+  ly0 = view_y >> scale;
+  ly1 = (view_y + view_h - 1) >> scale;
+
+  for (y = 0; y < level->height; y++) {
+    for (x = 0; x < level->width; x++) {
+      if (mode == display_hardness) {
+        c = hardness_glyph[level->hardness[y * level->width + x]];
+      } else {
+        c = minimap_glyph[level->terrain[y * level->width + x]];
+        if ((*d).get_pcx() && (*d).get_pcy() &&
+            x == (uint32_t) ((*d).get_pcx() >> scale) &&
+            y == (uint32_t) ((*d).get_pcy() >> scale)) {
+          c = PC_CHAR;
+        }
+      }
+      if ((view_w < DUNGEON_X || view_h < DUNGEON_Y) &&
+          x >= lx0 && x <= lx1 && y >= ly0 && y <= ly1) {
+        c |= A_REVERSE;
+      }
+      mvaddch(y0 + y, x0 + x, c);
+    }
+  }
+} // draw_minimap
 
 /*
- * Display the hardness values in the terminal
+ * The selection rectangle, inclusive of both corners
  */
-void io_display_hardness(dungeon *d)
+static void selection_bounds(dungeon *d, uint32_t *x0, uint32_t *y0,
+                             uint32_t *x1, uint32_t *y1)
 {
-  uint32_t y, x;
-  
-  clear();
-  for (y = 0; y < DUNGEON_Y; y++) {
-    for (x = 0; x < DUNGEON_X; x++) {
-      /* Maximum hardness is 255.  We have 62 values to display it, but *
-       * we only want one zero value, so we need to cover [1,255] with  *
-       * 61 values, which gives us a divisor of 254 / 61 = 4.164.       *
-       * Generally, we want to avoid floating point math, but this is   *
-       * not gameplay, so we'll make an exception here to get maximal   *
-       * hardness display resolution.                                   */
-      mvaddch(y, x, (hmapxy(x, y)                                       ?
-		     hardness_to_char[1 + (int)(hmapxy(x, y)/4.2)] : ' '));
+  *x0 = std::min(select_x, (uint32_t) (*d).get_cursx());
+  *x1 = std::max(select_x, (uint32_t) (*d).get_cursx());
+  *y0 = std::min(select_y, (uint32_t) (*d).get_cursy());
+  *y1 = std::max(select_y, (uint32_t) (*d).get_cursy());
+} // selection_bounds
+
+/* Rows the stats overlay covers: a heading, one per stat and the *
+ * layout                                                          */
+static const uint32_t STATS_ROWS = num_stats + 2;
+
+/*
+ * Draw the timing histograms over the top left of the map
+ */
+static void draw_stats(void)
+{
+  static histogram stats[num_stats];
+  char line[96], text[80];
+  uint32_t i;
+
+  stats_collect(stats);
+
+  snprintf(line, sizeof (line), "%-14s %8s %9s %9s %9s %9s",
+           "us", "count", "mean", "p50", "p99", "max");
+  mvaddnstr(0, 0, line, view_w);
+  for (i = 0; i < num_stats && i + 1 < view_h; i++) {
+    snprintf(line, sizeof (line), "%-14s %8llu %9.1f %9.1f %9.1f %9.1f",
+             stat_name[i], (unsigned long long) stats[i].count,
+             stats[i].mean() / 1000.0, stats[i].percentile(50) / 1000.0,
+             stats[i].percentile(99) / 1000.0, stats[i].max / 1000.0);
+    mvaddnstr(i + 1, 0, line, view_w);
+  }
+  if (i + 1 < view_h) {
+    if (layout_version) {
+      snprintf(text, sizeof (text), "layout v%llu: %u rooms, %u regions, "
+               "%u dead ends, PC reaches %u%%",
+               (unsigned long long) layout_version, layout.rooms,
+               layout.components, layout.dead_ends,
+               layout.walkable ? 100 * layout.reachable / layout.walkable : 0);
+    } else {
+      snprintf(text, sizeof (text), "layout: measuring");
     }
+    /* Padded to cover a longer line from before */
+    snprintf(line, sizeof (line), "%-72s", text);
+    mvaddnstr(i + 1, 0, line, view_w);
   }
-  move((*d).get_cursy(), (*d).get_cursx());
-  refresh();
-} // io_display_hardness
+} // draw_stats
 
 /*
- * Display dungeon to the terminal
+ * Redraw the parts of the map that changed since the last draw.
+ * Each dirty span inside the view is built from the glyph tables and
+ * written with a single call, then the cursor is restored.  Nothing
+ * reaches the terminal until the next refresh.
  */
-void io_display(dungeon *d)
+static void draw_dirty(dungeon *d, display_mode mode)
 {
-  uint8_t x, y, x_max, y_max, pcx, pcy;
+  chtype row[DUNGEON_X];
+  const chtype *glyph;
+  uint32_t x, y, x0, x1, pcx, pcy, sx0, sy0, sx1, sy1;
+  STATS(stat_display);
+
+  if (mode != current_display) {
+    current_display = mode;
+    (*d).mark_all_dirty();
+  }
+  if (follow_cursor(d)) {
+    (*d).mark_all_dirty();
+  }
 
   pcx = (*d).get_pcx();
   pcy = (*d).get_pcy();
-  x_max = DUNGEON_X - 1;
-  y_max = DUNGEON_Y - 1;
-  
-  clear();
-  for(y = 0; y < DUNGEON_Y; y++) {
-    for(x = 0; x < DUNGEON_X; x++) {
-      if(x && y && (x == pcx) && (y == pcy)) {
-	mvaddch(y, x, PC_CHAR);
-      } else {
-	switch(d->d_map[y][x])
-	  {
-	  case ter_wall:
-	    mvaddch(y, x, WALL_CHAR);
-	    break;
-	  case ter_wall_immutable:
-	    if(y == 0 || y == y_max) {
-	      mvaddch(y, x, HORIZ_BORDER_CHAR);
-	    } else if(x == 0 || x == x_max) {
-	      mvaddch(y, x, VERT_BORDER_CHAR);
-	    }
-	    break;
-	  case ter_floor_room:
-	    mvaddch(y, x, ROOM_CHAR);
-	    break;
-	  case ter_floor:
-	  case ter_floor_hall:
-	    mvaddch(y, x, HALL_CHAR);
-	    break;
-	  default:
-	    mvaddch(y, x, UNKNOWN_CHAR);
-	  }
+  if (select_mode) {
+    selection_bounds(d, &sx0, &sy0, &sx1, &sy1);
+  }
+  for (y = view_y; y < view_y + view_h; y++) {
+    if (!(*d).row_dirty(y)) {
+      continue;
+    }
+    x0 = (*d).get_dirtyx0(y);
+    x1 = (*d).get_dirtyx1(y);
+    if (x0 < view_x) {
+      x0 = view_x;
+    }
+    if (x1 > view_x + view_w) {
+      x1 = view_x + view_w;
+    }
+    if (x0 >= x1) {
+      continue;
+    }
+    if (mode == display_hardness) {
+      for (x = x0; x < x1; x++) {
+        row[x] = hardness_glyph[hmapxy(x, y)];
+      }
+    } else {
+      glyph = terrain_glyph[y == 0 || y == DUNGEON_Y - 1];
+      for (x = x0; x < x1; x++) {
+        row[x] = glyph[dmapxy(x, y)];
+      }
+      if (pcx && pcy && y == pcy && x0 <= pcx && pcx < x1) {
+        row[pcx] = PC_CHAR;
       }
     }
+    if (select_mode && y >= sy0 && y <= sy1) {
+      for (x = std::max(x0, sx0); x < x1 && x <= sx1; x++) {
+        row[x] |= A_REVERSE;
+      }
+    }
+    mvaddchnstr(y - view_y, x0 - view_x, row + x0, x1 - x0);
   }
-  move((*d).get_cursy(), (*d).get_cursx());
-  refresh();
+
+  if (show_minimap) {
+    draw_minimap(d, mode);
+  } else {
+    minimap_stale = true;
+  }
+  if (show_stats) {
+    draw_stats();
+  }
+  (*d).clear_dirty();
+
+  move((*d).get_cursy() - view_y, (*d).get_cursx() - view_x);
+} // draw_dirty
+
+/*
+ * Display the hardness values in the terminal
+ */
+void io_display_hardness(dungeon *d)
+{
+  draw_dirty(d, display_hardness);
+} // io_display_hardness
+
+/*
+ * Display dungeon to the terminal
+ */
+void io_display(dungeon *d)
+{
+  draw_dirty(d, display_terrain);
 } // io_display
 
+/*
+ * Redraw whatever map is currently displayed
+ */
+static void io_redisplay(dungeon *d)
+{
+  draw_dirty(d, current_display == display_hardness ? display_hardness :
+                                                      display_terrain);
+} // io_redisplay
+
+/*
+ * Move the terminal cursor to the dungeon cursor, scrolling the
+ * view if the dungeon cursor left it
+ */
+static void io_move_cursor(dungeon *d)
+{
+  if ((*d).get_cursx() < view_x || (*d).get_cursx() >= view_x + view_w ||
+      (*d).get_cursy() < view_y || (*d).get_cursy() >= view_y + view_h) {
+    io_redisplay(d);
+  } else {
+    move((*d).get_cursy() - view_y, (*d).get_cursx() - view_x);
+  }
+} // io_move_cursor
+
+/*
+ * Draws a character at a map position if it is in view
+ */
+static void map_addch(uint32_t y, uint32_t x, chtype c)
+{
+  if (x >= view_x && x < view_x + view_w &&
+      y >= view_y && y < view_y + view_h) {
+    mvaddch(y - view_y, x - view_x, c);
+  }
+} // map_addch
+
+/*
+ * Show or hide the stats overlay.  Timing starts when it is first
+ * shown, if --stats didn't already turn it on.
+ */
+static void toggle_stats(dungeon *d)
+{
+  if (show_stats) {
+    (*d).mark_dirty(view_x, view_y, view_w, std::min(STATS_ROWS, view_h));
+  }
+  show_stats = !show_stats;
+  stats_enabled = true;
+} // toggle_stats
+
+/*
+ * Show or hide the minimap.  Hiding it uncovers the map under it.
+ */
+static void toggle_minimap(dungeon *d)
+{
+  mip_level *level;
+
+  if (show_minimap && !minimap.levels.empty()) {
+    level = &minimap.levels[minimap_level];
+    (*d).mark_dirty(view_x + view_w - level->width, view_y,
+                    level->width, level->height);
+  }
+  show_minimap = !show_minimap;
+  io_redisplay(d);
+} // toggle_minimap
+
 /*
  * Check if it is valid to move cursor in given direction
  * Updates the cursor position if valid
@@ -177,112 +521,19 @@ bool valid_corridor_move(dungeon *d, int x_dir, int y_dir)
  * Places a corridor character at the current cursor position
  * if the current position is not in a room
  */
-void place_corridor(dungeon *d)
+uint8_t place_corridor(dungeon *d)
 {
   uint8_t x, y;
   
   x = (*d).get_cursx();
   y = (*d).get_cursy();
-
-  dmapxy(x, y) = ter_floor_hall;
-  hmapxy(x, y) = 0;
-  addch(HALL_CHAR);
-  move(y, x);
-  refresh();
+  if(add_corridor(d, x, y)) {
+    return 1;
+  }
+  record_edit("corridor %u %u", x, y);
+  return 0;
 } // place_corridor
 
-/*
- * Moving cursor position causes corridor character to be placed
- * at that position. Cursor is not able to move through rooms. 
- */
-void place_corridors(dungeon *d)
-{
-  uint8_t done = 0;
-
-  place_corridor(d);
-  do {
-    switch(getch())
-      {
-      case KEY_UP:
-      case 'k':
-      case '8':
-	/* Place corridor up */
-	if(valid_corridor_move(d, 0, -1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case KEY_DOWN:
-      case 'j':
-      case '2':
-	/* Place corridor down */
-	if(valid_corridor_move(d, 0, 1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case KEY_RIGHT:
-      case 'l':
-      case '6':
-	/* Place corridor right */
-	if(valid_corridor_move(d, 1, 0)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case KEY_LEFT:
-      case 'h':
-      case '4':
-	/* Place corridor left */
-	if(valid_corridor_move(d, -1, 0)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case 'y':
-      case '7':
-      case KEY_HOME:
-	/* Place corridor up left */
-	if(valid_corridor_move(d, -1, -1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case 'u':
-      case '9':
-      case KEY_PPAGE:
-	/* Place corridor up right */
-	if(valid_corridor_move(d, 1, -1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case 'b':
-      case '1':
-      case KEY_END:
-      /* Place corridor down left */
-	if(valid_corridor_move(d, -1, 1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case 'n':
-      case '3':
-      case KEY_NPAGE:
-	/* Place corridor down right */
-	if(valid_corridor_move(d, 1, 1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  place_corridor(d);
-	}
-	break;
-      case 'C':
-      case 'c':
-	done = 1;
-	break;
-      }
-  } while (!done);
-} // place_corridors
-
 /*
  * Places a wall character at the current cursor position
  * if the current position is not in a room
@@ -293,34 +544,54 @@ uint8_t place_wall(dungeon *d)
   
   x = (*d).get_cursx();
   y = (*d).get_cursy();
-  if(dmapxy(x, y) != ter_floor_room) {
-    dmapxy(x, y) = ter_wall;
-    hmapxy(x, y) = rand_range(1, (MAX_HARDNESS_VALUE - 1));
-    addch(WALL_CHAR);
-    move(y, x);
-    refresh();
-    return 0;
+  if(add_wall(d, x, y)) {
+    return 1;
   }
-  return 1;
+  record_edit("wall %u %u", x, y);
+  return 0;
 } // place_wall
 
 /*
- * Check if there is a room in the given area
- * There must be a padding of 1 tile between rooms
+ * Fills the selection with corridor or wall tiles as one pass.  Walls
+ * all get the same random hardness.
  */
-bool room_present(dungeon *d, uint8_t x, uint8_t y, uint8_t xrng, uint8_t yrng)
+static void fill_selection(dungeon *d, terrain_type t)
 {
-  uint8_t i, j;
+  uint32_t x0, y0, x1, y1;
+  uint8_t h;
+  char msg[80];
 
-  for(j = (y - 1); j < (y + yrng + 1); j++) {
-    for(i = (x - 1); i < (x + xrng + 1); i++) {
-      if(dmapxy(i, j) == ter_floor_room) {
-	return true;
-      }
-    }
+  selection_bounds(d, &x0, &y0, &x1, &y1);
+  h = fill_hardness(t);
+  snprintf(msg, sizeof (msg), "Filled %u cells.",
+           fill_rect(d, x0, y0, x1 - x0 + 1, y1 - y0 + 1, t, h));
+  record_edit("fill %s %u %u %u %u", t == ter_wall ? "wall" : "corridor",
+              x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+  print_message(msg);
+} // fill_selection
+
+/*
+ * Flood fills the region under the cursor with corridor or wall tiles
+ */
+static void flood_cursor(dungeon *d, terrain_type t)
+{
+  uint8_t x, y, h;
+  uint32_t filled;
+  char msg[80];
+
+  x = (*d).get_cursx();
+  y = (*d).get_cursy();
+  /* A failed flood isn't recorded, so it mustn't use up a number */
+  if(!fillable(d, x, y)) {
+    print_error("Cannot fill rooms.");
+    return;
   }
-  return false;
-} // room_present
+  h = fill_hardness(t);
+  filled = flood_fill(d, x, y, t, h);
+  record_edit("flood %s %u %u", t == ter_wall ? "wall" : "corridor", x, y);
+  snprintf(msg, sizeof (msg), "Filled %u cells.", filled);
+  print_message(msg);
+} // flood_cursor
 
 /*
  * Place a room at the cursor location
@@ -337,13 +608,16 @@ void place_room(dungeon *d)
   ysize = MIN_ROOM_YSIZE;
   if((x + xsize) < DUNGEON_X && (y + ysize) < DUNGEON_Y &&
      !room_present(d, x, y, xsize, ysize)) {
-    /* Setup minimum room */
+    io_redisplay(d);
+    /* Setup minimum room.  The preview draws over the map, so every *
+     * cell it touches is marked to be redrawn once placement ends.  */
     for(j = y; j < y + ysize; j++) {
       for(i = x; i < x + xsize; i++) {
-	mvaddch(j, i, ROOM_CHAR);
+	map_addch(j, i, ROOM_CHAR);
       }
     }
-    move(y, x);
+    (*d).mark_dirty(x, y, xsize, ysize);
+    io_move_cursor(d);
     refresh();
     /* Allow size alteration */
     do {
@@ -358,9 +632,9 @@ void place_room(dungeon *d)
 	    ysize--;
 	    j = y + ysize;
 	    for(i = x; i < x + xsize; i++) {
-	      mvaddch(j, i, WALL_CHAR);
+	      map_addch(j, i, WALL_CHAR);
 	    }
-	    move(y, x);
+	    io_move_cursor(d);
 	    refresh();
 	  }
 	  break;
@@ -379,10 +653,11 @@ void place_room(dungeon *d)
 	    if(!inval) {
 	      j = y + ysize;
 	      for(i = x; i < x + xsize; i++) {
-		mvaddch(j, i, ROOM_CHAR);
+		map_addch(j, i, ROOM_CHAR);
 	      }
+	      (*d).mark_dirty(x, j, xsize, 1);
 	      ysize++;
-	      move(y, x);
+	      io_move_cursor(d);
 	      refresh();
 	    }
 	  }
@@ -402,10 +677,11 @@ void place_room(dungeon *d)
 	    if(!inval) {
 	      i = x + xsize;
 	      for(j = y; j < y + ysize; j++) {
-		mvaddch(j, i, ROOM_CHAR);
+		map_addch(j, i, ROOM_CHAR);
 	      }
+	      (*d).mark_dirty(i, y, 1, ysize);
 	      xsize++;
-	      move(y, x);
+	      io_move_cursor(d);
 	      refresh();
 	    }
 	  }
@@ -418,9 +694,9 @@ void place_room(dungeon *d)
 	    xsize--;
 	    i = x + xsize;
 	    for(j = y; j < y + ysize; j++) {
-	      mvaddch(j, i, WALL_CHAR);
+	      map_addch(j, i, WALL_CHAR);
 	    }
-	    move(y, x);
+	    io_move_cursor(d);
 	    refresh();
 	  }
 	  break;
@@ -431,16 +707,10 @@ void place_room(dungeon *d)
 	  quit = 1;
 	}
     } while (!quit && !add);
-    if(add) {
-      d->rooms.push_back(new room(x, y, xsize, ysize));
-      for(j = y; j < y + ysize; j++) {
-	for(i = x; i < x + xsize; i++) {
-	  dmapxy(i, j) = ter_floor_room;
-	  hmapxy(i, j) = 0;
-	}
-      }
+    if(add && !add_room(d, x, y, xsize, ysize)) {
+      record_edit("room %u %u %u %u", x, y, xsize, ysize);
     }
-    io_display(d);
+    io_redisplay(d);
   }
 } // place_room
 
@@ -449,37 +719,25 @@ void place_room(dungeon *d)
  */
 void del_room(dungeon *d)
 {
-  uint8_t cursx, cursy, x, y, i;
+  uint8_t x, y;
   int input;
 
-  cursx = (*d).get_cursx();
-  cursy = (*d).get_cursy();
+  x = (*d).get_cursx();
+  y = (*d).get_cursy();
   
+  io_redisplay(d);
   print_message("Delete Room? (y/n): ");
   input = getch();
   if(input == 'y' || input == 'Y') {
-    x = cursx;
-    y = cursy;
-    for(i = 0; i < d->rooms.size(); i++) {
-      if((*d->rooms[i]).contains(x, y)) {
-	for(y = (*d->rooms[i]).get_y();
-	    y < (*d->rooms[i]).get_y() + (*d->rooms[i]).get_ysize();
-	    y++) {
-	  for(x = (*d->rooms[i]).get_x();
-	      x < (*d->rooms[i]).get_x() + (*d->rooms[i]).get_xsize();
-	      x++) {
-	    dmapxy(x, y) = ter_wall;
-	    hmapxy(x, y) = rand_range(1, (MAX_HARDNESS_VALUE - 1));
-	}
-	}
-	d->rooms.erase(d->rooms.begin() + i);
-      }
+    if(!remove_room(d, x, y)) {
+      record_edit("delete %u %u", x, y);
     }
-    io_display(d);
+    clear_message();
+    io_redisplay(d);
   } else {
     clear_message();
   }
-  move(cursy, cursx);
+  io_move_cursor(d);
 } // del_room
 
 /* Save the dungeon to disc */
@@ -487,15 +745,22 @@ int save_dungeon(dungeon *d)
 {
   uint8_t win_y = 2;
   uint8_t win_x = 0;
-  uint8_t win_width = DUNGEON_X - (win_x << 1);
-  uint8_t win_height = DUNGEON_Y - (win_y << 1);
+  uint8_t win_width = view_w - (win_x << 1);
+  uint8_t win_height = view_h - (win_y << 1);
   uint8_t sprompt_y = 3;
   uint8_t warning_y = sprompt_y + 4;
   std::vector<const char *> warnings = std::vector<const char *>();
 
+  /* Bring the map up to date underneath the save window */
+  io_redisplay(d);
+  refresh();
+
   /* Create save window */
   WINDOW *save_win;
-  save_win = newwin(win_height, win_width, win_y, win_x);
+  if(view_h < 16 || !(save_win = newwin(win_height, win_width, win_y, win_x))) {
+    print_error("Terminal too small to save.");
+    return 1;
+  }
   keypad(save_win, TRUE);
   box(save_win, 0, 0);
 
@@ -559,19 +824,30 @@ int save_dungeon(dungeon *d)
     }
   } while(!save && !cncl);
 
-  if(save) {
-    if(filename.length() > 0) {
-      write_dungeon(d, filename.c_str());
-    } else {
-      write_dungeon(d, nullptr);
-    }
-  }
   /* Clear the border then deallocate memory for inventory window */
   wborder(save_win, ' ', ' ', ' ',' ',' ',' ',' ',' ');
   wrefresh(save_win);
   delwin(save_win);
 
-  io_display(d);
+  (*d).mark_dirty(view_x + win_x, view_y + win_y, win_width, win_height);
+  io_redisplay(d);
+
+  /* The save is written in the background; the status line says *
+   * when it is done.                                            */
+  clear_message();
+  if(save) {
+    if(save_async(d, filename.length() ? filename.c_str() : nullptr)) {
+      print_error("A save is already in progress.");
+    } else {
+      if(filename.length()) {
+	record_edit("save %s", filename.c_str());
+      } else {
+	record_edit("save");
+      }
+      print_message("Saving...");
+    }
+  }
+  io_move_cursor(d);
   
   return 0;
 } // save_dungeon
@@ -585,171 +861,468 @@ uint8_t place_pc(dungeon *d)
 
   x = (*d).get_cursx();
   y = (*d).get_cursy();
-  if(dmapxy(x, y) > ter_wall_immutable) {
-    (*d).set_pcx(x);
-    (*d).set_pcy(y);
-    addch(PC_CHAR);
-    refresh();
-    return 0;
+  if(move_pc(d, x, y)) {
+    return 1;
   }
-  return 1;
+  record_edit("pc %u %u", x, y);
+  return 0;
 } // place_pc
 
 /*
- * Handle user input to the program
+ * Translate a movement key into a direction.  Returns false if the
+ * key doesn't move the cursor.
+ */
+static bool key_direction(int key, int *x_dir, int *y_dir)
+{
+  switch(key)
+    {
+    case KEY_UP:
+    case 'k':
+    case '8':
+      *x_dir = 0;
+      *y_dir = -1;
+      return true;
+    case KEY_DOWN:
+    case 'j':
+    case '2':
+      *x_dir = 0;
+      *y_dir = 1;
+      return true;
+    case KEY_RIGHT:
+    case 'l':
+    case '6':
+      *x_dir = 1;
+      *y_dir = 0;
+      return true;
+    case KEY_LEFT:
+    case 'h':
+    case '4':
+      *x_dir = -1;
+      *y_dir = 0;
+      return true;
+    case 'y':
+    case '7':
+    case KEY_HOME:
+      *x_dir = -1;
+      *y_dir = -1;
+      return true;
+    case 'u':
+    case '9':
+    case KEY_PPAGE:
+      *x_dir = 1;
+      *y_dir = -1;
+      return true;
+    case 'b':
+    case '1':
+    case KEY_END:
+      *x_dir = -1;
+      *y_dir = 1;
+      return true;
+    case 'n':
+    case '3':
+    case KEY_NPAGE:
+      *x_dir = 1;
+      *y_dir = 1;
+      return true;
+    }
+  return false;
+} // key_direction
+
+/* Radius of the hardness brushes */
+static uint8_t brush_radius = 2;
+
+/* While set, moving the cursor places corridor tiles */
+static bool corridor_mode = false;
+
+/* Input to paint latency of the frames drawn so far, in microseconds */
+static uint64_t latency_last, latency_max, latency_total, latency_frames;
+
+/*
+ * Undo or redo the last edit
+ */
+static void undo_edit(dungeon *d, bool redo)
+{
+  if(!d->hist) {
+    return;
+  }
+  if(redo ? (*d->hist).redo(d) : (*d->hist).undo(d)) {
+    print_error(redo ? "Nothing to redo." : "Nothing to undo.");
+  } else {
+    record_edit(redo ? "redo" : "undo");
+  }
+} // undo_edit
+
+/*
+ * Apply a hardness brush centered on the cursor
+ */
+static void brush_cursor(dungeon *d, brush_mode mode, uint8_t amount)
+{
+  static const char *mode_name[] = { "raise", "lower", "set", "smooth" };
+  uint8_t x, y;
+
+  x = (*d).get_cursx();
+  y = (*d).get_cursy();
+  if(apply_brush(d, x, y, brush_radius, mode, amount)) {
+    record_edit("brush %s %u %u %u %u", mode_name[mode], brush_radius,
+		amount, x, y);
+  }
+} // brush_cursor
+
+static bool apply_key(dungeon *d, int input);
+
+/*
+ * Apply one key to the dungeon.  Map changes are only marked dirty;
+ * they are drawn once the whole frame's input has been handled.
+ * Everything one key changes is undone together, or a whole run of
+ * continuous corridor placement.  Returns true if the user asked to
+ * quit.
+ */
+static bool handle_key(dungeon *d, int input)
+{
+  bool quit;
+  STATS(stat_key);
+
+  if(mvinch(view_h, 1) != ' ') {
+    clear_message();
+  }
+
+  if(!corridor_mode && (input == 'z' || input == 'Z')) {
+    undo_edit(d, input == 'Z');
+    return false;
+  }
+
+  if(d->hist) {
+    (*d->hist).begin();
+  }
+  quit = apply_key(d, input);
+  if(d->hist) {
+    (*d->hist).end();
+  }
+
+  return quit;
+} // handle_key
+
+static bool apply_key(dungeon *d, int input)
+{
+  int x_dir, y_dir;
+  uint32_t x0, y0, x1, y1;
+  char msg[80];
+
+  if(corridor_mode) {
+    /* Moving cursor position causes corridor character to be placed *
+     * at that position. Cursor is not able to move through rooms.   */
+    if(key_direction(input, &x_dir, &y_dir)) {
+      if(valid_corridor_move(d, x_dir, y_dir)) {
+	place_corridor(d);
+      }
+    } else if(input == 'c' || input == 'C') {
+      corridor_mode = false;
+      if(d->hist) {
+	(*d->hist).end();
+      }
+      record_edit("end");
+    }
+    return false;
+  }
+
+  if(select_mode) {
+    /* Moving the cursor stretches the selection, which is redrawn *
+     * as it changes.  c or w fills it, anything else cancels.     */
+    selection_bounds(d, &x0, &y0, &x1, &y1);
+    (*d).mark_dirty(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+    if(key_direction(input, &x_dir, &y_dir)) {
+      valid_move(d, x_dir, y_dir);
+      selection_bounds(d, &x0, &y0, &x1, &y1);
+      (*d).mark_dirty(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+      return false;
+    }
+    select_mode = false;
+    if(input == 'c') {
+      fill_selection(d, ter_floor_hall);
+    } else if(input == 'w') {
+      fill_selection(d, ter_wall);
+    }
+    return false;
+  }
+
+  if(key_direction(input, &x_dir, &y_dir)) {
+    /* Move cursor */
+    valid_move(d, x_dir, y_dir);
+    return false;
+  }
+
+  switch(input)
+    {
+    case 'c':
+      /* Place corrider tile at cursor location */
+      if(place_corridor(d)) {
+	print_error("Cannot place corridor over room tiles.");
+      }
+      break;
+    case 'C':
+      /* Continuously place corridor tiles, as one edit */
+      record_edit("begin");
+      if(d->hist) {
+	(*d->hist).begin();
+      }
+      if(!place_corridor(d)) {
+	corridor_mode = true;
+      } else {
+	if(d->hist) {
+	  (*d->hist).end();
+	}
+	record_edit("end");
+	print_error("Cannot place corridors over room tiles.");
+      }
+      break;
+    case 'w':
+      /* Place wall tile at cursor location */
+      if(place_wall(d)) {
+	print_error("Cannot place wall over room tile.");
+      }
+      break;
+    case 'v':
+      /* Start selecting a rectangle at the cursor */
+      select_mode = true;
+      select_x = (*d).get_cursx();
+      select_y = (*d).get_cursy();
+      (*d).mark_dirty(select_x, select_y);
+      print_message("Select: move to stretch, c or w to fill.");
+      break;
+    case 'f':
+      /* Flood fill the region under the cursor with corridor */
+      flood_cursor(d, ter_floor_hall);
+      break;
+    case 'F':
+      /* Flood fill the region under the cursor with wall */
+      flood_cursor(d, ter_wall);
+      break;
+    case '+':
+      /* Harden the walls around the cursor */
+      brush_cursor(d, brush_raise, BRUSH_STEP);
+      break;
+    case '-':
+      /* Soften the walls around the cursor */
+      brush_cursor(d, brush_lower, BRUSH_STEP);
+      break;
+    case '=':
+      /* Flatten the walls around the cursor to its hardness */
+      if(dmapxy((*d).get_cursx(), (*d).get_cursy()) != ter_wall) {
+	print_error("Set the brush hardness from a wall tile.");
+      } else {
+	brush_cursor(d, brush_set, hmapxy((*d).get_cursx(), (*d).get_cursy()));
+      }
+      break;
+    case '~':
+      /* Smooth the walls around the cursor */
+      brush_cursor(d, brush_smooth, 1);
+      break;
+    case '[':
+    case ']':
+      /* Shrink or grow the brush */
+      if(input == '[' && brush_radius > 0) {
+	brush_radius--;
+      } else if(input == ']' && brush_radius < MAX_BRUSH_RADIUS) {
+	brush_radius++;
+      }
+      snprintf(msg, sizeof (msg), "Brush radius %u.", brush_radius);
+      print_message(msg);
+      break;
+    case 'r':
+      /* Place room at cursor location */
+      if (d->rooms.size() < MAX_ROOM_COUNT) {
+	place_room(d);
+      } else {
+	print_error("Room limit reached. Delete rooms to add more.");
+      }
+      break;
+    case 'd':
+      /* Delete room at cursor location */
+      if(dmapxy((*d).get_cursx(), (*d).get_cursy()) == ter_floor_room) {
+	del_room(d);
+      }
+      break;
+    case 'p':
+      /* Place PC at cursor location */
+      if(place_pc(d)) {
+	print_error("Place PC in room or corridor.");
+      }
+      break;
+    case 's':
+      /* Place stairs as far from the PC and each other as possible */
+      if(place_stairs(d)) {
+	print_error("Not enough connected floor for stairs.");
+      }
+      record_edit("stairs");
+      break;
+    case 'D':
+      /* Display the default dungeon map */
+      io_display(d);
+      break;
+    case 'H':
+      /* Display the hardness map */
+      io_display_hardness(d);
+      print_message("Displaying hardness values.");
+      break;
+    case 'M':
+      /* Show or hide the minimap */
+      toggle_minimap(d);
+      break;
+    case 'T':
+      /* Show or hide the timing stats */
+      toggle_stats(d);
+      break;
+    case 'L':
+      /* Show the input to paint latency */
+      snprintf(msg, sizeof (msg),
+	       "Input to paint: last %llu us, mean %llu us, max %llu us",
+	       (unsigned long long) latency_last,
+	       (unsigned long long) (latency_frames ?
+				     latency_total / latency_frames : 0),
+	       (unsigned long long) latency_max);
+      print_message(msg);
+      break;
+    case KEY_RESIZE:
+      /* Refit the view to the new terminal size */
+      fit_view();
+      clear();
+      (*d).mark_all_dirty();
+      break;
+    case 'Q':
+      /* Quit the dungeon generator */
+      return true;
+    case 'S':
+      /* Save the dungeon */
+      save_dungeon(d);
+      break;
+    }
+  return false;
+} // handle_key
+
+/*
+ * Show the outcome of a background save once it has finished
+ */
+static void show_save_status(void)
+{
+  std::string msg;
+  bool failed;
+
+  if(save_poll(msg, &failed)) {
+    clear_message();
+    if(failed) {
+      print_error(msg.c_str());
+    } else {
+      print_message(msg.c_str());
+    }
+  }
+} // show_save_status
+
+/*
+ * Keeps the layout line of the stats overlay current: collects a
+ * finished measurement, and starts another on a fresh snapshot if the
+ * dungeon has changed since.  Nothing is measured while it is hidden.
+ */
+static void update_layout(dungeon *d)
+{
+  snapshot_ptr s;
+
+  measure_poll(&layout, &layout_version);
+  if (!show_stats || measure_pending()) {
+    return;
+  }
+  s = snapshot_dungeon(d);
+  if (s->version != layout_version) {
+    measure_async(s);
+  }
+} // update_layout
+
+/*
+ * Read a key, waiting at most delay milliseconds (-1 to block).
+ * Modal prompts read keys on their own, so blocking input is always
+ * restored before returning.
+ */
+static int read_key(int delay)
+{
+  int key;
+
+  timeout(delay);
+  key = getch();
+  timeout(-1);
+
+  return key;
+} // read_key
+
+/*
+ * Handle user input to the program.
+ *
+ * Each frame waits for a key, then handles every key already queued
+ * (auto repeat and pasted input arrive in bursts) and any arriving
+ * before the frame interval is up, and only then draws and refreshes.
+ * Keeping up with the input never waits on the terminal.
  */
 void io_mainloop(dungeon *d)
 {
-  int input;
-  uint8_t quit = 0;
-  
+  int input, delay, sync_delay;
+  bool quit;
+  uint64_t first_key, last_paint, now, latency;
+
+  quit = false;
+  last_paint = 0;
   do {
-    input = getch();
-    if(mvinch(21, 1) != ' ') {
-      clear_message();
+    /* While a save is being written or the layout measured, wake *
+     * up now and then to report when it is done, and wake up to  *
+     * sync the journal when its last edits are due               */
+    delay = save_pending() || measure_pending() ? IO_SAVE_POLL_MSEC : -1;
+    sync_delay = d->jrnl ? (*d->jrnl).sync_delay() : -1;
+    if(sync_delay >= 0 && (delay < 0 || sync_delay < delay)) {
+      delay = sync_delay;
     }
-    move((*d).get_cursy(), (*d).get_cursx());
-    switch(input)
-      {
-      case KEY_UP:
-      case 'k':
-      case '8':
-	/* Move cursor up */
-	if(valid_move(d, 0, -1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case KEY_DOWN:
-      case 'j':
-      case '2':
-	/* Move cursor down */
-	if(valid_move(d, 0, 1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case KEY_RIGHT:
-      case 'l':
-      case '6':
-	/* Move cursor right */
-	if(valid_move(d, 1, 0)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case KEY_LEFT:
-      case 'h':
-      case '4':
-	/* Move cursor left */
-	if(valid_move(d, -1, 0)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case 'y':
-      case '7':
-      case KEY_HOME:
-	/* Move cursor up left */
-	if(valid_move(d, -1, -1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case 'u':
-      case '9':
-      case KEY_PPAGE:
-	/* Move cursor up right */
-	if(valid_move(d, 1, -1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case 'b':
-      case '1':
-      case KEY_END:
-	/* Move cursor down left */
-	if(valid_move(d, -1, 1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case 'n':
-      case '3':
-      case KEY_NPAGE:
-	/* Move cursor down right */
-	if(valid_move(d, 1, 1)) {
-	  move((*d).get_cursy(), (*d).get_cursx());
-	  refresh();
-	}
-	break;
-      case 'c':
-	/* Place corrider tile at cursor location */
-	if(dmapxy((*d).get_cursx(), (*d).get_cursy()) != ter_floor_room) {
-	  place_corridor(d);
-	} else {
-	  print_error("Cannot place corridor over room tiles.");
-	  move((*d).get_cursy(), (*d).get_cursx());
-	}
-	break;
-      case 'C':
-	/* Continuously place corridor tiles */
-	if(dmapxy((*d).get_cursx(), (*d).get_cursy()) != ter_floor_room) {
-	  place_corridors(d);
-	} else {
-	  print_error("Cannot place corridors over room tiles.");
-	  move((*d).get_cursy(), (*d).get_cursx());
-	}
-	break;
-      case 'w':
-	/* Place wall tile at cursor location */
-	if(place_wall(d)) {
-	  print_error("Cannot place wall over room tile.");
-	  move((*d).get_cursy(), (*d).get_cursx());
-	}
-	break;
-      case 'r':
-	/* Place room at cursor location */
-	if (d->rooms.size() < MAX_ROOM_COUNT) {
-	  place_room(d);
-	} else {
-	  print_error("Room limit reached. Delete rooms to add more.");
-	  move((*d).get_cursy(), (*d).get_cursx());
-	}
-	break;
-      case 'd':
-	/* Delete room at cursor location */
-	if(dmapxy((*d).get_cursx(), (*d).get_cursy()) == ter_floor_room) {
-	  del_room(d);
-	}
-	break;
-      case 'p':
-	/* Place PC at cursor location */
-	if(place_pc(d)) {
-	  print_error("Place PC in room or corridor.");
-	  move((*d).get_cursy(), (*d).get_cursx());
-	}
-	break;
-      case 'D':
-	/* Display the default dungeon map */
-	io_display(d);
-	break;
-      case 'H':
-	/* Display the hardness map */
-	io_display_hardness(d);
-	print_message("Displaying hardness values.");
-	move((*d).get_cursy(), (*d).get_cursx());
-	break;
-      case 'Q':
-	/* Quit the dungeon generator */
-	quit = 1;
-	break;
-      case 'S':
-	/* Save the dungeon */
-	print_message("Saving...");
-	save_dungeon(d);
-	move((*d).get_cursy(), (*d).get_cursx());
+    input = read_key(delay);
+    if(input == ERR) {
+      if(d->jrnl && (*d->jrnl).sync()) {
+	print_error("Cannot sync the journal, edits may be lost in a crash.");
+      }
+      show_save_status();
+      update_layout(d);
+      io_redisplay(d);
+      refresh();
+      continue;
+    }
+    first_key = now_usec();
+    quit = handle_key(d, input);
+
+    /* Drain input until a frame has passed since the last paint */
+    while(!quit) {
+      now = now_usec();
+      if(now - last_paint < IO_FRAME_USEC) {
+	input = read_key((IO_FRAME_USEC - (now - last_paint) + 999) / 1000);
+      } else {
+	input = read_key(0);
+      }
+      if(input == ERR) {
 	break;
       }
+      quit = handle_key(d, input);
+    }
+
+    /* The frame's edits go to the journal in one write */
+    if(d->jrnl && (*d->jrnl).flush(d)) {
+      print_error("Cannot write the journal, edits may be lost in a crash.");
+    }
+    publish_update(d);
+    show_save_status();
+    update_layout(d);
+    io_redisplay(d);
+    refresh();
+    last_paint = now_usec();
+
+    latency = last_paint - first_key;
+    latency_last = latency;
+    latency_total += latency;
+    latency_frames++;
+    if(latency > latency_max) {
+      latency_max = latency;
+    }
   } while(!quit);
+  measure_wait();
 } // io_mainloop
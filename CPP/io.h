@@ -5,6 +5,8 @@ const char PC_CHAR = '@';
 const char WALL_CHAR = ' ';
 const char ROOM_CHAR = '.';
 const char HALL_CHAR = '#';
+const char STAIRS_UP_CHAR = '<';
+const char STAIRS_DOWN_CHAR = '>';
 const char HORIZ_BORDER_CHAR = '_';
 const char VERT_BORDER_CHAR = '|';
 const char UNKNOWN_CHAR = 'x';
@@ -12,6 +14,7 @@ const char UNKNOWN_CHAR = 'x';
 class dungeon;
 
 void io_init_terminal(void);
+void io_init_screen(void);
 void io_reset_terminal(void);
 void io_display_hardness(dungeon *d);
 void io_display(dungeon *d);
@@ -0,0 +1,247 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dungeon.h"
+#include "journal.h"
+#include "room.h"
+#include "utils.h"
+
+static const char JOURNAL_MAGIC[] = "DGNJ";
+
+journal::~journal()
+{
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/*
+ * The journal that goes with a save file (./dungeon if null)
+ */
+std::string journal_path(const char *file)
+{
+  return save_path(file) + ".journal";
+} // journal_path
+
+/*
+ * Starts journaling to file, beginning with a checkpoint of the
+ * dungeon as it is now.  Returns 1 if the journal can't be written.
+ */
+int journal::start(dungeon *d, const std::string& file)
+{
+  path = file;
+  return checkpoint(d);
+} // start
+
+/*
+ * Replaces the journal with a checkpoint of the dungeon.  The new
+ * journal is synced and renamed over the old one, so there is always a
+ * complete journal on disc.  Buffered edits are already part of the
+ * checkpoint and are dropped.
+ */
+int journal::checkpoint(dungeon *d)
+{
+  std::vector<uint8_t> buf, save;
+  uint32_t len;
+
+  encode_dungeon(d, save);
+  len = save.size();
+  buf.insert(buf.end(), JOURNAL_MAGIC, JOURNAL_MAGIC + 4);
+  buf.push_back('K');
+  buf.insert(buf.end(), (uint8_t *) &len, (uint8_t *) &len + 4);
+  buf.insert(buf.end(), save.begin(), save.end());
+
+  pending.clear();
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (write_save_file(path.c_str(), buf) ||
+      (fd = open(path.c_str(), O_WRONLY | O_APPEND)) < 0) {
+    return 1;
+  }
+  logged = 0;
+  last_sync = now_usec();
+  unsynced = false;
+
+  return 0;
+} // checkpoint
+
+/*
+ * Appends the buffered edits with a single write.  The journal is
+ * synced at most once every JOURNAL_SYNC_USEC, and checkpointed once
+ * enough edits pile up.  Returns 1 if the edits couldn't be written.
+ */
+int journal::flush(dungeon *d)
+{
+  size_t done;
+  ssize_t n;
+
+  if (fd < 0 || pending.empty()) {
+    return fd < 0;
+  }
+  for (done = 0; done < pending.size(); done += n) {
+    if ((n = write(fd, &pending[done], pending.size() - done)) < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      return 1;
+    }
+  }
+  logged += pending.size();
+  pending.clear();
+  unsynced = true;
+
+  if (logged >= JOURNAL_CHECKPOINT_BYTES) {
+    return checkpoint(d);
+  }
+  return sync();
+} // flush
+
+/*
+ * Milliseconds until appended edits are due to be synced, 0 if they
+ * are overdue, or -1 if there are none.  The editor waits for input
+ * no longer than this, so edits followed by a pause are synced too.
+ */
+int journal::sync_delay(void)
+{
+  uint64_t now;
+
+  if (fd < 0 || !unsynced) {
+    return -1;
+  }
+  now = now_usec();
+  if (now - last_sync >= JOURNAL_SYNC_USEC) {
+    return 0;
+  }
+  return (JOURNAL_SYNC_USEC - (now - last_sync) + 999) / 1000;
+} // sync_delay
+
+/*
+ * Syncs appended edits if JOURNAL_SYNC_USEC has passed since the last
+ * sync.  Returns 1 if the sync failed.
+ */
+int journal::sync(void)
+{
+  if (sync_delay()) {
+    return 0;
+  }
+  last_sync = now_usec();
+  unsynced = false;
+  return fdatasync(fd) ? 1 : 0;
+} // sync
+
+/*
+ * Stops journaling and deletes the journal, after a clean exit
+ */
+void journal::discard(void)
+{
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+    unlink(path.c_str());
+  }
+  pending.clear();
+} // discard
+
+/*
+ * Rebuilds the dungeon from a journal: the last checkpoint, then every
+ * edit after it.  A record cut short by a crash ends the replay.
+ * Returns 1 if the journal can't be read or holds no checkpoint.
+ */
+int recover_journal(dungeon *d, const std::string& file, uint32_t *replayed)
+{
+  std::vector<uint8_t> buf;
+  struct stat st;
+  const uint8_t *p, *end;
+  const char *err;
+  uint32_t len, n;
+  uint16_t i;
+  int fd;
+  bool restored;
+  ssize_t r;
+
+  if ((fd = open(file.c_str(), O_RDONLY)) < 0) {
+    std::perror(file.c_str());
+    return 1;
+  }
+  if (fstat(fd, &st)) {
+    std::perror(file.c_str());
+    close(fd);
+    return 1;
+  }
+  buf.resize(st.st_size);
+  for (n = 0; n < buf.size(); n += r) {
+    if ((r = read(fd, &buf[n], buf.size() - n)) <= 0) {
+      break;
+    }
+  }
+  close(fd);
+  if (n < 4 || memcmp(&buf[0], JOURNAL_MAGIC, 4)) {
+    std::fprintf(stderr, "%s: Not a dungeon journal.\n", file.c_str());
+    return 1;
+  }
+
+  restored = false;
+  *replayed = 0;
+  p = &buf[4];
+  end = &buf[0] + n;
+  while (p < end) {
+    if (*p == 'K' && end - p >= 5) {
+      memcpy(&len, p + 1, 4);
+      if ((size_t) (end - p - 5) < len) {
+        break;
+      }
+      if (decode_dungeon(d, p + 5, len, &err)) {
+        std::fprintf(stderr, "%s: %s\n", file.c_str(), err);
+        return 1;
+      }
+      restored = true;
+      *replayed = 0;
+      p += 5 + len;
+    } else if (*p == 'C' && end - p >= 5 && restored) {
+      memcpy(&i, p + 1, 2);
+      if (i >= DUNGEON_X * DUNGEON_Y || p[3] > ter_stairs_down) {
+        break;
+      }
+      (&d->d_map[0][0])[i] = (terrain_type) p[3];
+      (&d->h_map[0][0])[i] = p[4];
+      p += 5;
+    } else if (*p == 'R' && end - p >= 6 && restored) {
+      if (p[1]) {
+        d->rooms.push_back(new room(p[2], p[3], p[4], p[5]));
+      } else {
+        for (i = 0; i < d->rooms.size(); i++) {
+          if ((*d->rooms[i]).get_x() == p[2] &&
+              (*d->rooms[i]).get_y() == p[3]) {
+            delete d->rooms[i];
+            d->rooms.erase(d->rooms.begin() + i);
+            break;
+          }
+        }
+      }
+      p += 6;
+    } else if (*p == 'P' && end - p >= 3 && restored &&
+               !(*d).set_pc(p[1], p[2])) {
+      p += 3;
+    } else {
+      break;
+    }
+    (*replayed)++;
+  }
+  if (!restored) {
+    std::fprintf(stderr, "%s: No checkpoint in journal.\n", file.c_str());
+    return 1;
+  }
+  if ((*d).get_pcx() && (*d).get_pcy()) {
+    (*d).set_curs((*d).get_pcx(), (*d).get_pcy());
+  }
+  (*d).mark_all_dirty();
+
+  return 0;
+} // recover_journal
@@ -0,0 +1,84 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstring>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "dungeon.h"
+
+/* Start a fresh checkpoint once this many bytes of edits are logged */
+const size_t JOURNAL_CHECKPOINT_BYTES = 1 << 18;
+/* Longest an appended edit waits to be synced to disc */
+const uint64_t JOURNAL_SYNC_USEC = 1000000;
+
+/*
+ * Crash safe log of the edits made in the editor, kept next to the
+ * save file as <save>.journal.
+ *
+ * The journal starts with "DGNJ" and a checkpoint, a whole dungeon in
+ * the save file format.  Edits are appended after it as records:
+ *   'K' len(4) data    A checkpoint
+ *   'C' cell(2) t h    A cell changed terrain and hardness
+ *   'R' added x y w h  A room was added (added = 1) or removed
+ *   'P' x y            The PC moved
+ * Multi-byte fields are in host order; journals don't leave the
+ * machine that wrote them.
+ *
+ * Records are buffered and appended once per frame, and synced within
+ * JOURNAL_SYNC_USEC even if the editor then sits idle.  Every so often
+ * the journal is replaced by a new checkpoint so it stays short.  A
+ * clean exit deletes it; if it is still there at startup, the last
+ * session crashed and can be recovered.
+ */
+class journal {
+ private:
+  std::string path;
+  int fd;
+  std::vector<uint8_t> pending;
+  size_t logged;        /* Bytes appended since the last checkpoint */
+  uint64_t last_sync;
+  bool unsynced;        /* Edits appended since last_sync */
+
+ public:
+  journal() : path(), fd(-1), pending(), logged(0), last_sync(0),
+              unsynced(false) {}
+  ~journal();
+
+  int start(dungeon *d, const std::string& file);
+  int flush(dungeon *d);
+  int sync_delay(void);
+  int sync(void);
+  int checkpoint(dungeon *d);
+  void discard(void);
+
+  void record_cell(uint16_t i, terrain_type t, uint8_t h)
+  {
+    uint8_t rec[5] = { 'C', 0, 0, t, h };
+
+    memcpy(&rec[1], &i, 2);
+    pending.insert(pending.end(), rec, rec + 5);
+  }
+
+  void record_room(uint8_t added, room *r)
+  {
+    uint8_t rec[6] = { 'R', added, (*r).get_x(), (*r).get_y(),
+                       (*r).get_xsize(), (*r).get_ysize() };
+
+    pending.insert(pending.end(), rec, rec + 6);
+  }
+
+  void record_pc(uint8_t x, uint8_t y)
+  {
+    uint8_t rec[3] = { 'P', x, y };
+
+    pending.insert(pending.end(), rec, rec + 3);
+  }
+};
+
+std::string journal_path(const char *file);
+int recover_journal(dungeon *d, const std::string& file, uint32_t *replayed);
+
+#endif
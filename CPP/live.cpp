@@ -0,0 +1,129 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "live.h"
+
+/* Tries a reader makes while the writer is busy before yielding */
+static const uint32_t LIVE_SPIN = 64;
+/* Tries before a reader gives up until its next poll */
+static const uint32_t LIVE_TRIES = 256;
+
+/*
+ * The shared memory name for a link: name with a leading slash
+ */
+std::string live_name(const char *name)
+{
+  return name[0] == '/' ? std::string(name) : "/" + std::string(name);
+} // live_name
+
+/*
+ * Maps the segment an editor publishes to as name.  Returns 1 and
+ * prints why if there is none or it isn't a live link.
+ */
+int live_open(const char *name, live_link *l)
+{
+  std::string path;
+  struct stat st;
+  void *m;
+  int fd;
+
+  path = live_name(name);
+  l->seg = nullptr;
+  l->seen = 0;
+  l->fd = -1;
+  if ((fd = shm_open(path.c_str(), O_RDONLY, 0)) < 0) {
+    std::perror(path.c_str());
+    return 1;
+  }
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof (live_segment)) {
+    std::fprintf(stderr, "%s: Not a live link.\n", path.c_str());
+    close(fd);
+    return 1;
+  }
+  m = mmap(nullptr, sizeof (live_segment), PROT_READ, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    std::perror(path.c_str());
+    close(fd);
+    return 1;
+  }
+  l->seg = (const live_segment *) m;
+  l->fd = fd;
+  if (memcmp(l->seg->magic, LIVE_MAGIC, 4) ||
+      l->seg->version != LIVE_VERSION) {
+    std::fprintf(stderr, "%s: Not a live link.\n", path.c_str());
+    live_close(l);
+    return 1;
+  }
+  return 0;
+} // live_open
+
+/*
+ * Copies the dungeon out if it has changed since the last copy.
+ * Returns 1 with a new copy in out, 0 if nothing changed (out is left
+ * alone).  A writer that stays part way through, or died there, also
+ * gives 0, and the next poll tries again.
+ */
+int live_poll(live_link *l, live_dungeon *out)
+{
+  uint32_t s, tries;
+
+  for (tries = 0; tries < LIVE_TRIES; tries++) {
+    s = l->seg->seq.load(std::memory_order_acquire);
+    if (s == l->seen) {
+      return 0;
+    }
+    if (!(s & 1)) {
+      memcpy(out, &l->seg->d, sizeof (*out));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (l->seg->seq.load(std::memory_order_relaxed) == s) {
+        l->seen = s;
+        return 1;
+      }
+    }
+    /* The writer is part way through; it copies a few KB, so this *
+     * is short unless it was descheduled                           */
+    if (tries >= LIVE_SPIN) {
+      sched_yield();
+    }
+  }
+  return 0;
+} // live_poll
+
+/*
+ * Whether an editor is publishing to the link.  The last dungeon stays
+ * readable after it exits, and a new one carries on where it left off.
+ * An editor that crashed leaves the flag set, but its lock goes with
+ * it, so both must be there.
+ */
+bool live_editing(const live_link *l)
+{
+  struct flock lk;
+
+  if (!l->seg->editing.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  memset(&lk, 0, sizeof (lk));
+  lk.l_type = F_RDLCK;
+  lk.l_whence = SEEK_SET;
+  return fcntl(l->fd, F_OFD_GETLK, &lk) || lk.l_type != F_UNLCK;
+} // live_editing
+
+void live_close(live_link *l)
+{
+  if (l->seg) {
+    munmap((void *) l->seg, sizeof (live_segment));
+    l->seg = nullptr;
+  }
+  if (l->fd >= 0) {
+    close(l->fd);
+    l->fd = -1;
+  }
+} // live_close
@@ -0,0 +1,66 @@
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+/*
+ * The live link: dgen --publish keeps the dungeon being edited in a
+ * POSIX shared memory segment, /NAME, so a running game can pick up
+ * each edit on its next frame without files or parsing.  This header
+ * and live.cpp are all a game needs to read it.
+ *
+ * There is one writer and any number of readers.  The writer makes the
+ * sequence count odd, copies the dungeon in and makes it even again; a
+ * reader copies the dungeon out and retries if the count was odd or
+ * moved meanwhile.  Readers never block the writer, and checking for a
+ * change is one load of the count.
+ *
+ * The editor holds a write lock on the segment while it publishes, so
+ * a second editor is turned away and readers can tell an editor that
+ * crashed from one still running.
+ */
+
+const char LIVE_MAGIC[4] = { 'D', 'G', 'N', 'L' };
+const uint32_t LIVE_VERSION = 1;
+const uint32_t LIVE_X = 80;
+const uint32_t LIVE_Y = 21;
+const uint32_t LIVE_MAX_ROOMS = 255;
+
+/* The dungeon as published.  Terrain values are dgen's terrain_type. */
+struct live_dungeon {
+  uint64_t generation;           /* Counts up with each change */
+  uint8_t terrain[LIVE_Y][LIVE_X];
+  uint8_t hardness[LIVE_Y][LIVE_X];
+  uint8_t pc_x, pc_y;            /* 0, 0 with no PC */
+  uint8_t stairs[4];             /* Up x, y, down x, y; zeros if none */
+  uint16_t num_rooms;
+  uint8_t rooms[LIVE_MAX_ROOMS][4]; /* x, y, width, height */
+};
+
+struct live_segment {
+  char magic[4];
+  uint32_t version;
+  std::atomic<uint32_t> seq;
+  /* Set while an editor is publishing */
+  std::atomic<uint32_t> editing;
+  live_dungeon d;
+};
+
+/* A reader's view of a segment */
+struct live_link {
+  const live_segment *seg;
+  /* Sequence count of the last copy returned */
+  uint32_t seen;
+  /* Kept open to test the editor's lock */
+  int fd;
+};
+
+std::string live_name(const char *name);
+int live_open(const char *name, live_link *l);
+int live_poll(live_link *l, live_dungeon *out);
+bool live_editing(const live_link *l);
+void live_close(live_link *l);
+
+#endif
@@ -0,0 +1,523 @@
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "corpus.h"
+#include "dungeon.h"
+#include "loader.h"
+
+/*
+ * Bulk loading.  An archive is already mapped, so its saves go straight
+ * to the workers.  A directory is read through io_uring: the calling
+ * thread keeps LOADER_DEPTH files moving through open, read and close,
+ * handing each file's bytes to the workers as its read completes, so
+ * the disk sees a deep queue while the workers decode.  Where io_uring
+ * isn't available (old kernels, seccomp, io_uring_disabled) each
+ * worker reads its own files instead.
+ *
+ * The ring is driven with the raw system calls, so there's no library
+ * to link.
+ */
+
+/* The operation a completion finishes, in the low bits of user_data */
+enum ring_op {
+  op_open,
+  op_read,
+  op_close
+};
+
+/* A submission and completion queue pair shared with the kernel */
+struct uring {
+  int fd;
+  uint8_t *sq_ring, *cq_ring;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned pending;  /* Queued but not yet submitted */
+};
+
+static void uring_exit(uring *r)
+{
+  if (r->sqes) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ring && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_len);
+  }
+  if (r->sq_ring) {
+    munmap(r->sq_ring, r->sq_len);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+} // uring_exit
+
+/*
+ * Checks the kernel can open, read and close files through the ring.
+ * Those came in 5.6 along with the probe, so on 5.1 to 5.5 the probe
+ * itself fails; without it every open would come back EINVAL.
+ * Returns 1, with errno set, if any is missing.
+ */
+static int uring_probe(uring *r)
+{
+  std::vector<uint8_t> buf(sizeof (struct io_uring_probe) +
+                           IORING_OP_LAST * sizeof (struct io_uring_probe_op));
+  struct io_uring_probe *p;
+  const uint8_t ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+  uint32_t i;
+
+  p = (struct io_uring_probe *) &buf[0];
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, p,
+              IORING_OP_LAST) < 0) {
+    return 1;
+  }
+  for (i = 0; i < sizeof (ops); i++) {
+    if (ops[i] >= p->ops_len ||
+        !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      errno = EOPNOTSUPP;
+      return 1;
+    }
+  }
+  return 0;
+} // uring_probe
+
+/*
+ * Sets up a ring with room for entries submissions.  Returns 1 if the
+ * kernel won't give us one.
+ */
+static int uring_init(uring *r, unsigned entries)
+{
+  struct io_uring_params p;
+  void *m;
+
+  memset(r, 0, sizeof (*r));
+  memset(&p, 0, sizeof (p));
+  if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+    return 1;
+  }
+  if (uring_probe(r)) {
+    uring_exit(r);
+    return 1;
+  }
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+  }
+  m = mmap(nullptr, r->sq_len, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (m == MAP_FAILED) {
+    uring_exit(r);
+    return 1;
+  }
+  r->sq_ring = (uint8_t *) m;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    m = mmap(nullptr, r->cq_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (m == MAP_FAILED) {
+      uring_exit(r);
+      return 1;
+    }
+    r->cq_ring = (uint8_t *) m;
+  }
+  r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  m = mmap(nullptr, r->sqes_len, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (m == MAP_FAILED) {
+    uring_exit(r);
+    return 1;
+  }
+  r->sqes = (struct io_uring_sqe *) m;
+
+  r->sq_head = (unsigned *) (r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *) (r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (r->sq_ring + p.sq_off.array);
+  r->cq_head = (unsigned *) (r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *) (r->cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (r->cq_ring + p.cq_off.cqes);
+  return 0;
+} // uring_init
+
+/*
+ * The next free submission entry, cleared.  The caller never has more
+ * in flight than the ring holds, so there always is one.
+ */
+static struct io_uring_sqe *uring_sqe(uring *r)
+{
+  unsigned tail, idx;
+
+  tail = *r->sq_tail;
+  idx = tail & *r->sq_mask;
+  r->sq_array[idx] = idx;
+  memset(&r->sqes[idx], 0, sizeof (r->sqes[idx]));
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->pending++;
+  return &r->sqes[idx];
+} // uring_sqe
+
+/*
+ * Submits what's queued and waits for at least one completion.
+ * Returns 1 on error.
+ */
+static int uring_wait(uring *r)
+{
+  int n;
+
+  for (;;) {
+    n = syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+                IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (n >= 0) {
+      r->pending -= n;
+      return 0;
+    }
+    if (errno != EINTR) {
+      return 1;
+    }
+  }
+} // uring_wait
+
+/* A file's bytes on their way to a worker */
+struct load_item {
+  uint32_t i;
+  uint8_t *buf;
+  size_t len;
+  int err;
+};
+
+/*
+ * What the ring thread and the workers share: the files read and
+ * waiting to be decoded, and the buffers free for more reads
+ */
+struct load_queue {
+  std::mutex lock;
+  std::condition_variable ready;   /* An item arrived, or all are read */
+  std::condition_variable freed;   /* A buffer came back */
+  std::deque<load_item> items;
+  std::vector<uint8_t *> free_bufs;
+  bool finished;
+};
+
+/*
+ * Decodes, or rather hands to fn, items until the ring is finished
+ * and the queue empty.  An item whose file filled the buffer may be
+ * longer, so it's read again through the corpus.
+ */
+static void drain_queue(corpus *c, load_queue *q, uint32_t worker,
+                        const save_fn *fn)
+{
+  std::vector<uint8_t> buf;
+  const uint8_t *data;
+  size_t len;
+  load_item item;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> l(q->lock);
+      q->ready.wait(l, [q]() { return !q->items.empty() || q->finished; });
+      if (q->items.empty()) {
+        return;
+      }
+      item = q->items.front();
+      q->items.pop_front();
+    }
+    if (!item.err && item.len == LOADER_BUFFER) {
+      item.err = c->get(item.i, buf, &data, &len) ? errno : 0;
+      (*fn)(worker, item.i, data, len, item.err);
+    } else {
+      (*fn)(worker, item.i, item.buf, item.len, item.err);
+    }
+    {
+      std::lock_guard<std::mutex> l(q->lock);
+      q->free_bufs.push_back(item.buf);
+    }
+    q->freed.notify_one();
+  }
+} // drain_queue
+
+/* A file on the ring */
+struct ring_slot {
+  uint32_t i;
+  std::string name;
+  uint8_t *buf;
+  int fd;
+};
+
+/*
+ * Winds the ring down after io_uring_enter failed with inflight files
+ * still on it.  Operations the kernel hasn't taken yet are taken back,
+ * then the rest are waited out, closing any file left open, so nothing
+ * lands in the slots or buffers once load_ring returns.  If even the
+ * wait fails the ring is torn down anyway, which cancels what's left.
+ */
+static void uring_cancel(uring *r, ring_slot *slots, uint32_t inflight)
+{
+  struct io_uring_cqe *cqe;
+  struct io_uring_sqe *sqe;
+  ring_slot *s;
+  unsigned head, tail;
+
+  head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  tail = *r->sq_tail;
+  for (; head != tail; tail--, inflight--) {
+    sqe = &r->sqes[r->sq_array[(tail - 1) & *r->sq_mask]];
+    if ((sqe->user_data & 3) != op_open) {
+      close(slots[sqe->user_data >> 2].fd);
+    }
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+  r->pending = 0;
+
+  while (inflight) {
+    if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, inflight--) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      s = &slots[cqe->user_data >> 2];
+      if ((cqe->user_data & 3) == op_open && cqe->res >= 0) {
+        close(cqe->res);
+      } else if ((cqe->user_data & 3) == op_read) {
+        close(s->fd);
+      }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+} // uring_cancel
+
+/*
+ * Reads every file of a directory corpus through the ring, while jobs
+ * workers hand them to fn.  The ring is torn down before returning,
+ * while its buffers are still alive.  Returns 1 if the ring fails part
+ * way.
+ */
+static int load_ring(corpus& c, uring *r, uint32_t jobs, const save_fn& fn)
+{
+  load_queue q;
+  std::vector<std::thread> workers;
+  std::vector<uint8_t> arena;
+  std::vector<ring_slot> slots(LOADER_DEPTH);
+  std::vector<uint32_t> free_slots;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  std::deque<load_item> done;
+  ring_slot *s;
+  uint32_t next, inflight, i;
+  unsigned head, tail;
+  int dir, ret;
+  uint8_t *buf;
+
+  if ((dir = open(c.source(), O_RDONLY | O_DIRECTORY)) < 0) {
+    std::perror(c.source());
+    uring_exit(r);
+    return 1;
+  }
+
+  /* Twice the buffers of the ring, so it reads on while workers decode */
+  arena.resize(2 * LOADER_DEPTH * LOADER_BUFFER);
+  for (i = 0; i < 2 * LOADER_DEPTH; i++) {
+    q.free_bufs.push_back(&arena[i * LOADER_BUFFER]);
+  }
+  q.finished = false;
+  for (i = 0; i < LOADER_DEPTH; i++) {
+    free_slots.push_back(LOADER_DEPTH - 1 - i);
+  }
+  /* No more workers than files, as parallel_for_workers */
+  if (jobs > c.size()) {
+    jobs = c.size();
+  }
+  for (i = 0; i < jobs; i++) {
+    workers.push_back(std::thread(drain_queue, &c, &q, i, &fn));
+  }
+
+  ret = 0;
+  next = inflight = 0;
+  while (next < c.size() || inflight) {
+    /* Start as many files as there are slots and buffers for */
+    buf = nullptr;
+    while (next < c.size() && !free_slots.empty()) {
+      {
+        std::unique_lock<std::mutex> l(q.lock);
+        if (!inflight) {
+          q.freed.wait(l, [&q]() { return !q.free_bufs.empty(); });
+        }
+        if (q.free_bufs.empty()) {
+          break;
+        }
+        buf = q.free_bufs.back();
+        q.free_bufs.pop_back();
+      }
+      s = &slots[free_slots.back()];
+      s->i = next++;
+      s->name = c.name(s->i);
+      s->buf = buf;
+      s->fd = -1;
+      sqe = uring_sqe(r);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = dir;
+      sqe->addr = (uintptr_t) s->name.c_str();
+      sqe->open_flags = O_RDONLY;
+      sqe->user_data = (uint64_t) free_slots.back() << 2 | op_open;
+      free_slots.pop_back();
+      inflight++;
+    }
+
+    if (uring_wait(r)) {
+      std::perror("io_uring_enter");
+      uring_cancel(r, &slots[0], inflight);
+      ret = 1;
+      break;
+    }
+
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      s = &slots[cqe->user_data >> 2];
+      switch (cqe->user_data & 3) {
+      case op_open:
+        if (cqe->res < 0) {
+          done.push_back({s->i, s->buf, 0, -cqe->res});
+          free_slots.push_back(s - &slots[0]);
+          inflight--;
+          break;
+        }
+        s->fd = cqe->res;
+        sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = s->fd;
+        sqe->addr = (uintptr_t) s->buf;
+        sqe->len = LOADER_BUFFER;
+        sqe->off = 0;
+        sqe->user_data = cqe->user_data >> 2 << 2 | op_read;
+        break;
+      case op_read:
+        done.push_back({s->i, s->buf, cqe->res < 0 ? 0 : (size_t) cqe->res,
+                        cqe->res < 0 ? -cqe->res : 0});
+        sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = s->fd;
+        sqe->user_data = cqe->user_data >> 2 << 2 | op_close;
+        break;
+      case op_close:
+        free_slots.push_back(s - &slots[0]);
+        inflight--;
+        break;
+      }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    if (!done.empty()) {
+      {
+        std::lock_guard<std::mutex> l(q.lock);
+        q.items.insert(q.items.end(), done.begin(), done.end());
+      }
+      q.ready.notify_all();
+      done.clear();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> l(q.lock);
+    q.finished = true;
+  }
+  q.ready.notify_all();
+  for (i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  uring_exit(r);
+  close(dir);
+  return ret;
+} // load_ring
+
+/*
+ * Hands every save in a corpus to fn(worker, i, data, len, err) on one
+ * of jobs worker threads, numbered below jobs.  err is the errno of a
+ * save that couldn't be read, else 0; data is only good for the call.
+ * Returns 1 if the loader itself failed.
+ */
+int load_saves(corpus& c, uint32_t jobs, const save_fn& fn,
+               load_method method)
+{
+  uring r;
+
+  if (c.directory() && c.size() && method != load_threads) {
+    if (!uring_init(&r, LOADER_DEPTH)) {
+      return load_ring(c, &r, jobs, fn);
+    }
+    if (method == load_uring) {
+      std::perror("io_uring");
+      return 1;
+    }
+  }
+
+  parallel_for_workers(c.size(), jobs, [&](uint32_t worker, uint32_t i) {
+    std::vector<uint8_t> buf;
+    const uint8_t *data;
+    size_t len;
+
+    if (c.get(i, buf, &data, &len)) {
+      fn(worker, i, nullptr, 0, errno);
+    } else {
+      fn(worker, i, data, len, 0);
+    }
+  });
+  return 0;
+} // load_saves
+
+/*
+ * Like load_saves, but decodes each save on its worker and hands fn the
+ * dungeon.  Saves that can't be read or decoded are reported and
+ * skipped.  Returns 1 if any were.
+ */
+int load_dungeons(corpus& c, uint32_t jobs, const dungeon_fn& fn,
+                  load_method method)
+{
+  std::atomic<uint32_t> failed(0);
+
+  if (load_saves(c, jobs, [&](uint32_t worker, uint32_t i,
+                              const uint8_t *data, size_t len, int err) {
+        dungeon d;
+        const char *msg;
+
+        if (err) {
+          std::fprintf(stderr, "%s: %s\n", c.name(i).c_str(), strerror(err));
+          failed++;
+          return;
+        }
+        if (decode_dungeon(&d, data, len, &msg)) {
+          std::fprintf(stderr, "%s: %s\n", c.name(i).c_str(), msg);
+          failed++;
+          return;
+        }
+        fn(worker, i, &d);
+        del_dungeon(&d);
+      }, method)) {
+    return 1;
+  }
+  return failed ? 1 : 0;
+} // load_dungeons
@@ -0,0 +1,33 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+class corpus;
+class dungeon;
+
+/* How load_saves reads a directory */
+enum load_method {
+  load_auto,     /* io_uring if the kernel allows it, else threads */
+  load_uring,
+  load_threads
+};
+
+/* Files a ring keeps in flight */
+const uint32_t LOADER_DEPTH = 128;
+/* Bytes read per file; anything longer is read again the slow way */
+const size_t LOADER_BUFFER = 4096;
+
+typedef std::function<void(uint32_t worker, uint32_t i, const uint8_t *data,
+                           size_t len, int err)> save_fn;
+typedef std::function<void(uint32_t worker, uint32_t i, dungeon *d)>
+        dungeon_fn;
+
+int load_saves(corpus& c, uint32_t jobs, const save_fn& fn,
+               load_method method = load_auto);
+int load_dungeons(corpus& c, uint32_t jobs, const dungeon_fn& fn,
+                  load_method method = load_auto);
+
+#endif
@@ -0,0 +1,338 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "corpus.h"
+#include "dungeon.h"
+#include "loader.h"
+#include "metrics.h"
+#include "path.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "utils.h"
+
+/* What stats_files keeps a histogram of, over the dungeons or rooms */
+enum metric_id {
+  metric_rooms,
+  metric_room_area,
+  metric_corridor,
+  metric_dead_ends,
+  metric_components,
+  metric_hardness,
+  metric_reachable,
+  metric_unreachable_rooms,
+  metric_room_dist,
+  num_metrics
+};
+
+static const char *metric_name[num_metrics] = {
+  "rooms",
+  "room_area",
+  "corridor_cells",
+  "dead_ends",
+  "components",
+  "mean_wall_hardness",
+  "reachable_percent",
+  "unreachable_rooms",
+  "pc_room_distance"
+};
+
+/* Cells before a cell in raster order that it touches */
+static const int32_t before[4] = {
+  -(int32_t) DUNGEON_X - 1, -(int32_t) DUNGEON_X, -(int32_t) DUNGEON_X + 1,
+  -1
+};
+
+/* Offsets to the eight neighbors of a cell */
+static const int32_t around[8] = {
+  -(int32_t) DUNGEON_X - 1, -(int32_t) DUNGEON_X, -(int32_t) DUNGEON_X + 1,
+  -1,                                             1,
+  (int32_t) DUNGEON_X - 1,  (int32_t) DUNGEON_X,  (int32_t) DUNGEON_X + 1
+};
+
+static inline uint16_t find_root(uint16_t *parent, uint16_t i)
+{
+  while (parent[i] != i) {
+    i = parent[i] = parent[parent[i]];
+  }
+  return i;
+} // find_root
+
+/*
+ * Measures a dungeon.  Cell counts, dead ends, wall hardness and the
+ * walkable regions all come from one raster pass over d_map and h_map;
+ * regions are joined with union-find as each cell meets the neighbors
+ * already seen.  If the PC is placed, a search from it gives how much
+ * of the dungeon it can reach and how far away each room is.  If
+ * room_dist isn't null it gets the distance to each room, or
+ * DIST_INFINITY.
+ */
+void measure_dungeon(dungeon *d, dungeon_metrics *m,
+                     std::vector<uint16_t> *room_dist)
+{
+  uint16_t parent[DUNGEON_CELLS];
+  uint16_t dist[DUNGEON_Y][DUNGEON_X];
+  const terrain_type *ter = &d->d_map[0][0];
+  const uint8_t *hard = &d->h_map[0][0];
+  uint32_t x, y, i, j, open, best;
+  uint16_t a, b, pc;
+
+  std::memset(m, 0, sizeof (*m));
+  m->rooms = d->rooms.size();
+  if (room_dist) {
+    room_dist->assign(d->rooms.size(), DIST_INFINITY);
+  }
+
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1, i = cellidx(1, y); x < DUNGEON_X - 1; x++, i++) {
+      if (ter[i] < ter_floor) {
+        if (ter[i] == ter_wall) {
+          m->walls++;
+          m->wall_hardness += hard[i];
+        }
+        continue;
+      }
+      m->walkable++;
+      m->room_cells += ter[i] == ter_floor_room;
+      if (ter[i] == ter_floor_hall) {
+        m->corridor_cells++;
+        for (j = open = 0; j < 8; j++) {
+          open += ter[i + around[j]] >= ter_floor &&
+                  cell_interior(i + around[j]);
+        }
+        m->dead_ends += open == 1;
+      }
+      parent[i] = i;
+      m->components++;
+      for (j = 0; j < 4; j++) {
+        /* Only interior cells have a parent */
+        if (ter[i + before[j]] >= ter_floor && cell_interior(i + before[j])) {
+          a = find_root(parent, i);
+          b = find_root(parent, i + before[j]);
+          if (a != b) {
+            parent[a] = b;
+            m->components--;
+          }
+        }
+      }
+    }
+  }
+
+  m->pc_placed = (*d).get_pcx() && (*d).get_pcy();
+  if (!m->pc_placed) {
+    return;
+  }
+  pc = cellidx((*d).get_pcx(), (*d).get_pcy());
+  if (dist_map(d, &pc, 1, dist) == DIST_INFINITY) {
+    return;
+  }
+  for (i = 0; i < DUNGEON_CELLS; i++) {
+    m->reachable += (&dist[0][0])[i] != DIST_INFINITY;
+  }
+  for (i = 0; i < d->rooms.size(); i++) {
+    best = DIST_INFINITY;
+    for (y = (*d->rooms[i]).get_y();
+         y < (uint32_t) (*d->rooms[i]).get_y() + (*d->rooms[i]).get_ysize() &&
+         y < DUNGEON_Y; y++) {
+      for (x = (*d->rooms[i]).get_x();
+           x < (uint32_t) (*d->rooms[i]).get_x() +
+               (*d->rooms[i]).get_xsize() && x < DUNGEON_X; x++) {
+        best = dist[y][x] < best ? dist[y][x] : best;
+      }
+    }
+    if (room_dist) {
+      (*room_dist)[i] = best;
+    }
+    if (best != DIST_INFINITY) {
+      m->reachable_rooms++;
+      m->room_dist_total += best;
+      m->room_dist_max = best > m->room_dist_max ? best : m->room_dist_max;
+    }
+  }
+} // measure_dungeon
+
+/*
+ * Adds a dungeon's measurements to a set of histograms, along with the
+ * size of each room and the distance to each room the PC can reach
+ */
+static void record_metrics(dungeon *d, dungeon_metrics *m,
+                           std::vector<uint16_t>& room_dist,
+                           histogram h[num_metrics])
+{
+  uint32_t i;
+
+  h[metric_rooms].record(m->rooms);
+  for (i = 0; i < d->rooms.size(); i++) {
+    h[metric_room_area].record((*d->rooms[i]).get_xsize() *
+                               (*d->rooms[i]).get_ysize());
+  }
+  h[metric_corridor].record(m->corridor_cells);
+  h[metric_dead_ends].record(m->dead_ends);
+  h[metric_components].record(m->components);
+  if (m->walls) {
+    h[metric_hardness].record((m->wall_hardness + m->walls / 2) / m->walls);
+  }
+  if (!m->pc_placed) {
+    return;
+  }
+  h[metric_reachable].record(m->walkable ? m->reachable * 100 / m->walkable
+                                         : 0);
+  h[metric_unreachable_rooms].record(m->rooms - m->reachable_rooms);
+
+  for (i = 0; i < room_dist.size(); i++) {
+    if (room_dist[i] != DIST_INFINITY) {
+      h[metric_room_dist].record(room_dist[i]);
+    }
+  }
+} // record_metrics
+
+/*
+ * Writes each histogram as JSON.  Means are exact, percentiles are to
+ * within the histogram's resolution.
+ */
+static void dump_metrics(FILE *f, uint32_t count, histogram h[num_metrics])
+{
+  uint32_t i;
+
+  std::fprintf(f, "{\n  \"dungeons\": %u,\n", count);
+  for (i = 0; i < num_metrics; i++) {
+    std::fprintf(f, "  \"%s\": { \"count\": %llu, \"min\": %llu, "
+                 "\"mean\": %.2f, \"p10\": %llu, \"p50\": %llu, "
+                 "\"p90\": %llu, \"p99\": %llu, \"max\": %llu }%s\n",
+                 metric_name[i],
+                 (unsigned long long) h[i].count,
+                 (unsigned long long) (h[i].count ? h[i].min : 0),
+                 h[i].count ? (double) h[i].total / h[i].count : 0.0,
+                 (unsigned long long) h[i].percentile(10),
+                 (unsigned long long) h[i].percentile(50),
+                 (unsigned long long) h[i].percentile(90),
+                 (unsigned long long) h[i].percentile(99),
+                 (unsigned long long) h[i].max,
+                 i + 1 < num_metrics ? "," : "");
+  }
+  std::fprintf(f, "}\n");
+} // dump_metrics
+
+/*
+ * Measures every dungeon in a directory or archive on jobs threads and
+ * writes histograms of the measurements as JSON to stdout.  Each
+ * thread fills its own histograms, which are merged at the end.
+ * Dungeons that can't be loaded are reported and left out.  Returns 1
+ * if any couldn't be.
+ */
+int stats_files(const char *src, uint32_t jobs)
+{
+  corpus c;
+  std::vector<std::vector<histogram> > shards;
+  std::vector<uint32_t> measured;
+  histogram total[num_metrics];
+  uint32_t i, j, count;
+  int failed;
+  uint64_t start;
+
+  if (c.open(src)) {
+    return 1;
+  }
+
+  start = now_usec();
+  measured.assign(jobs, 0);
+  shards.assign(jobs, std::vector<histogram>(num_metrics));
+  failed = load_dungeons(c, jobs, [&](uint32_t worker, uint32_t,
+                                      dungeon *d) {
+    dungeon_metrics m;
+    std::vector<uint16_t> room_dist;
+
+    measure_dungeon(d, &m, &room_dist);
+    record_metrics(d, &m, room_dist, &shards[worker][0]);
+    measured[worker]++;
+  });
+
+  for (i = count = 0; i < shards.size(); i++) {
+    for (j = 0; j < num_metrics; j++) {
+      total[j].merge(shards[i][j]);
+    }
+    count += measured[i];
+  }
+  dump_metrics(stdout, count, total);
+  std::fflush(stdout);
+
+  std::fprintf(stderr, "Measured %u dungeons in %s, %.1f us per dungeon\n",
+               count, src,
+               c.size() ? (double) (now_usec() - start) / c.size() : 0.0);
+  return failed;
+} // stats_files
+
+/*
+ * The editor's layout metrics are measured on a background thread from
+ * a snapshot, so editing never waits for them.  One measurement runs at
+ * a time.
+ */
+
+static std::thread measure_thread;
+static std::atomic<bool> measure_done;
+static bool measure_running = false;
+static snapshot_ptr measure_snap;
+static dungeon_metrics measure_result;
+
+static void measure_worker(void)
+{
+  dungeon d;
+
+  restore_snapshot(measure_snap.get(), &d);
+  measure_dungeon(&d, &measure_result, nullptr);
+  del_dungeon(&d);
+  measure_done.store(true, std::memory_order_release);
+} // measure_worker
+
+/*
+ * Starts measuring a snapshot.  Returns 1 if a measurement is already
+ * running.
+ */
+int measure_async(snapshot_ptr s)
+{
+  if (measure_running) {
+    return 1;
+  }
+  measure_snap = s;
+  measure_done.store(false, std::memory_order_relaxed);
+  measure_running = true;
+  measure_thread = std::thread(measure_worker);
+
+  return 0;
+} // measure_async
+
+bool measure_pending(void)
+{
+  return measure_running;
+} // measure_pending
+
+/*
+ * Collects a finished measurement and the version of the snapshot it
+ * was taken from.  Returns false if none has finished.
+ */
+bool measure_poll(dungeon_metrics *m, uint64_t *version)
+{
+  if (!measure_running || !measure_done.load(std::memory_order_acquire)) {
+    return false;
+  }
+  measure_thread.join();
+  measure_running = false;
+  *m = measure_result;
+  *version = measure_snap->version;
+  measure_snap.reset();
+  return true;
+} // measure_poll
+
+/*
+ * Waits for any running measurement and throws it away
+ */
+void measure_wait(void)
+{
+  if (measure_running) {
+    measure_thread.join();
+    measure_running = false;
+    measure_snap.reset();
+  }
+} // measure_wait
@@ -0,0 +1,36 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "snapshot.h"
+
+class dungeon;
+
+/* Measurements of one dungeon's layout */
+struct dungeon_metrics {
+  uint32_t rooms;
+  uint32_t room_cells;      /* Room floor */
+  uint32_t corridor_cells;
+  uint32_t dead_ends;       /* Corridor cells with one way out */
+  uint32_t walkable;
+  uint32_t components;      /* Separate walkable regions */
+  uint32_t walls;           /* Mutable wall cells */
+  uint64_t wall_hardness;   /* Summed over the mutable walls */
+  bool pc_placed;
+  uint32_t reachable;       /* Walkable cells the PC can reach */
+  uint32_t reachable_rooms; /* Rooms the PC can reach... */
+  uint32_t room_dist_total; /* ...and the moves to the nearest cell of each */
+  uint32_t room_dist_max;
+};
+
+void measure_dungeon(dungeon *d, dungeon_metrics *m,
+                     std::vector<uint16_t> *room_dist);
+int stats_files(const char *src, uint32_t jobs);
+int measure_async(snapshot_ptr s);
+bool measure_pending(void);
+bool measure_poll(dungeon_metrics *m, uint64_t *version);
+void measure_wait(void);
+
+#endif
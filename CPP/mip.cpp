@@ -0,0 +1,113 @@
+#include "dungeon.h"
+#include "mip.h"
+
+/*
+ * Reduce a terrain type to the classes the minimap shows
+ */
+static mip_terrain classify(terrain_type t)
+{
+  switch(t) {
+  case ter_floor_room:
+    return mip_room;
+  case ter_floor:
+  case ter_floor_hall:
+    return mip_hall;
+  case ter_stairs:
+  case ter_stairs_up:
+  case ter_stairs_down:
+    return mip_stairs;
+  default:
+    return mip_wall;
+  }
+} // classify
+
+/*
+ * Recompute one cell of level l from the (up to) four cells below it.
+ * Terrain keeps the highest class so thin corridors stay visible,
+ * hardness keeps the mean.
+ */
+static void downsample(std::vector<mip_level>& levels, uint32_t l,
+                       uint32_t x, uint32_t y)
+{
+  mip_level& src = levels[l - 1];
+  mip_level& dst = levels[l];
+  uint32_t sx, sy, i, n, sum;
+  mip_terrain t;
+
+  t = mip_wall;
+  sum = n = 0;
+  for (sy = y << 1; sy < (y << 1) + 2 && sy < src.height; sy++) {
+    for (sx = x << 1; sx < (x << 1) + 2 && sx < src.width; sx++) {
+      i = sy * src.width + sx;
+      if (src.terrain[i] > t) {
+        t = src.terrain[i];
+      }
+      sum += src.hardness[i];
+      n++;
+    }
+  }
+  dst.terrain[y * dst.width + x] = t;
+  dst.hardness[y * dst.width + x] = sum / n;
+} // downsample
+
+/*
+ * Build every level of the pyramid from the dungeon
+ */
+void mip_pyramid::build(dungeon *d)
+{
+  uint32_t w, h, x, y, l;
+
+  levels.clear();
+  levels.push_back(mip_level(DUNGEON_X, DUNGEON_Y));
+  for (y = 0; y < DUNGEON_Y; y++) {
+    for (x = 0; x < DUNGEON_X; x++) {
+      levels[0].terrain[y * DUNGEON_X + x] = classify(dmapxy(x, y));
+      levels[0].hardness[y * DUNGEON_X + x] = hmapxy(x, y);
+    }
+  }
+
+  w = DUNGEON_X;
+  h = DUNGEON_Y;
+  for (l = 1; w > 1 || h > 1; l++) {
+    w = (w + 1) >> 1;
+    h = (h + 1) >> 1;
+    levels.push_back(mip_level(w, h));
+    for (y = 0; y < h; y++) {
+      for (x = 0; x < w; x++) {
+        downsample(levels, l, x, y);
+      }
+    }
+  }
+} // build
+
+/*
+ * Propagate a change to a single map cell up the pyramid.  Only the
+ * one cell per level that covers it is recomputed.
+ */
+void mip_pyramid::update(dungeon *d, uint32_t x, uint32_t y)
+{
+  uint32_t l;
+
+  levels[0].terrain[y * DUNGEON_X + x] = classify(dmapxy(x, y));
+  levels[0].hardness[y * DUNGEON_X + x] = hmapxy(x, y);
+  for (l = 1; l < levels.size(); l++) {
+    x >>= 1;
+    y >>= 1;
+    downsample(levels, l, x, y);
+  }
+} // update
+
+/*
+ * Find the most detailed level that fits in the given size
+ */
+uint32_t mip_pyramid::fit_level(uint32_t max_width, uint32_t max_height)
+{
+  uint32_t l;
+
+  for (l = 0; l < levels.size() - 1; l++) {
+    if (levels[l].width <= max_width && levels[l].height <= max_height) {
+      break;
+    }
+  }
+  return l;
+} // fit_level
@@ -0,0 +1,40 @@
+#ifndef MIP_H
+#define MIP_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "dungeon.h"
+
+/* Terrain classes kept by the pyramid, higher ones win when downsampling */
+enum __attribute__ ((__packed__)) mip_terrain {
+  mip_wall,
+  mip_hall,
+  mip_room,
+  mip_stairs
+};
+
+class mip_level {
+ public:
+  uint32_t width, height;
+  std::vector<mip_terrain> terrain;
+  std::vector<uint8_t> hardness;
+  mip_level(uint32_t w, uint32_t h) : width(w), height(h),
+                                      terrain(w * h), hardness(w * h) {}
+};
+
+/*
+ * Each level halves the one below it, rounding up, until it is a
+ * single cell.  Level 0 is the full map.
+ */
+class mip_pyramid {
+ public:
+  std::vector<mip_level> levels;
+  mip_pyramid() : levels() {}
+
+  void build(dungeon *d);
+  void update(dungeon *d, uint32_t x, uint32_t y);
+  uint32_t fit_level(uint32_t max_width, uint32_t max_height);
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include <cstring>
+
+#include "dungeon.h"
+#include "path.h"
+#include "room.h"
+
+/* Offsets to the eight neighbors of a cell, in cell index units */
+static const int32_t neighbor[8] = {
+  -(int32_t) DUNGEON_X - 1, -(int32_t) DUNGEON_X, -(int32_t) DUNGEON_X + 1,
+  -1,                                             1,
+  (int32_t) DUNGEON_X - 1,  (int32_t) DUNGEON_X,  (int32_t) DUNGEON_X + 1
+};
+
+/*
+ * Checks if the cell can be walked on by the PC
+ */
+bool walkable(dungeon *d, uint8_t x, uint8_t y)
+{
+  return dmapxy(x, y) >= ter_floor;
+} // walkable
+
+/*
+ * Breadth first search over all walkable cells starting from every
+ * cell in src at once.  Fills dist with the number of moves to the
+ * nearest source and returns the index of the cell farthest from all
+ * of them.  Unreachable cells are left at DIST_INFINITY.
+ *
+ * Only interior cells are searched (see cell_interior).
+ */
+uint16_t dist_map(dungeon *d, const uint16_t *src, uint32_t num_src,
+                  uint16_t dist[DUNGEON_Y][DUNGEON_X])
+{
+  uint16_t queue[DUNGEON_CELLS];
+  const terrain_type *ter = &d->d_map[0][0];
+  uint16_t *dst = &dist[0][0];
+  uint32_t head, tail, i;
+  uint16_t cur, next;
+
+  std::memset(dst, 0xff, DUNGEON_CELLS * sizeof (*dst));
+
+  head = tail = 0;
+  for (i = 0; i < num_src; i++) {
+    if (cell_interior(src[i]) && ter[src[i]] >= ter_floor && dst[src[i]]) {
+      dst[src[i]] = 0;
+      queue[tail++] = src[i];
+    }
+  }
+  if (!tail) {
+    return DIST_INFINITY;
+  }
+
+  while (head < tail) {
+    cur = queue[head++];
+    for (i = 0; i < 8; i++) {
+      next = cur + neighbor[i];
+      if (ter[next] >= ter_floor && dst[next] == DIST_INFINITY &&
+          cell_interior(next)) {
+        dst[next] = dst[cur] + 1;
+        queue[tail++] = next;
+      }
+    }
+  }
+
+  /* BFS visits cells in order of distance, so the last one is farthest */
+  return queue[tail - 1];
+} // dist_map
+
+/*
+ * Checks if the x, y coordinate is on the floor of a room
+ */
+static bool in_room(dungeon *d, uint8_t x, uint8_t y)
+{
+  uint32_t i;
+  room *r;
+
+  for (i = 0; i < d->rooms.size(); i++) {
+    r = d->rooms[i];
+    if (x >= (*r).get_x() && x < (*r).get_x() + (*r).get_xsize() &&
+        y >= (*r).get_y() && y < (*r).get_y() + (*r).get_ysize()) {
+      return true;
+    }
+  }
+  return false;
+} // in_room
+
+/*
+ * Removes any stairs, restoring the floor underneath
+ */
+static void clear_stairs(dungeon *d)
+{
+  uint8_t x, y;
+
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (dmapxy(x, y) == ter_stairs_up || dmapxy(x, y) == ter_stairs_down) {
+        set_cell(d, x, y, in_room(d, x, y) ? ter_floor_room : ter_floor_hall,
+                 hmapxy(x, y));
+      }
+    }
+  }
+} // clear_stairs
+
+/*
+ * Places one up and one down staircase as far apart as possible.
+ *
+ * With the PC placed, the down stairs go to the cell farthest from the
+ * PC and the up stairs go to the cell farthest from both, found with a
+ * single multi-source search from the PC and the down stairs.  Without
+ * a PC, a double sweep (farthest from an arbitrary floor cell, then
+ * farthest from that) puts the stairs at the two ends of the longest
+ * walk through the floor.
+ *
+ * Returns 1 if there is not enough connected floor for both stairs.
+ */
+int place_stairs(dungeon *d)
+{
+  uint16_t dist[DUNGEON_Y][DUNGEON_X];
+  uint16_t src[2], up, down;
+  uint8_t x, y;
+
+  clear_stairs(d);
+
+  if ((*d).get_pcx() && (*d).get_pcy() &&
+      walkable(d, (*d).get_pcx(), (*d).get_pcy())) {
+    src[0] = cellidx((*d).get_pcx(), (*d).get_pcy());
+    down = dist_map(d, src, 1, dist);
+    if (down == src[0]) {
+      return 1;
+    }
+    src[1] = down;
+    up = dist_map(d, src, 2, dist);
+    if (up == src[0] || up == src[1]) {
+      return 1;
+    }
+  } else {
+    src[0] = DIST_INFINITY;
+    for (y = 1; y < DUNGEON_Y - 1 && src[0] == DIST_INFINITY; y++) {
+      for (x = 1; x < DUNGEON_X - 1; x++) {
+        if (walkable(d, x, y)) {
+          src[0] = cellidx(x, y);
+          break;
+        }
+      }
+    }
+    if (src[0] == DIST_INFINITY) {
+      return 1;
+    }
+    up = dist_map(d, src, 1, dist);
+    src[0] = up;
+    down = dist_map(d, src, 1, dist);
+    if (down == up) {
+      return 1;
+    }
+  }
+
+  set_cell(d, cellx(up), celly(up), ter_stairs_up,
+           d->h_map[celly(up)][cellx(up)]);
+  set_cell(d, cellx(down), celly(down), ter_stairs_down,
+           d->h_map[celly(down)][cellx(down)]);
+
+  return 0;
+} // place_stairs
@@ -0,0 +1,31 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stdint.h>
+
+#include "dungeon.h"
+
+const uint16_t DIST_INFINITY = UINT16_MAX;
+const uint32_t DUNGEON_CELLS = DUNGEON_X * DUNGEON_Y;
+
+#define cellidx(x, y) ((uint16_t) ((y) * DUNGEON_X + (x)))
+#define cellx(i) ((uint8_t) ((i) % DUNGEON_X))
+#define celly(i) ((uint8_t) ((i) / DUNGEON_X))
+
+/*
+ * Checks if the cell index is inside the border.  Searches only step
+ * between interior cells, so they stay on the map even when a loaded
+ * or converted map has a walkable border.
+ */
+static inline bool cell_interior(uint32_t i)
+{
+  return i >= DUNGEON_X && i < DUNGEON_CELLS - DUNGEON_X &&
+         i % DUNGEON_X && i % DUNGEON_X != DUNGEON_X - 1;
+}
+
+bool walkable(dungeon *d, uint8_t x, uint8_t y);
+uint16_t dist_map(dungeon *d, const uint16_t *src, uint32_t num_src,
+                  uint16_t dist[DUNGEON_Y][DUNGEON_X]);
+int place_stairs(dungeon *d);
+
+#endif
@@ -0,0 +1,193 @@
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dungeon.h"
+#include "live.h"
+#include "publish.h"
+#include "snapshot.h"
+
+static_assert(LIVE_X == DUNGEON_X && LIVE_Y == DUNGEON_Y,
+              "A live dungeon is a dungeon's size");
+static_assert(sizeof (terrain_type) == 1, "Terrain is published as bytes");
+
+/* How often --watch looks for changes: a frame at 60 Hz */
+static const useconds_t WATCH_USEC = 1000000 / 60;
+
+/*
+ * The editor's end of the live link.  After each frame that changed the
+ * dungeon it is copied into the segment under the sequence count.
+ */
+
+static live_segment *live_seg = nullptr;
+static int live_fd = -1;
+static uint64_t live_version;
+
+/*
+ * Creates or reuses the segment for name, so a game already following
+ * it picks up from this editor.  The segment stays write locked while
+ * the editor runs; the lock belongs to the open file, so it goes when
+ * the editor does, however it ends.  Returns 1 and prints why on error,
+ * including when another editor is publishing to name.
+ */
+int publish_open(const char *name)
+{
+  std::string path;
+  struct flock lk;
+  void *m;
+  int fd;
+
+  path = live_name(name);
+  if ((fd = shm_open(path.c_str(), O_RDWR | O_CREAT, 0644)) < 0) {
+    std::perror(path.c_str());
+    return 1;
+  }
+  memset(&lk, 0, sizeof (lk));
+  lk.l_type = F_WRLCK;
+  lk.l_whence = SEEK_SET;
+  if (fcntl(fd, F_OFD_SETLK, &lk)) {
+    if (errno == EAGAIN || errno == EACCES) {
+      std::fprintf(stderr, "%s: Another editor is publishing here.\n",
+                   path.c_str());
+    } else {
+      std::perror(path.c_str());
+    }
+    close(fd);
+    return 1;
+  }
+  if (ftruncate(fd, sizeof (live_segment))) {
+    std::perror(path.c_str());
+    close(fd);
+    return 1;
+  }
+  m = mmap(nullptr, sizeof (live_segment), PROT_READ | PROT_WRITE,
+           MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    std::perror(path.c_str());
+    close(fd);
+    return 1;
+  }
+  live_seg = (live_segment *) m;
+  live_fd = fd;
+  if (memcmp(live_seg->magic, LIVE_MAGIC, 4) ||
+      live_seg->version != LIVE_VERSION) {
+    /* New, or from something else: readers check the magic last */
+    memset((void *) live_seg, 0, sizeof (*live_seg));
+    live_seg->version = LIVE_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(live_seg->magic, LIVE_MAGIC, 4);
+  }
+  /* A writer that died part way left the count odd */
+  live_seg->seq.fetch_or(1, std::memory_order_relaxed);
+  live_seg->seq.fetch_add(1, std::memory_order_release);
+  live_seg->editing.store(1, std::memory_order_relaxed);
+  live_version = 0;
+  return 0;
+} // publish_open
+
+/*
+ * Publishes the dungeon if it has changed since it was last published.
+ * Snapshots tell cheaply whether it has.
+ */
+void publish_update(dungeon *d)
+{
+  live_dungeon *ld;
+  uint64_t version;
+  uint32_t s, i, n, r;
+
+  if (!live_seg || (version = snapshot_dungeon(d)->version) == live_version) {
+    return;
+  }
+  live_version = version;
+  ld = &live_seg->d;
+
+  s = live_seg->seq.load(std::memory_order_relaxed);
+  live_seg->seq.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  ld->generation++;
+  memcpy(ld->terrain, d->d_map, sizeof (ld->terrain));
+  memcpy(ld->hardness, d->h_map, sizeof (ld->hardness));
+  ld->pc_x = (*d).get_pcx();
+  ld->pc_y = (*d).get_pcy();
+  if (!find_stairs(d, ld->stairs)) {
+    memset(ld->stairs, 0, sizeof (ld->stairs));
+  }
+  n = d->rooms.size() < LIVE_MAX_ROOMS ? d->rooms.size() : LIVE_MAX_ROOMS;
+  for (i = 0; i < n; i++) {
+    r = (*d->rooms[i]).byte_frmt();
+    ld->rooms[i][0] = r >> 24;
+    ld->rooms[i][1] = r >> 16;
+    ld->rooms[i][2] = r >> 8;
+    ld->rooms[i][3] = r;
+  }
+  ld->num_rooms = n;
+
+  live_seg->seq.store(s + 2, std::memory_order_release);
+} // publish_update
+
+/*
+ * Leaves the last dungeon in the segment for readers and says the
+ * editor has gone, letting go of the lock.  The segment itself stays
+ * until it is removed from /dev/shm or the machine restarts.
+ */
+void publish_close(void)
+{
+  if (live_seg) {
+    live_seg->editing.store(0, std::memory_order_relaxed);
+    munmap(live_seg, sizeof (live_segment));
+    live_seg = nullptr;
+  }
+  if (live_fd >= 0) {
+    close(live_fd);
+    live_fd = -1;
+  }
+} // publish_close
+
+static volatile sig_atomic_t watch_stop;
+
+static void stop_watching(int)
+{
+  watch_stop = 1;
+} // stop_watching
+
+/*
+ * Follows a live link the way a game would, printing a line for each
+ * change until interrupted.  Returns 1 if the link can't be opened.
+ */
+int watch_link(const char *name)
+{
+  live_link l;
+  live_dungeon d;
+  bool editing, was_editing;
+
+  if (live_open(name, &l)) {
+    return 1;
+  }
+  watch_stop = 0;
+  signal(SIGINT, stop_watching);
+  signal(SIGTERM, stop_watching);
+  was_editing = !live_editing(&l);
+  while (!watch_stop) {
+    if (live_poll(&l, &d)) {
+      std::printf("generation %llu: %u rooms, PC at %u, %u\n",
+                  (unsigned long long) d.generation, d.num_rooms, d.pc_x,
+                  d.pc_y);
+    }
+    if ((editing = live_editing(&l)) != was_editing) {
+      std::printf("%s\n", editing ? "editor attached" : "editor gone");
+      was_editing = editing;
+    }
+    std::fflush(stdout);
+    usleep(WATCH_USEC);
+  }
+  live_close(&l);
+  return 0;
+} // watch_link
@@ -0,0 +1,11 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+class dungeon;
+
+int publish_open(const char *name);
+void publish_update(dungeon *d);
+void publish_close(void);
+int watch_link(const char *name);
+
+#endif
@@ -45,8 +45,8 @@ uint32_t room::byte_frmt(void)
  */
 bool room::contains(uint8_t x, uint8_t y)
 {
-  if((x_pos <= x && x <= x_pos + x_size) &&
-     (y_pos <= y && y <= y_pos + y_size)) {
+  if((x_pos <= x && x < x_pos + x_size) &&
+     (y_pos <= y && y < y_pos + y_size)) {
     return true;
   }
   return false;
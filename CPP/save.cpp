@@ -0,0 +1,104 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dungeon.h"
+#include "save.h"
+#include "snapshot.h"
+
+/*
+ * Saves from the editor run on a background thread so a slow disk
+ * never stalls editing.  The calling thread only takes a snapshot of
+ * the dungeon; the worker encodes and writes that, so the editor can
+ * keep changing the dungeon while the save is written.  Only one save
+ * runs at a time.
+ */
+
+static std::thread save_thread;
+static std::atomic<bool> save_done;
+static bool save_running = false;
+static int save_errno;
+static std::string save_file;
+static snapshot_ptr save_snap;
+
+static void save_worker(void)
+{
+  std::vector<uint8_t> buf;
+  dungeon d;
+
+  restore_snapshot(save_snap.get(), &d);
+  save_snap.reset();
+  encode_dungeon(&d, buf);
+  del_dungeon(&d);
+  save_errno = write_save_file(save_file.c_str(), buf) ? errno : 0;
+  save_done.store(true, std::memory_order_release);
+} // save_worker
+
+/*
+ * Snapshots the dungeon and starts writing it to file (./dungeon if
+ * null).  Returns 1 if a save is already running.
+ */
+int save_async(dungeon *d, const char *file)
+{
+  if (save_running) {
+    return 1;
+  }
+  save_snap = snapshot_dungeon(d);
+  save_file = save_path(file);
+  save_done.store(false, std::memory_order_relaxed);
+  save_running = true;
+  save_thread = std::thread(save_worker);
+
+  return 0;
+} // save_async
+
+bool save_pending(void)
+{
+  return save_running;
+} // save_pending
+
+/*
+ * Joins the worker and describes how the save went
+ */
+static void finish_save(std::string& msg, bool *failed)
+{
+  save_thread.join();
+  save_running = false;
+
+  *failed = save_errno != 0;
+  if (*failed) {
+    msg = "Save to " + save_file + " failed: " + strerror(save_errno);
+  } else {
+    msg = "Saved " + save_file + ".";
+  }
+} // finish_save
+
+/*
+ * Collects the result of a finished save.  Returns false if there is
+ * no save or it is still being written.  Otherwise msg describes the
+ * outcome and failed is set if the save didn't make it to disc.
+ */
+bool save_poll(std::string& msg, bool *failed)
+{
+  if (!save_running || !save_done.load(std::memory_order_acquire)) {
+    return false;
+  }
+  finish_save(msg, failed);
+  return true;
+} // save_poll
+
+/*
+ * Waits for any running save to finish, then collects it like
+ * save_poll
+ */
+bool save_wait(std::string& msg, bool *failed)
+{
+  if (!save_running) {
+    return false;
+  }
+  finish_save(msg, failed);
+  return true;
+} // save_wait
@@ -0,0 +1,13 @@
+#ifndef SAVE_H
+#define SAVE_H
+
+#include <string>
+
+class dungeon;
+
+int save_async(dungeon *d, const char *file);
+bool save_pending(void);
+bool save_poll(std::string& msg, bool *failed);
+bool save_wait(std::string& msg, bool *failed);
+
+#endif
@@ -0,0 +1,411 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+#include "brush.h"
+#include "dungeon.h"
+#include "history.h"
+#include "path.h"
+#include "script.h"
+#include "utils.h"
+
+/*
+ * Edit scripts are plain text, one command per line.  Blank lines and
+ * anything after a '#' are ignored.  Coordinates are map cells; the
+ * commands that take an optional X Y act at the cursor without one.
+ *
+ *   new                 Start from an empty dungeon
+ *   load [FILE]         Load a dungeon (default ./dungeon)
+ *   save [FILE]         Save the dungeon (default ./dungeon)
+ *   seed N              Seed the random number generator
+ *   move X Y            Move the cursor
+ *   corridor [X Y]      Place a corridor tile
+ *   wall [X Y]          Place a wall tile
+ *   fill TILE X Y W H   Fill a W by H rectangle with TILE (corridor or wall)
+ *   flood TILE [X Y]    Flood fill the region containing X, Y with TILE
+ *   room X Y W H        Place a W by H room with its corner at X, Y
+ *   delete [X Y]        Delete the room containing X, Y
+ *   pc [X Y]            Place the PC
+ *   brush MODE R N [X Y]
+ *                       Apply a hardness brush of radius R: raise or lower
+ *                       by N, set to N, or smooth with N passes
+ *   smooth N            Smooth the whole map's hardness with N passes
+ *   stairs              Place the stairs
+ *   undo                Undo the last edit
+ *   redo                Redo the last undone edit
+ *   begin               Start grouping edits so they undo together
+ *   end                 Stop grouping edits
+ *
+ * Each command is one edit unless it is inside a begin/end group.
+ * Undo only works when the dungeon has a history attached, and not
+ * inside a group.
+ */
+
+static FILE *record_file;
+
+/*
+ * Skips spaces and tabs
+ */
+static const char *skip_blank(const char *p)
+{
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  return p;
+} // skip_blank
+
+/*
+ * Reads the next word on the line.  Returns its length, 0 at the end
+ * of the line.
+ */
+static uint32_t read_word(const char **p, const char **word)
+{
+  const char *s;
+
+  s = skip_blank(*p);
+  *word = s;
+  while (*s && *s != ' ' && *s != '\t' && *s != '\n' && *s != '#') {
+    s++;
+  }
+  *p = s;
+  return s - *word;
+} // read_word
+
+/*
+ * Reads an unsigned number.  Returns 1 if there isn't one or it
+ * doesn't fit in 32 bits.
+ */
+static int read_uint(const char **p, uint32_t *v)
+{
+  const char *s;
+  uint64_t n;
+
+  s = skip_blank(*p);
+  if (*s < '0' || *s > '9') {
+    return 1;
+  }
+  for (n = 0; *s >= '0' && *s <= '9'; s++) {
+    n = n * 10 + (*s - '0');
+    if (n > UINT32_MAX) {
+      return 1;
+    }
+  }
+  *v = n;
+  *p = s;
+  return 0;
+} // read_uint
+
+/*
+ * Reads an optional X Y position, defaulting to the cursor.  Returns
+ * 1 if the position is malformed or not inside the border.
+ */
+static int read_position(dungeon *d, const char **p, uint32_t *x, uint32_t *y)
+{
+  const char *s;
+
+  s = skip_blank(*p);
+  if (!*s || *s == '\n' || *s == '#') {
+    *x = (*d).get_cursx();
+    *y = (*d).get_cursy();
+    return 0;
+  }
+  if (read_uint(p, x) || read_uint(p, y)) {
+    return 1;
+  }
+  return (!*x || *x >= DUNGEON_X - 1 || !*y || *y >= DUNGEON_Y - 1);
+} // read_position
+
+static bool word_is(const char *word, uint32_t len, const char *name)
+{
+  return len == strlen(name) && !strncmp(word, name, len);
+}
+
+/*
+ * Reads a fill tile, corridor or wall.  Returns 1 for anything else.
+ * The hardness is picked only once the fill is sure to happen, as the
+ * editor does, so a recording replays with the same random numbers.
+ */
+static int read_tile(const char **p, terrain_type *t)
+{
+  const char *word;
+  uint32_t len;
+
+  len = read_word(p, &word);
+  if (word_is(word, len, "corridor")) {
+    *t = ter_floor_hall;
+  } else if (word_is(word, len, "wall")) {
+    *t = ter_wall;
+  } else {
+    return 1;
+  }
+  return 0;
+} // read_tile
+
+/*
+ * Runs the script in buf against the dungeon.  Malformed commands and
+ * edits that can't be made are reported with their line number and
+ * skipped.  Returns 1 if there were any.
+ */
+int run_script_buffer(dungeon *d, const char *name, const char *buf)
+{
+  const char *p, *word, *err;
+  uint32_t line, len, errors, x, y, w, h;
+  std::string file;
+  std::vector<uint8_t> save;
+  terrain_type tile;
+  brush_mode mode;
+  bool grouped;
+
+  errors = 0;
+  for (p = buf, line = 1; *p; line++) {
+    err = nullptr;
+    len = read_word(&p, &word);
+    /* Undo and redo can't happen in the middle of an edit */
+    grouped = (len && d->hist && !word_is(word, len, "undo") &&
+               !word_is(word, len, "redo"));
+    if (grouped) {
+      (*d->hist).begin();
+    }
+
+    if (!len) {
+      /* Blank line or comment */
+    } else if (word_is(word, len, "corridor")) {
+      if (read_position(d, &p, &x, &y)) {
+        err = "expected corridor [X Y] inside the border";
+      } else if (add_corridor(d, x, y)) {
+        err = "cannot place corridor over room tiles";
+      }
+    } else if (word_is(word, len, "wall")) {
+      if (read_position(d, &p, &x, &y)) {
+        err = "expected wall [X Y] inside the border";
+      } else if (add_wall(d, x, y)) {
+        err = "cannot place wall over room tiles";
+      }
+    } else if (word_is(word, len, "fill")) {
+      if (read_tile(&p, &tile) ||
+          read_uint(&p, &x) || read_uint(&p, &y) ||
+          read_uint(&p, &w) || read_uint(&p, &h) ||
+          x >= DUNGEON_X || y >= DUNGEON_Y || w > DUNGEON_X || h > DUNGEON_Y) {
+        err = "expected fill corridor|wall X Y W H";
+      } else {
+        fill_rect(d, x, y, w, h, tile, fill_hardness(tile));
+      }
+    } else if (word_is(word, len, "flood")) {
+      if (read_tile(&p, &tile) || read_position(d, &p, &x, &y)) {
+        err = "expected flood corridor|wall [X Y] inside the border";
+      } else if (!fillable(d, x, y)) {
+        err = "cannot fill rooms";
+      } else {
+        flood_fill(d, x, y, tile, fill_hardness(tile));
+      }
+    } else if (word_is(word, len, "move")) {
+      if (read_position(d, &p, &x, &y)) {
+        err = "expected move X Y inside the border";
+      } else {
+        (*d).set_curs(x, y);
+      }
+    } else if (word_is(word, len, "room")) {
+      if (read_uint(&p, &x) || read_uint(&p, &y) ||
+          read_uint(&p, &w) || read_uint(&p, &h) ||
+          x > UINT8_MAX || y > UINT8_MAX || w > UINT8_MAX || h > UINT8_MAX) {
+        err = "expected room X Y W H";
+      } else if (add_room(d, x, y, w, h)) {
+        err = "room does not fit";
+      }
+    } else if (word_is(word, len, "delete")) {
+      if (read_position(d, &p, &x, &y)) {
+        err = "expected delete [X Y] inside the border";
+      } else if (remove_room(d, x, y)) {
+        err = "no room to delete";
+      }
+    } else if (word_is(word, len, "pc")) {
+      if (read_position(d, &p, &x, &y)) {
+        err = "expected pc [X Y] inside the border";
+      } else if (move_pc(d, x, y)) {
+        err = "place PC in room or corridor";
+      }
+    } else if (word_is(word, len, "brush")) {
+      len = read_word(&p, &word);
+      if (word_is(word, len, "raise")) {
+        mode = brush_raise;
+      } else if (word_is(word, len, "lower")) {
+        mode = brush_lower;
+      } else if (word_is(word, len, "set")) {
+        mode = brush_set;
+      } else if (word_is(word, len, "smooth")) {
+        mode = brush_smooth;
+      } else {
+        len = 0;
+      }
+      if (!len || read_uint(&p, &w) || read_uint(&p, &h) ||
+          w > MAX_BRUSH_RADIUS || h > UINT8_MAX ||
+          read_position(d, &p, &x, &y)) {
+        err = "expected brush raise|lower|set|smooth R N [X Y]";
+      } else {
+        apply_brush(d, x, y, w, mode, h);
+      }
+    } else if (word_is(word, len, "smooth")) {
+      if (read_uint(&p, &x) || x > MAX_SMOOTH_PASSES) {
+        err = "expected smooth N";
+      } else {
+        smooth_hardness(d, x);
+      }
+    } else if (word_is(word, len, "stairs")) {
+      if (place_stairs(d)) {
+        err = "not enough connected floor for stairs";
+      }
+    } else if (word_is(word, len, "seed")) {
+      if (read_uint(&p, &x)) {
+        err = "expected seed N";
+      } else {
+        std::srand(x);
+      }
+    } else if (word_is(word, len, "undo")) {
+      if (!d->hist || (*d->hist).undo(d)) {
+        err = "nothing to undo";
+      }
+    } else if (word_is(word, len, "redo")) {
+      if (!d->hist || (*d->hist).redo(d)) {
+        err = "nothing to redo";
+      }
+    } else if (word_is(word, len, "begin")) {
+      if (d->hist) {
+        (*d->hist).begin();
+      }
+    } else if (word_is(word, len, "end")) {
+      if (d->hist) {
+        (*d->hist).end();
+      }
+    } else if (word_is(word, len, "new")) {
+      if (d->hist) {
+        (*d->hist).clear();
+      }
+      del_dungeon(d);
+      init_dungeon(d);
+      (*d).set_pc(0, 0);
+    } else if (word_is(word, len, "load")) {
+      len = read_word(&p, &word);
+      file.assign(word, len);
+      file = save_path(len ? file.c_str() : nullptr);
+      if (read_save_file(file.c_str(), save)) {
+        err = strerror(errno);
+      } else if (!decode_dungeon(d, save.empty() ? nullptr : &save[0],
+                                 save.size(), &err) && d->hist) {
+        (*d->hist).clear();
+      }
+    } else if (word_is(word, len, "save")) {
+      len = read_word(&p, &word);
+      file.assign(word, len);
+      if (write_dungeon(d, len ? file.c_str() : nullptr)) {
+        err = "save failed";
+      }
+    } else {
+      err = "unknown command";
+    }
+
+    if (!err && read_word(&p, &word)) {
+      err = "unexpected text after command";
+    }
+    if (grouped) {
+      (*d->hist).end();
+    }
+    if (err) {
+      std::fprintf(stderr, "%s:%u: %s\n", name, line, err);
+      errors++;
+    }
+
+    /* On to the next line, past any comment */
+    while (*p && *p != '\n') {
+      p++;
+    }
+    if (*p) {
+      p++;
+    }
+  }
+
+  return errors ? 1 : 0;
+} // run_script_buffer
+
+/*
+ * Runs an edit script from a file, or from stdin if file is "-"
+ */
+int run_script(dungeon *d, const char *file)
+{
+  FILE *f;
+  std::vector<char> buf;
+  size_t len, n;
+
+  if (!strcmp(file, "-")) {
+    f = stdin;
+  } else if (!(f = fopen(file, "r"))) {
+    std::perror(file);
+    return 1;
+  }
+
+  len = 0;
+  buf.resize(1 << 16);
+  while ((n = fread(&buf[len], 1, buf.size() - len - 1, f)) > 0) {
+    len += n;
+    if (len + 1 == buf.size()) {
+      buf.resize(buf.size() << 1);
+    }
+  }
+  buf[len] = '\0';
+
+  if (f != stdin) {
+    fclose(f);
+  }
+
+  return run_script_buffer(d, file, &buf[0]);
+} // run_script
+
+/*
+ * Starts recording the edits made in the editor as a script.  The
+ * script begins by recreating the starting dungeon, so replaying it
+ * repeats the session exactly.
+ */
+int open_record(const char *file, uint32_t seed, int load,
+                const char *load_file)
+{
+  if (!(record_file = fopen(file, "w"))) {
+    std::perror(file);
+    return 1;
+  }
+  std::fprintf(record_file, "# dgen session\nseed %u\n", seed);
+  if (!load) {
+    std::fprintf(record_file, "new\n");
+  } else if (load_file) {
+    std::fprintf(record_file, "load %s\n", load_file);
+  } else {
+    std::fprintf(record_file, "load\n");
+  }
+  return 0;
+} // open_record
+
+/*
+ * Appends a command to the recording, if there is one
+ */
+void record_edit(const char *fmt, ...)
+{
+  va_list ap;
+
+  if (!record_file) {
+    return;
+  }
+  va_start(ap, fmt);
+  std::vfprintf(record_file, fmt, ap);
+  va_end(ap);
+  std::fputc('\n', record_file);
+} // record_edit
+
+void close_record(void)
+{
+  if (record_file) {
+    fclose(record_file);
+    record_file = nullptr;
+  }
+} // close_record
@@ -0,0 +1,16 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdint.h>
+
+class dungeon;
+
+int run_script(dungeon *d, const char *file);
+int run_script_buffer(dungeon *d, const char *name, const char *buf);
+int open_record(const char *file, uint32_t seed, int load,
+                const char *load_file);
+void record_edit(const char *fmt, ...)
+  __attribute__ ((format (printf, 1, 2)));
+void close_record(void);
+
+#endif
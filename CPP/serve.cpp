@@ -0,0 +1,502 @@
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "brush.h"
+#include "corpus.h"
+#include "dungeon.h"
+#include "serve.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Dungeon server.  Worker threads generate dungeons ahead of time into
+ * a dungeon_pool; the serving thread only copies encoded saves out of
+ * it, so a request never waits on generation unless the pool has run
+ * dry.  Clients connect to a Unix socket and send one SERVE_REQUEST
+ * byte per dungeon wanted; each is answered with a save, in the usual
+ * RLG327 format, whose header gives its length.  Requests may be
+ * pipelined.
+ */
+
+/* Bytes of save a client may have waiting before we stop taking more */
+static const size_t MAX_CLIENT_BACKLOG = 64 * 1024;
+/* Save header: marker, version, size, PC position */
+static const size_t SAVE_HEADER = 22;
+
+dungeon_pool::dungeon_pool(uint32_t size) : slots(nullptr), mask(0), head(0),
+                                            tail(0)
+{
+  size_t n, i;
+
+  for (n = 2; n < size; n <<= 1)
+    ;
+  slots = new slot[n];
+  mask = n - 1;
+  for (i = 0; i < n; i++) {
+    slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+dungeon_pool::~dungeon_pool()
+{
+  delete [] slots;
+}
+
+/*
+ * Copies a save into the pool.  Returns false if it's full or the save
+ * is too big for a slot.
+ */
+bool dungeon_pool::push(const uint8_t *save, size_t len)
+{
+  slot *s;
+  size_t pos, seq;
+
+  if (len > MAX_POOL_SAVE) {
+    return false;
+  }
+  pos = tail.load(std::memory_order_relaxed);
+  for (;;) {
+    s = &slots[pos & mask];
+    seq = s->seq.load(std::memory_order_acquire);
+    if (seq == pos) {
+      if (tail.compare_exchange_weak(pos, pos + 1,
+                                     std::memory_order_relaxed)) {
+        break;
+      }
+    } else if ((intptr_t) (seq - pos) < 0) {
+      return false;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+  memcpy(s->save, save, len);
+  s->len = len;
+  s->seq.store(pos + 1, std::memory_order_release);
+  return true;
+} // push
+
+/*
+ * Appends the oldest save in the pool to buf.  Returns false if the
+ * pool is empty.
+ */
+bool dungeon_pool::pop(std::vector<uint8_t>& buf)
+{
+  slot *s;
+  size_t pos, seq;
+
+  pos = head.load(std::memory_order_relaxed);
+  for (;;) {
+    s = &slots[pos & mask];
+    seq = s->seq.load(std::memory_order_acquire);
+    if (seq == pos + 1) {
+      if (head.compare_exchange_weak(pos, pos + 1,
+                                     std::memory_order_relaxed)) {
+        break;
+      }
+    } else if ((intptr_t) (seq - (pos + 1)) < 0) {
+      return false;
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
+  }
+  buf.insert(buf.end(), s->save, s->save + s->len);
+  s->seq.store(pos + mask + 1, std::memory_order_release);
+  return true;
+} // pop
+
+static volatile sig_atomic_t stopping;
+
+static void stop_serving(int)
+{
+  stopping = 1;
+}
+
+/*
+ * Keeps the pool full.  Generation is slow next to serving, so when
+ * the pool is full a worker naps rather than spinning.
+ */
+static void fill_pool(dungeon_pool *pool, uint32_t smooth,
+                      std::atomic<bool> *done)
+{
+  dungeon d;
+  std::vector<uint8_t> buf;
+
+  while (!*done) {
+    gen_dungeon(&d);
+    smooth_hardness(&d, smooth);
+    encode_dungeon(&d, buf);
+    while (!pool->push(&buf[0], buf.size()) && !*done) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  del_dungeon(&d);
+} // fill_pool
+
+/* A connected client and the saves waiting to go to it */
+struct serve_client {
+  int fd;
+  uint32_t wanted;
+  std::vector<uint8_t> out;
+  size_t sent;
+};
+
+/*
+ * Opens a listening socket at path.  A socket file left by a server
+ * that's gone is replaced, but not one that's still answering.
+ */
+static int listen_at(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof (addr.sun_path)) {
+    std::fprintf(stderr, "%s: Socket path too long.\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    std::perror("socket");
+    return -1;
+  }
+  if (!connect(fd, (struct sockaddr *) &addr, sizeof (addr))) {
+    std::fprintf(stderr, "%s: Already being served.\n", path);
+    close(fd);
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+      listen(fd, SOMAXCONN) ||
+      fcntl(fd, F_SETFL, O_NONBLOCK)) {
+    std::perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+} // listen_at
+
+/*
+ * Moves saves from the pool to the client's output for the requests
+ * it has made.  Returns false if the pool ran out first.
+ */
+static bool fill_client(serve_client *c, dungeon_pool *pool)
+{
+  if (c->sent == c->out.size()) {
+    c->out.clear();
+    c->sent = 0;
+  }
+  while (c->wanted && c->out.size() - c->sent < MAX_CLIENT_BACKLOG) {
+    if (!pool->pop(c->out)) {
+      return false;
+    }
+    c->wanted--;
+  }
+  return true;
+} // fill_client
+
+/*
+ * Reads requests from and writes saves to a ready client.  Returns 1
+ * once the client has gone.
+ */
+static int service_client(serve_client *c, short revents, dungeon_pool *pool,
+                          uint64_t *served, uint64_t *dry)
+{
+  uint8_t req[256];
+  ssize_t n, i;
+  size_t before;
+
+  if (revents & (POLLIN | POLLHUP | POLLERR)) {
+    if ((n = read(c->fd, req, sizeof (req))) <= 0) {
+      if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        n = 0;
+      } else {
+        return 1;
+      }
+    }
+    for (i = 0; i < n; i++) {
+      c->wanted += req[i] == SERVE_REQUEST;
+    }
+  }
+
+  before = c->wanted;
+  if (!fill_client(c, pool)) {
+    (*dry)++;
+  }
+  *served += before - c->wanted;
+
+  if (c->sent < c->out.size()) {
+    if ((n = write(c->fd, &c->out[c->sent], c->out.size() - c->sent)) < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        return 1;
+      }
+      n = 0;
+    }
+    c->sent += n;
+  }
+  return 0;
+} // service_client
+
+/*
+ * Serves generated dungeons on a Unix socket at path until interrupted,
+ * keeping up to pool_size of them ready, made by jobs threads with the
+ * given smoothing passes.  Returns 1 on error.
+ */
+int serve_dungeons(const char *path, uint32_t pool_size, uint32_t jobs,
+                   uint32_t smooth)
+{
+  dungeon_pool pool(pool_size);
+  std::vector<std::thread> workers;
+  std::atomic<bool> done(false);
+  std::vector<serve_client> clients;
+  std::vector<struct pollfd> fds;
+  struct sigaction sa;
+  serve_client c;
+  uint64_t served, dry;
+  uint32_t i;
+  bool waiting;
+  int lfd, fd;
+
+  if ((lfd = listen_at(path)) < 0) {
+    return 1;
+  }
+
+  /* Without SA_RESTART, so poll wakes up to notice */
+  memset(&sa, 0, sizeof (sa));
+  sa.sa_handler = stop_serving;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < jobs; i++) {
+    workers.push_back(std::thread(fill_pool, &pool, smooth, &done));
+  }
+  std::fprintf(stderr, "Serving dungeons on %s, %zu pooled by %u workers\n",
+               path, pool.capacity(), jobs);
+
+  served = dry = 0;
+  waiting = false;
+  while (!stopping) {
+    fds.clear();
+    fds.push_back({lfd, POLLIN, 0});
+    for (i = 0; i < clients.size(); i++) {
+      fds.push_back({clients[i].fd,
+                     (short) (POLLIN | (clients[i].sent < clients[i].out.size()
+                                        ? POLLOUT : 0)), 0});
+    }
+    /* A client waiting on a dry pool is retried shortly */
+    if (poll(&fds[0], fds.size(), waiting ? 1 : -1) < 0 && errno != EINTR) {
+      std::perror("poll");
+      break;
+    }
+
+    waiting = false;
+    for (i = clients.size(); i > 0; i--) {
+      if (service_client(&clients[i - 1], fds[i].revents, &pool, &served,
+                         &dry)) {
+        close(clients[i - 1].fd);
+        clients.erase(clients.begin() + i - 1);
+      } else {
+        waiting |= clients[i - 1].wanted != 0;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      while ((fd = accept(lfd, nullptr, nullptr)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        c.fd = fd;
+        c.wanted = 0;
+        c.sent = 0;
+        clients.push_back(c);
+      }
+    }
+  }
+
+  done = true;
+  for (i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  for (i = 0; i < clients.size(); i++) {
+    close(clients[i].fd);
+  }
+  close(lfd);
+  unlink(path);
+
+  std::fprintf(stderr, "Served %llu dungeons, waited on an empty pool "
+               "%llu times\n",
+               (unsigned long long) served, (unsigned long long) dry);
+  return 0;
+} // serve_dungeons
+
+/*
+ * Connects to a dungeon server.  Returns the socket, or -1 on error.
+ */
+int connect_server(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof (addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *) &addr, sizeof (addr))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+} // connect_server
+
+/*
+ * Reads exactly len bytes.  Returns 1 on error or early end of file.
+ */
+static int read_full(int fd, uint8_t *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len) {
+    if ((n = read(fd, buf, len)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (!n) {
+        errno = ECONNRESET;
+      }
+      return 1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+} // read_full
+
+/*
+ * Asks the server on fd for a dungeon and reads its save into buf.
+ * Returns 1 on error.
+ */
+int fetch_save(int fd, std::vector<uint8_t>& buf)
+{
+  uint32_t be32;
+  size_t len;
+
+  while (write(fd, &SERVE_REQUEST, 1) != 1) {
+    if (errno != EINTR) {
+      return 1;
+    }
+  }
+  buf.resize(SAVE_HEADER);
+  if (read_full(fd, &buf[0], SAVE_HEADER)) {
+    return 1;
+  }
+  memcpy(&be32, &buf[16], 4);
+  len = be32toh(be32);
+  if (len < SAVE_HEADER || len > MAX_POOL_SAVE) {
+    errno = EPROTO;
+    return 1;
+  }
+  buf.resize(len);
+  return read_full(fd, &buf[SAVE_HEADER], len - SAVE_HEADER);
+} // fetch_save
+
+/*
+ * Fetches one dungeon from the server at path and saves it to file.
+ * Returns 1 on error.
+ */
+int fetch_dungeon(const char *path, const char *file)
+{
+  dungeon d;
+  std::vector<uint8_t> buf;
+  const char *err;
+  int fd;
+
+  if ((fd = connect_server(path)) < 0 || fetch_save(fd, buf)) {
+    std::perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  close(fd);
+  if (decode_dungeon(&d, &buf[0], buf.size(), &err)) {
+    std::fprintf(stderr, "%s: %s\n", path, err);
+    return 1;
+  }
+  del_dungeon(&d);
+  if (write_save_file(file, buf)) {
+    std::perror(file);
+    return 1;
+  }
+  return 0;
+} // fetch_dungeon
+
+/*
+ * Fetches count dungeons from the server at path over clients
+ * connections at once, each waiting for one dungeon before asking for
+ * the next, and prints the latency of a request.  Returns 1 on error.
+ */
+int load_test(const char *path, uint32_t count, uint32_t clients)
+{
+  std::vector<histogram> latency(clients);
+  std::atomic<uint32_t> failed(0);
+  histogram total;
+  uint64_t start, elapsed;
+  uint32_t i;
+
+  start = now_usec();
+  parallel_for(clients, clients, [&](uint32_t i) {
+    std::vector<uint8_t> buf;
+    uint32_t n, j;
+    uint64_t t;
+    int fd;
+
+    if ((fd = connect_server(path)) < 0) {
+      std::perror(path);
+      failed++;
+      return;
+    }
+    n = count / clients + (i < count % clients);
+    for (j = 0; j < n; j++) {
+      t = now_nsec();
+      if (fetch_save(fd, buf)) {
+        std::perror(path);
+        failed++;
+        break;
+      }
+      latency[i].record(now_nsec() - t);
+    }
+    close(fd);
+  });
+  elapsed = now_usec() - start;
+
+  for (i = 0; i < clients; i++) {
+    total.merge(latency[i]);
+  }
+  std::printf("%llu dungeons over %u clients in %.3f s, %.0f per second\n"
+              "latency us: mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+              "max %.1f\n",
+              (unsigned long long) total.count, clients, elapsed / 1e6,
+              elapsed ? total.count * 1e6 / elapsed : 0.0,
+              total.mean() / 1e3, total.percentile(50) / 1e3,
+              total.percentile(90) / 1e3, total.percentile(99) / 1e3,
+              total.percentile(99.9) / 1e3, total.max / 1e3);
+  return failed ? 1 : 0;
+} // load_test
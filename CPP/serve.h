@@ -0,0 +1,61 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "dungeon.h"
+
+const uint32_t DEFAULT_POOL_SIZE = 256;
+/* Largest pool --pool takes; each slot holds a whole save */
+const uint32_t MAX_POOL_SIZE = 65536;
+/* Largest save the pool holds: a generated dungeon with stairs */
+const size_t MAX_POOL_SAVE = 22 + DUNGEON_X * DUNGEON_Y +
+                             MAX_ROOM_COUNT * 4 + 4;
+/* What a client sends to ask for a dungeon */
+const uint8_t SERVE_REQUEST = 'g';
+
+/*
+ * Bounded lock-free ring of encoded dungeons, after Vyukov's MPMC
+ * queue.  Each slot's sequence number says whose turn it is: a slot
+ * at position pos is free for the push of pos when its sequence is
+ * pos, and holds a dungeon for the pop of pos when it is pos + 1.
+ * Pushers and poppers only contend on their own counter.
+ */
+class dungeon_pool {
+ private:
+  struct slot {
+    std::atomic<size_t> seq;
+    uint32_t len;
+    uint8_t save[MAX_POOL_SAVE];
+  };
+
+  slot *slots;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head;  /* Next to pop */
+  alignas(64) std::atomic<size_t> tail;  /* Next to push */
+
+ public:
+  dungeon_pool(uint32_t size);
+  ~dungeon_pool();
+  dungeon_pool(const dungeon_pool&) = delete;
+  dungeon_pool& operator=(const dungeon_pool&) = delete;
+
+  bool push(const uint8_t *save, size_t len);
+  bool pop(std::vector<uint8_t>& buf);
+  size_t capacity(void)
+  {
+    return mask + 1;
+  }
+};
+
+int serve_dungeons(const char *path, uint32_t pool_size, uint32_t jobs,
+                   uint32_t smooth);
+int connect_server(const char *path);
+int fetch_save(int fd, std::vector<uint8_t>& buf);
+int fetch_dungeon(const char *path, const char *file);
+int load_test(const char *path, uint32_t count, uint32_t clients);
+
+#endif
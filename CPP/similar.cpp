@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "convert.h"
+#include "corpus.h"
+#include "dungeon.h"
+#include "loader.h"
+#include "path.h"
+#include "similar.h"
+#include "utils.h"
+
+/*
+ * Layout similarity search.  A dungeon is reduced to a set of features
+ * and the set to a MinHash signature: for each of MINHASH_SIZE hash
+ * functions, the smallest hash of any feature.  Two signatures agree
+ * in about the same fraction of places as the feature sets overlap
+ * (their Jaccard similarity).
+ *
+ * The index keeps every signature, and for each of LSH_BANDS bands of
+ * LSH_ROWS values, every dungeon's band sorted by value.  Dungeons
+ * that share any whole band with the query are the candidates; only
+ * they are scored.  The index is written once and mapped to query, so
+ * a query reads only the pages it touches.
+ *
+ * Index layout, in host order:
+ *   header         "DGNS", version, count, MINHASH_SIZE, LSH_BANDS,
+ *                  0, names length (8 bytes)
+ *   signatures     count * MINHASH_SIZE uint16_t
+ *   band keys      LSH_BANDS * count uint64_t, sorted within each band
+ *   band ids       LSH_BANDS * count uint32_t, the dungeon of each key
+ *   name offsets   count + 1 uint32_t, 8 byte aligned
+ *   names          The dungeons' names, back to back
+ */
+
+static const char SIMILAR_MAGIC[] = "DGNS";
+static const uint32_t SIMILAR_VERSION = 2;
+
+/* Feature kinds, in the top bits of a feature */
+static const uint32_t FEATURE_ROOM = 1 << 28;
+static const uint32_t FEATURE_HALL = 2 << 28;
+static const uint32_t FEATURE_TILE = 3 << 28;
+
+struct similar_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t minhash_size;
+  uint32_t bands;
+  uint32_t unused;
+  uint64_t names_len;
+};
+
+struct similar_layout {
+  size_t sigs, keys, ids, name_offsets, names, total;
+};
+
+static void index_layout(uint32_t count, uint64_t names_len,
+                         similar_layout *l)
+{
+  l->sigs = sizeof (similar_header);
+  l->keys = l->sigs + (size_t) count * MINHASH_SIZE * sizeof (uint16_t);
+  l->ids = l->keys + (size_t) count * LSH_BANDS * sizeof (uint64_t);
+  l->name_offsets = l->ids + (size_t) count * LSH_BANDS * sizeof (uint32_t);
+  l->name_offsets = (l->name_offsets + 7) & ~(size_t) 7;
+  l->names = l->name_offsets + ((size_t) count + 1) * sizeof (uint32_t);
+  l->total = l->names + names_len;
+} // index_layout
+
+static inline uint64_t mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+} // mix64
+
+/* The MinHash functions: h(x) = (a * x + b) >> 32, with a odd */
+static uint64_t minhash_a[MINHASH_SIZE], minhash_b[MINHASH_SIZE];
+
+static struct minhash_init {
+  minhash_init()
+  {
+    uint32_t k;
+
+    for (k = 0; k < MINHASH_SIZE; k++) {
+      minhash_a[k] = mix64(2 * k + 1) | 1;
+      minhash_b[k] = mix64(2 * k + 2);
+    }
+  }
+} minhash_init;
+
+/*
+ * The features of a layout: each room, coarsely placed and sized so
+ * that rooms a cell or two apart still match; each corridor cell, on a
+ * 2 by 2 grid; and each 3 by 3 pattern of floor, tagged with where on
+ * the map it is to within a few cells.
+ */
+void layout_features(dungeon *d, std::vector<uint32_t>& features)
+{
+  uint32_t i, x, y, pattern;
+
+  features.clear();
+  for (i = 0; i < d->rooms.size(); i++) {
+    features.push_back(FEATURE_ROOM |
+                       ((*d->rooms[i]).get_x() / 4) << 20 |
+                       ((*d->rooms[i]).get_y() / 2) << 12 |
+                       ((*d->rooms[i]).get_xsize() / 2) << 6 |
+                       (*d->rooms[i]).get_ysize() / 2);
+  }
+  for (y = 1; y < DUNGEON_Y - 1; y++) {
+    for (x = 1; x < DUNGEON_X - 1; x++) {
+      if (dmapxy(x, y) == ter_floor_hall || dmapxy(x, y) == ter_floor) {
+        features.push_back(FEATURE_HALL | (y / 2) << 8 | x / 2);
+      }
+    }
+  }
+  for (y = 0; y < DUNGEON_Y - 2; y++) {
+    for (x = 0; x < DUNGEON_X - 2; x++) {
+      pattern = walkable(d, x, y)         | walkable(d, x + 1, y) << 1 |
+                walkable(d, x + 2, y) << 2 | walkable(d, x, y + 1) << 3 |
+                walkable(d, x + 1, y + 1) << 4 |
+                walkable(d, x + 2, y + 1) << 5 |
+                walkable(d, x, y + 2) << 6 | walkable(d, x + 1, y + 2) << 7 |
+                walkable(d, x + 2, y + 2) << 8;
+      if (pattern) {
+        features.push_back(FEATURE_TILE | (y / 3) << 20 | (x / 6) << 12 |
+                           pattern);
+      }
+    }
+  }
+} // layout_features
+
+/*
+ * The MinHash signature of a dungeon, keeping the top 16 bits of each
+ * minimum
+ */
+void minhash_dungeon(dungeon *d, uint16_t sig[MINHASH_SIZE])
+{
+  std::vector<uint32_t> features;
+  uint32_t mins[MINHASH_SIZE], h, i, k;
+  uint64_t base;
+
+  layout_features(d, features);
+  for (k = 0; k < MINHASH_SIZE; k++) {
+    mins[k] = UINT32_MAX;
+  }
+  for (i = 0; i < features.size(); i++) {
+    base = mix64(features[i]);
+    for (k = 0; k < MINHASH_SIZE; k++) {
+      h = (minhash_a[k] * base + minhash_b[k]) >> 32;
+      mins[k] = h < mins[k] ? h : mins[k];
+    }
+  }
+  for (k = 0; k < MINHASH_SIZE; k++) {
+    sig[k] = mins[k] >> 16;
+  }
+} // minhash_dungeon
+
+static inline uint64_t band_key(const uint16_t *sig, uint32_t band)
+{
+  uint64_t key;
+  uint32_t r;
+
+  for (key = 0, r = 0; r < LSH_ROWS; r++) {
+    key = key << 16 | sig[band * LSH_ROWS + r];
+  }
+  return key;
+} // band_key
+
+/*
+ * Builds a similarity index over a directory or archive, signing
+ * dungeons on jobs threads.  Dungeons that can't be loaded are
+ * reported and left out.  Returns 1 on error.
+ */
+int build_similar_index(const char *src, const char *index, uint32_t jobs)
+{
+  corpus c;
+  similar_header hdr;
+  similar_layout l;
+  std::vector<uint16_t> sigs;
+  std::vector<uint8_t> ok;
+  std::vector<std::pair<uint64_t, uint32_t> > band;
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> ids, name_offsets;
+  std::vector<uint8_t> buf;
+  std::string names;
+  uint32_t i, b, n;
+  uint64_t start;
+
+  if (c.open(src)) {
+    return 1;
+  }
+
+  start = now_usec();
+  sigs.resize((size_t) c.size() * MINHASH_SIZE);
+  ok.resize(c.size());
+  load_dungeons(c, jobs, [&](uint32_t, uint32_t i, dungeon *d) {
+    minhash_dungeon(d, &sigs[(size_t) i * MINHASH_SIZE]);
+    ok[i] = 1;
+  });
+
+  /* Close up the gaps left by dungeons that failed */
+  for (i = n = 0; i < c.size(); i++) {
+    if (!ok[i]) {
+      continue;
+    }
+    if (n != i) {
+      memcpy(&sigs[(size_t) n * MINHASH_SIZE], &sigs[(size_t) i * MINHASH_SIZE],
+             MINHASH_SIZE * sizeof (uint16_t));
+    }
+    name_offsets.push_back(names.size());
+    names += c.name(i);
+    n++;
+  }
+  name_offsets.push_back(names.size());
+  sigs.resize((size_t) n * MINHASH_SIZE);
+
+  keys.reserve((size_t) n * LSH_BANDS);
+  ids.reserve((size_t) n * LSH_BANDS);
+  band.resize(n);
+  for (b = 0; b < LSH_BANDS; b++) {
+    for (i = 0; i < n; i++) {
+      band[i].first = band_key(&sigs[(size_t) i * MINHASH_SIZE], b);
+      band[i].second = i;
+    }
+    std::sort(band.begin(), band.end());
+    for (i = 0; i < n; i++) {
+      keys.push_back(band[i].first);
+      ids.push_back(band[i].second);
+    }
+  }
+
+  memset(&hdr, 0, sizeof (hdr));
+  memcpy(hdr.magic, SIMILAR_MAGIC, 4);
+  hdr.version = SIMILAR_VERSION;
+  hdr.count = n;
+  hdr.minhash_size = MINHASH_SIZE;
+  hdr.bands = LSH_BANDS;
+  hdr.names_len = names.size();
+  index_layout(n, names.size(), &l);
+
+  /* Synced and renamed over the old index, as a save is */
+  buf.assign(l.total, 0);
+  memcpy(&buf[0], &hdr, sizeof (hdr));
+  memcpy(&buf[0] + l.sigs, sigs.data(), sigs.size() * sizeof (uint16_t));
+  memcpy(&buf[0] + l.keys, keys.data(), keys.size() * sizeof (uint64_t));
+  memcpy(&buf[0] + l.ids, ids.data(), ids.size() * sizeof (uint32_t));
+  memcpy(&buf[0] + l.name_offsets, name_offsets.data(),
+         name_offsets.size() * sizeof (uint32_t));
+  memcpy(&buf[0] + l.names, names.data(), names.size());
+  if (write_save_file(index, buf)) {
+    std::perror(index);
+    return 1;
+  }
+
+  std::fprintf(stderr, "Indexed %u dungeons in %s, %.1f us per dungeon\n",
+               n, index, c.size() ? (double) (now_usec() - start) / c.size()
+                                  : 0.0);
+  return n == c.size() ? 0 : 1;
+} // build_similar_index
+
+/*
+ * Checks the parts of a mapped index that are used to index other
+ * parts: every id names a dungeon, and the name offsets run in order
+ * through the names.  Done once on opening, so a corrupt index can't
+ * send a lookup outside the mapping.
+ */
+static bool index_consistent(const uint8_t *map, const similar_layout *l,
+                             uint32_t count, uint64_t names_len)
+{
+  const uint32_t *ids, *name_offsets;
+  size_t i;
+
+  ids = (const uint32_t *) (map + l->ids);
+  for (i = 0; i < (size_t) count * LSH_BANDS; i++) {
+    if (ids[i] >= count) {
+      return false;
+    }
+  }
+  name_offsets = (const uint32_t *) (map + l->name_offsets);
+  if (name_offsets[0] || name_offsets[count] != names_len) {
+    return false;
+  }
+  for (i = 0; i < count; i++) {
+    if (name_offsets[i] > name_offsets[i + 1]) {
+      return false;
+    }
+  }
+  return true;
+} // index_consistent
+
+/*
+ * Prints the top dungeons in the index most like the one in file, as
+ * "similarity<TAB>name", most similar first.  The query can be a
+ * save, JSON or an ASCII map.  Returns 1 on error.
+ */
+int find_similar(const char *file, const char *index, uint32_t top)
+{
+  dungeon d;
+  struct stat st;
+  const similar_header *hdr;
+  similar_layout l;
+  const uint8_t *map;
+  const uint16_t *sigs, *s;
+  const uint64_t *keys, *lo, *hi;
+  const uint32_t *ids, *name_offsets;
+  const char *names;
+  uint16_t sig[MINHASH_SIZE];
+  std::vector<uint32_t> candidates;
+  std::vector<std::pair<uint32_t, uint32_t> > scored;
+  uint32_t b, i, k, same;
+  uint64_t key, start;
+  int fd;
+
+  if (read_any_dungeon(&d, file)) {
+    return 1;
+  }
+  start = now_usec();
+  minhash_dungeon(&d, sig);
+  del_dungeon(&d);
+
+  if ((fd = open(index, O_RDONLY)) < 0 || fstat(fd, &st)) {
+    std::perror(index);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  map = nullptr;
+  if ((size_t) st.st_size >= sizeof (similar_header)) {
+    map = (const uint8_t *) mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED,
+                                 fd, 0);
+    map = map == MAP_FAILED ? nullptr : map;
+  }
+  close(fd);
+  hdr = (const similar_header *) map;
+  if (hdr) {
+    index_layout(hdr->count, hdr->names_len, &l);
+  }
+  if (!hdr || memcmp(hdr->magic, SIMILAR_MAGIC, 4) ||
+      hdr->version != SIMILAR_VERSION || hdr->minhash_size != MINHASH_SIZE ||
+      hdr->bands != LSH_BANDS || l.total != (size_t) st.st_size ||
+      !index_consistent(map, &l, hdr->count, hdr->names_len)) {
+    std::fprintf(stderr, "%s: Not a similarity index.\n", index);
+    if (map) {
+      munmap((void *) map, st.st_size);
+    }
+    return 1;
+  }
+  sigs = (const uint16_t *) (map + l.sigs);
+  keys = (const uint64_t *) (map + l.keys);
+  ids = (const uint32_t *) (map + l.ids);
+  name_offsets = (const uint32_t *) (map + l.name_offsets);
+  names = (const char *) (map + l.names);
+
+  for (b = 0; b < LSH_BANDS; b++) {
+    key = band_key(sig, b);
+    lo = keys + (size_t) b * hdr->count;
+    hi = lo + hdr->count;
+    for (lo = std::lower_bound(lo, hi, key); lo < hi && *lo == key; lo++) {
+      candidates.push_back(ids[lo - keys]);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+
+  for (i = 0; i < candidates.size(); i++) {
+    s = sigs + (size_t) candidates[i] * MINHASH_SIZE;
+    for (k = same = 0; k < MINHASH_SIZE; k++) {
+      same += s[k] == sig[k];
+    }
+    scored.push_back(std::make_pair(same, candidates[i]));
+  }
+  top = top < scored.size() ? top : scored.size();
+  std::partial_sort(scored.begin(), scored.begin() + top, scored.end(),
+                    [](const std::pair<uint32_t, uint32_t>& a,
+                       const std::pair<uint32_t, uint32_t>& b) {
+                      return a.first > b.first ||
+                             (a.first == b.first && a.second < b.second);
+                    });
+  for (i = 0; i < top; i++) {
+    std::printf("%.3f\t%.*s\n", (double) scored[i].first / MINHASH_SIZE,
+                (int) (name_offsets[scored[i].second + 1] -
+                       name_offsets[scored[i].second]),
+                names + name_offsets[scored[i].second]);
+  }
+  std::fflush(stdout);
+  std::fprintf(stderr, "%zu candidates of %u dungeons, %.2f ms\n",
+               candidates.size(), hdr->count,
+               (now_usec() - start) / 1000.0);
+
+  munmap((void *) map, st.st_size);
+  return 0;
+} // find_similar
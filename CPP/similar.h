@@ -0,0 +1,20 @@
+#ifndef SIMILAR_H
+#define SIMILAR_H
+
+#include <stdint.h>
+#include <vector>
+
+class dungeon;
+
+/* MinHash values per dungeon, and how LSH groups them into bands */
+const uint32_t MINHASH_SIZE = 64;
+const uint32_t LSH_BANDS = 16;
+const uint32_t LSH_ROWS = MINHASH_SIZE / LSH_BANDS;
+const uint32_t DEFAULT_SIMILAR_TOP = 10;
+
+void layout_features(dungeon *d, std::vector<uint32_t>& features);
+void minhash_dungeon(dungeon *d, uint16_t sig[MINHASH_SIZE]);
+int build_similar_index(const char *src, const char *index, uint32_t jobs);
+int find_similar(const char *file, const char *index, uint32_t top);
+
+#endif
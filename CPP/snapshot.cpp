@@ -0,0 +1,88 @@
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "dungeon.h"
+#include "room.h"
+#include "snapshot.h"
+
+/*
+ * Snapshots the dungeon.  Rows the dungeon hasn't marked changed since
+ * its last snapshot are shared with it, as are marked rows that turn
+ * out the same; if nothing differs the last snapshot itself is
+ * returned.  Only the editor's thread may call this for a dungeon.
+ */
+snapshot_ptr snapshot_dungeon(dungeon *d)
+{
+  std::shared_ptr<dungeon_snapshot> s;
+  const dungeon_snapshot *prev;
+  std::shared_ptr<snapshot_row> row;
+  uint32_t i, y, r;
+  bool same;
+
+  prev = d->snap.get();
+  s = std::make_shared<dungeon_snapshot>();
+  same = prev != nullptr;
+  for (y = 0; y < DUNGEON_Y; y++) {
+    if (prev && !(d->snap_rows & 1 << y)) {
+      s->rows[y] = prev->rows[y];
+      continue;
+    }
+    if (prev && !memcmp(prev->rows[y]->ter, d->d_map[y], DUNGEON_X) &&
+        !memcmp(prev->rows[y]->hard, d->h_map[y], DUNGEON_X)) {
+      s->rows[y] = prev->rows[y];
+      continue;
+    }
+    row = std::make_shared<snapshot_row>();
+    memcpy(row->ter, d->d_map[y], DUNGEON_X);
+    memcpy(row->hard, d->h_map[y], DUNGEON_X);
+    s->rows[y] = row;
+    same = false;
+  }
+
+  s->rooms.resize(4 * d->rooms.size());
+  for (i = 0; i < d->rooms.size(); i++) {
+    r = (*d->rooms[i]).byte_frmt();
+    s->rooms[4 * i] = r >> 24;
+    s->rooms[4 * i + 1] = r >> 16;
+    s->rooms[4 * i + 2] = r >> 8;
+    s->rooms[4 * i + 3] = r;
+  }
+  s->pc_x = (*d).get_pcx();
+  s->pc_y = (*d).get_pcy();
+  d->snap_rows = 0;
+
+  if (same && s->rooms == prev->rooms && s->pc_x == prev->pc_x &&
+      s->pc_y == prev->pc_y) {
+    return d->snap;
+  }
+  s->version = prev ? prev->version + 1 : 1;
+  d->snap = s;
+  return d->snap;
+} // snapshot_dungeon
+
+/*
+ * Makes d a copy of a snapshot, for a thread to work on privately.
+ * The cursor goes to the PC or the middle, as when loading.
+ */
+void restore_snapshot(const dungeon_snapshot *s, dungeon *d)
+{
+  uint32_t i, y;
+
+  del_dungeon(d);
+  for (y = 0; y < DUNGEON_Y; y++) {
+    memcpy(d->d_map[y], s->rows[y]->ter, DUNGEON_X);
+    memcpy(d->h_map[y], s->rows[y]->hard, DUNGEON_X);
+  }
+  for (i = 0; i < s->rooms.size(); i += 4) {
+    d->rooms.push_back(new room(s->rooms[i], s->rooms[i + 1],
+                                s->rooms[i + 2], s->rooms[i + 3]));
+  }
+  (*d).set_pc(s->pc_x, s->pc_y);
+  if (s->pc_x && s->pc_y) {
+    (*d).set_curs(s->pc_x, s->pc_y);
+  } else {
+    (*d).set_curs(40, 10);
+  }
+  (*d).mark_all_dirty();
+} // restore_snapshot
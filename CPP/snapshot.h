@@ -0,0 +1,38 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "dungeon.h"
+
+/* One row of cells, shared by every snapshot it is unchanged in */
+struct snapshot_row {
+  terrain_type ter[DUNGEON_X];
+  uint8_t hard[DUNGEON_X];
+};
+
+/*
+ * An immutable copy of a dungeon, for background threads to read
+ * while the editor carries on.  A new snapshot copies only the rows
+ * changed since the last one and shares the rest, so taking one costs
+ * about as much as the edits since.  Snapshots are freed by reference
+ * count when the last thread lets go, so readers never wait on the
+ * editor or on each other.
+ */
+struct dungeon_snapshot {
+  /* Counts up from 1 with each snapshot of the dungeon that differs */
+  uint64_t version;
+  std::shared_ptr<const snapshot_row> rows[DUNGEON_Y];
+  /* Four bytes per room, x, y, width, height, as in a save */
+  std::vector<uint8_t> rooms;
+  uint8_t pc_x, pc_y;
+};
+
+typedef std::shared_ptr<const dungeon_snapshot> snapshot_ptr;
+
+snapshot_ptr snapshot_dungeon(dungeon *d);
+void restore_snapshot(const dungeon_snapshot *s, dungeon *d);
+
+#endif
@@ -0,0 +1,209 @@
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include "stats.h"
+
+std::atomic<bool> stats_enabled(false);
+const char *stat_name[num_stats] = {
+  "init_dungeon",
+  "read_dungeon",
+  "write_dungeon",
+  "display",
+  "room_present",
+  "key"
+};
+
+/*
+ * The bucket holding v: the power of two, then the top
+ * HISTOGRAM_SUB_BITS bits below the leading one
+ */
+static inline uint32_t bucket_of(uint64_t v)
+{
+  uint32_t e;
+
+  if (v < HISTOGRAM_SUB) {
+    return v;
+  }
+  e = 63 - __builtin_clzll(v);
+  return ((e - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+         ((v >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+} // bucket_of
+
+/*
+ * The largest value that lands in bucket b
+ */
+static inline uint64_t bucket_top(uint32_t b)
+{
+  uint32_t e;
+
+  if (b < HISTOGRAM_SUB) {
+    return b;
+  }
+  e = (b >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+  return (((uint64_t) (HISTOGRAM_SUB + (b & (HISTOGRAM_SUB - 1))) + 1)
+          << (e - HISTOGRAM_SUB_BITS)) - 1;
+} // bucket_top
+
+void histogram::record(uint64_t v)
+{
+  counts[bucket_of(v)]++;
+  count++;
+  total += v;
+  if (v < min) {
+    min = v;
+  }
+  if (v > max) {
+    max = v;
+  }
+} // record
+
+/*
+ * Adds everything recorded in h to this histogram
+ */
+void histogram::merge(const histogram& h)
+{
+  uint32_t b;
+
+  for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    counts[b] += h.counts[b];
+  }
+  count += h.count;
+  total += h.total;
+  if (h.min < min) {
+    min = h.min;
+  }
+  if (h.max > max) {
+    max = h.max;
+  }
+} // merge
+
+/*
+ * The value below which p percent of the recorded values fall, to
+ * the resolution of the buckets
+ */
+uint64_t histogram::percentile(double p)
+{
+  uint64_t rank, seen;
+  uint32_t b;
+
+  if (!count) {
+    return 0;
+  }
+  rank = (uint64_t) (p / 100.0 * count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (b = 0, seen = 0; b < HISTOGRAM_BUCKETS; b++) {
+    seen += counts[b];
+    if (seen >= rank) {
+      return bucket_top(b) < max ? bucket_top(b) : max;
+    }
+  }
+  return max;
+} // percentile
+
+/*
+ * The timed paths run on the editor's thread and on workers (saving,
+ * serving, exporting), so each thread records into its own histograms
+ * and readers merge them.  A thread's set joins the list the first
+ * time it records and is folded into retired when the thread exits.
+ * Its lock is only ever contended by a reader merging it.
+ */
+class thread_stats {
+ public:
+  std::mutex lock;
+  histogram h[num_stats];
+
+  thread_stats();
+  ~thread_stats();
+};
+
+static std::mutex sets_lock;
+static std::vector<thread_stats *> sets;
+static histogram retired[num_stats];
+static thread_local thread_stats local_stats;
+
+thread_stats::thread_stats()
+{
+  std::lock_guard<std::mutex> hold(sets_lock);
+
+  sets.push_back(this);
+}
+
+thread_stats::~thread_stats()
+{
+  std::lock_guard<std::mutex> hold(sets_lock);
+  uint32_t i;
+
+  for (i = 0; i < num_stats; i++) {
+    retired[i].merge(h[i]);
+  }
+  for (i = 0; i < sets.size(); i++) {
+    if (sets[i] == this) {
+      sets.erase(sets.begin() + i);
+      break;
+    }
+  }
+}
+
+/*
+ * Records one timing, in nanoseconds, for the calling thread
+ */
+void stats_record(stat_id id, uint64_t ns)
+{
+  std::lock_guard<std::mutex> hold(local_stats.lock);
+
+  local_stats.h[id].record(ns);
+} // stats_record
+
+/*
+ * Merges every thread's histograms, and those of threads gone, into out
+ */
+void stats_collect(histogram out[num_stats])
+{
+  std::lock_guard<std::mutex> hold(sets_lock);
+  uint32_t i, j;
+
+  for (i = 0; i < num_stats; i++) {
+    out[i] = retired[i];
+  }
+  for (j = 0; j < sets.size(); j++) {
+    std::lock_guard<std::mutex> hold_set(sets[j]->lock);
+
+    for (i = 0; i < num_stats; i++) {
+      out[i].merge(sets[j]->h[i]);
+    }
+  }
+} // stats_collect
+
+/*
+ * Writes every histogram as JSON, times in nanoseconds
+ */
+void stats_dump(FILE *f)
+{
+  static histogram stats[num_stats];
+  uint32_t i;
+
+  stats_collect(stats);
+
+  std::fprintf(f, "{\n");
+  for (i = 0; i < num_stats; i++) {
+    std::fprintf(f, "  \"%s\": { \"count\": %llu, \"total_ns\": %llu, "
+                 "\"min_ns\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, "
+                 "\"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+                 "\"max_ns\": %llu }%s\n",
+                 stat_name[i],
+                 (unsigned long long) stats[i].count,
+                 (unsigned long long) stats[i].total,
+                 (unsigned long long) (stats[i].count ? stats[i].min : 0),
+                 (unsigned long long) stats[i].mean(),
+                 (unsigned long long) stats[i].percentile(50),
+                 (unsigned long long) stats[i].percentile(90),
+                 (unsigned long long) stats[i].percentile(99),
+                 (unsigned long long) stats[i].percentile(99.9),
+                 (unsigned long long) stats[i].max,
+                 i + 1 < num_stats ? "," : "");
+  }
+  std::fprintf(f, "}\n");
+} // stats_dump
@@ -0,0 +1,79 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <cstdio>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* The operations that are timed */
+enum stat_id {
+  stat_init_dungeon,
+  stat_read_dungeon,
+  stat_write_dungeon,
+  stat_display,
+  stat_room_present,
+  stat_key,
+  num_stats
+};
+
+/* Sub-buckets per power of two.  Values are kept to within 1/16. */
+const uint32_t HISTOGRAM_SUB_BITS = 4;
+const uint32_t HISTOGRAM_SUB = 1 << HISTOGRAM_SUB_BITS;
+const uint32_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB;
+
+/*
+ * Log-linear histogram in the style of HdrHistogram.  Values below
+ * HISTOGRAM_SUB get a bucket each; above that every power of two is
+ * split into HISTOGRAM_SUB buckets, so any 64 bit value is recorded
+ * with bounded relative error in fixed space.
+ */
+class histogram {
+ private:
+  uint64_t counts[HISTOGRAM_BUCKETS];
+ public:
+  uint64_t count, total, min, max;
+
+  histogram() : counts{0}, count(0), total(0), min(UINT64_MAX), max(0) {}
+
+  void record(uint64_t v);
+  void merge(const histogram& h);
+  uint64_t percentile(double p);
+  uint64_t mean(void)
+  {
+    return count ? total / count : 0;
+  }
+};
+
+extern std::atomic<bool> stats_enabled;
+extern const char *stat_name[num_stats];
+
+void stats_record(stat_id id, uint64_t ns);
+void stats_collect(histogram out[num_stats]);
+
+/*
+ * Times the enclosing scope into a histogram, in nanoseconds.  When
+ * stats are off this costs a flag test on the way in and out.
+ */
+class stats_timer {
+ private:
+  stat_id id;
+  uint64_t start;
+ public:
+  stats_timer(stat_id i)
+    : id(i), start(stats_enabled.load(std::memory_order_relaxed) ?
+                   now_nsec() : 0) {}
+  ~stats_timer()
+  {
+    if (start) {
+      stats_record(id, now_nsec() - start);
+    }
+  }
+};
+
+#define STATS(id) stats_timer stats_timer_ ## id(id)
+
+void stats_dump(FILE *f);
+
+#endif
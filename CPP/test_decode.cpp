@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "dungeon.h"
+
+/*
+ * Checks that decode_dungeon turns away saves whose body breaks what
+ * the rest of dgen relies on, and leaves the dungeon alone when it
+ * does.  Each bad save is a good one with one thing broken.
+ */
+
+const uint32_t TEST_SEED = 327;
+/* Where the map starts in a save, after the header and the PC */
+const uint32_t MAP_OFFSET = 22;
+
+static uint32_t failures;
+
+/*
+ * Decodes buf into a fresh dungeon and checks it fails or succeeds as
+ * expected.  A failed decode must leave the dungeon as it was.
+ */
+static void expect_decode(const char *name, const std::vector<uint8_t>& buf,
+                          bool ok)
+{
+  dungeon d;
+  const char *err;
+  int ret;
+
+  err = nullptr;
+  ret = decode_dungeon(&d, &buf[0], buf.size(), &err);
+  if (ok && ret) {
+    std::printf("FAIL %s: rejected, %s\n", name, err);
+    failures++;
+  } else if (!ok && !ret) {
+    std::printf("FAIL %s: accepted\n", name);
+    failures++;
+  } else if (!ok && (d.rooms.size() || d.get_pcx() || d.get_pcy())) {
+    std::printf("FAIL %s: dungeon changed by a failed decode\n", name);
+    failures++;
+  } else {
+    std::printf("ok   %s%s%s\n", name, ok ? "" : ": ", ok ? "" : err);
+  }
+  del_dungeon(&d);
+}
+
+/*
+ * Sets a cell of the stored hardness map
+ */
+static void set_hardness(std::vector<uint8_t>& buf, uint32_t x, uint32_t y,
+                         uint8_t h)
+{
+  buf[MAP_OFFSET + y * DUNGEON_X + x] = h;
+}
+
+int main(void)
+{
+  dungeon d;
+  std::vector<uint8_t> good, bad;
+  uint8_t stairs[4];
+  uint32_t x, y, rock_x, rock_y;
+
+  std::srand(TEST_SEED);
+  gen_dungeon(&d);
+  if (!find_stairs(&d, stairs)) {
+    std::printf("FAIL generated dungeon has no stairs\n");
+    return EXIT_FAILURE;
+  }
+  encode_dungeon(&d, good);
+  expect_decode("good save", good, true);
+
+  /* A PC far off the map */
+  bad = good;
+  bad[20] = 200;
+  bad[21] = 200;
+  expect_decode("PC off the map", bad, false);
+
+  /* A PC inside the map but in rock */
+  for (rock_x = rock_y = 0, y = 1; !rock_x && y < DUNGEON_Y - 1; y++) {
+    for (x = 1; !rock_x && x < DUNGEON_X - 1; x++) {
+      if (d.d_map[y][x] == ter_wall) {
+        rock_x = x;
+        rock_y = y;
+      }
+    }
+  }
+  bad = good;
+  bad[20] = rock_x;
+  bad[21] = rock_y;
+  expect_decode("PC in rock", bad, false);
+
+  /* A border of open floor */
+  bad = good;
+  for (x = 0; x < DUNGEON_X; x++) {
+    set_hardness(bad, x, 0, 0);
+    set_hardness(bad, x, DUNGEON_Y - 1, 0);
+  }
+  for (y = 0; y < DUNGEON_Y; y++) {
+    set_hardness(bad, 0, y, 0);
+    set_hardness(bad, DUNGEON_X - 1, y, 0);
+  }
+  expect_decode("open border", bad, false);
+
+  /* One border cell of ordinary rock */
+  bad = good;
+  set_hardness(bad, DUNGEON_X - 1, DUNGEON_Y / 2, 1);
+  expect_decode("soft border cell", bad, false);
+
+  /* Down stairs in the same rock; they are the last two bytes */
+  bad = good;
+  bad[bad.size() - 2] = rock_x;
+  bad[bad.size() - 1] = rock_y;
+  expect_decode("stairs in rock", bad, false);
+
+  /* Two stray bytes after the stairs, with the size to match.  They *
+   * repeat the up stairs, so stairs read from the end are on floor  */
+  bad = good;
+  bad.push_back(stairs[0]);
+  bad.push_back(stairs[1]);
+  bad[16] = bad.size() >> 24;
+  bad[17] = bad.size() >> 16;
+  bad[18] = bad.size() >> 8;
+  bad[19] = bad.size();
+  expect_decode("trailing bytes", bad, false);
+
+  del_dungeon(&d);
+  if (failures) {
+    std::printf("%u failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -2,8 +2,28 @@
 #define UTILS_H
 
 #include <cstdlib>
+#include <stdint.h>
+#include <time.h>
 
 /* Returns random integer in [min, max]. */
 # define rand_range(min, max) ((std::rand() % (((max) + 1) - (min))) + (min))
 
+/* Returns microseconds on the monotonic clock. */
+static inline uint64_t now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns nanoseconds on the monotonic clock. */
+static inline uint64_t now_nsec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 #endif
@@ -0,0 +1,384 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dungeon.h"
+#include "world.h"
+
+static const char WORLD_MAGIC[] = "DGNW";
+static const uint32_t WORLD_VERSION = 1;
+static const uint64_t WORLD_PAGE = 4096;
+/* A tile on disc: its terrain, then its hardness */
+static const uint64_t WORLD_TILE_BYTES = 2 * WORLD_TILE_CELLS;
+/* Hardness of the rock in tiles never written */
+static const uint8_t WORLD_ROCK = MAX_HARDNESS_VALUE - 1;
+
+struct world_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t width, height;
+  uint32_t tile;
+  uint32_t tiles_x, tiles_y;
+  uint32_t unused;
+  uint64_t data_off;
+  uint8_t reserved[24];
+};
+
+static uint64_t data_offset(uint32_t tiles_x, uint32_t tiles_y)
+{
+  return (sizeof (world_header) + (uint64_t) tiles_x * tiles_y * 8 +
+          WORLD_PAGE - 1) & ~(WORLD_PAGE - 1);
+} // data_offset
+
+world::~world()
+{
+  std::list<tile *>::iterator it;
+
+  if (fd >= 0) {
+    flush();
+    close(fd);
+  }
+  for (it = lru.begin(); it != lru.end(); it++) {
+    delete *it;
+  }
+  if (map) {
+    munmap((void *) map, map_len);
+  }
+}
+
+/*
+ * Creates an empty world of w by h cells.  Only the header and tile
+ * index are written, so even a huge world starts small.  Won't replace
+ * an existing file.  Returns 1 and prints why on error.
+ */
+int world::create(const char *file, uint32_t w, uint32_t h)
+{
+  world_header hdr;
+  int fd;
+
+  if (!w || !h || w > MAX_WORLD_SIZE || h > MAX_WORLD_SIZE) {
+    std::fprintf(stderr, "%s: A world is 1 to %u cells on a side.\n", file,
+                 MAX_WORLD_SIZE);
+    return 1;
+  }
+  memset(&hdr, 0, sizeof (hdr));
+  memcpy(hdr.magic, WORLD_MAGIC, 4);
+  hdr.version = WORLD_VERSION;
+  hdr.width = w;
+  hdr.height = h;
+  hdr.tile = WORLD_TILE;
+  hdr.tiles_x = (w + WORLD_TILE - 1) / WORLD_TILE;
+  hdr.tiles_y = (h + WORLD_TILE - 1) / WORLD_TILE;
+  hdr.data_off = data_offset(hdr.tiles_x, hdr.tiles_y);
+
+  if ((fd = ::open(file, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+    std::perror(file);
+    return 1;
+  }
+  if (pwrite(fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+      ftruncate(fd, hdr.data_off) || close(fd)) {
+    std::perror(file);
+    unlink(file);
+    return 1;
+  }
+  return open(file);
+} // create
+
+/*
+ * Maps the first len bytes of the file, replacing any earlier mapping
+ */
+int world::remap(size_t len)
+{
+  void *m;
+
+  m = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    std::perror(path.c_str());
+    return 1;
+  }
+  if (map) {
+    munmap((void *) map, map_len);
+  }
+  map = (const uint8_t *) m;
+  map_len = len;
+  return 0;
+} // remap
+
+/*
+ * Opens a world for reading and writing.  Returns 1 and prints why on
+ * error.
+ */
+int world::open(const char *file)
+{
+  world_header hdr;
+  struct stat st;
+
+  path = file;
+  if ((fd = ::open(file, O_RDWR)) < 0 || fstat(fd, &st)) {
+    std::perror(file);
+    return 1;
+  }
+  if (st.st_size < (off_t) sizeof (hdr) ||
+      pread(fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+      memcmp(hdr.magic, WORLD_MAGIC, 4) || hdr.version != WORLD_VERSION ||
+      hdr.tile != WORLD_TILE || !hdr.width || !hdr.height ||
+      hdr.width > MAX_WORLD_SIZE || hdr.height > MAX_WORLD_SIZE ||
+      hdr.tiles_x != (hdr.width + WORLD_TILE - 1) / WORLD_TILE ||
+      hdr.tiles_y != (hdr.height + WORLD_TILE - 1) / WORLD_TILE ||
+      hdr.data_off != data_offset(hdr.tiles_x, hdr.tiles_y) ||
+      (uint64_t) st.st_size < hdr.data_off) {
+    std::fprintf(stderr, "%s: Not a world file.\n", file);
+    close(fd);
+    fd = -1;
+    return 1;
+  }
+  width = hdr.width;
+  height = hdr.height;
+  tiles_x = hdr.tiles_x;
+  tiles_y = hdr.tiles_y;
+  data_off = hdr.data_off;
+  file_len = st.st_size;
+  return remap(file_len);
+} // open
+
+/*
+ * Writes a tile back, appending it to the file the first time.  A new
+ * tile is synced before the index entry that points at it is written,
+ * so a crash can't leave the index pointing at garbage.
+ */
+int world::write_tile(tile *t)
+{
+  uint64_t off;
+  bool fresh;
+
+  off = tile_index()[t->id];
+  fresh = !off;
+  if (fresh) {
+    off = file_len;
+  }
+  if (pwrite(fd, t->ter, WORLD_TILE_CELLS, off) != WORLD_TILE_CELLS ||
+      pwrite(fd, t->hard, WORLD_TILE_CELLS, off + WORLD_TILE_CELLS) !=
+      WORLD_TILE_CELLS) {
+    std::perror(path.c_str());
+    return 1;
+  }
+  if (fresh) {
+    file_len += WORLD_TILE_BYTES;
+    if (fdatasync(fd)) {
+      std::perror(path.c_str());
+      return 1;
+    }
+    if (pwrite(fd, &off, 8, sizeof (world_header) + (uint64_t) t->id * 8) !=
+        8) {
+      std::perror(path.c_str());
+      return 1;
+    }
+  }
+  t->dirty = false;
+  tiles_written++;
+  return 0;
+} // write_tile
+
+/*
+ * The cached copy of a tile, reading it in if need be and making room
+ * by writing back the least recently used.  Null on error.
+ */
+world::tile *world::get_tile(uint32_t id)
+{
+  std::unordered_map<uint32_t, std::list<tile *>::iterator>::iterator it;
+  tile *t;
+  uint64_t off;
+  uint32_t i;
+
+  if (last && last->id == id) {
+    return last;
+  }
+  if ((it = cached.find(id)) != cached.end()) {
+    lru.splice(lru.begin(), lru, it->second);
+    return last = *it->second;
+  }
+
+  if (lru.size() >= capacity) {
+    t = lru.back();
+    if (t->dirty && write_tile(t)) {
+      return nullptr;
+    }
+    cached.erase(t->id);
+    lru.pop_back();
+  } else {
+    t = new tile;
+  }
+
+  t->id = id;
+  t->dirty = false;
+  off = tile_index()[id];
+  if (!off) {
+    memset(t->ter, ter_wall, sizeof (t->ter));
+    memset(t->hard, WORLD_ROCK, sizeof (t->hard));
+  } else {
+    if (off < data_off || off + WORLD_TILE_BYTES > file_len ||
+        (off + WORLD_TILE_BYTES > map_len && remap(file_len))) {
+      std::fprintf(stderr, "%s: Bad tile offset.\n", path.c_str());
+      delete t;
+      return last = nullptr;
+    }
+    memcpy(t->ter, map + off, WORLD_TILE_CELLS);
+    memcpy(t->hard, map + off + WORLD_TILE_CELLS, WORLD_TILE_CELLS);
+    for (i = 0; i < WORLD_TILE_CELLS; i++) {
+      if (t->ter[i] > ter_stairs_down) {
+        t->ter[i] = ter_wall;
+      }
+    }
+    tiles_read++;
+  }
+  lru.push_front(t);
+  cached[id] = lru.begin();
+  return last = t;
+} // get_tile
+
+/*
+ * Writes back every changed tile and syncs the file.  Returns 1 on
+ * error.
+ */
+int world::flush(void)
+{
+  std::list<tile *>::iterator it;
+  bool wrote;
+
+  for (it = lru.begin(), wrote = false; it != lru.end(); it++) {
+    if ((*it)->dirty) {
+      if (write_tile(*it)) {
+        return 1;
+      }
+      wrote = true;
+    }
+  }
+  if (wrote && fdatasync(fd)) {
+    std::perror(path.c_str());
+    return 1;
+  }
+  return 0;
+} // flush
+
+/*
+ * Reads cell x, y.  Returns 1 if it's outside the world or its tile
+ * can't be read.
+ */
+int world::get(uint32_t x, uint32_t y, terrain_type *t, uint8_t *h)
+{
+  tile *tl;
+  uint32_t i;
+
+  if (x >= width || y >= height ||
+      !(tl = get_tile(y / WORLD_TILE * tiles_x + x / WORLD_TILE))) {
+    return 1;
+  }
+  i = y % WORLD_TILE * WORLD_TILE + x % WORLD_TILE;
+  *t = tl->ter[i];
+  *h = tl->hard[i];
+  return 0;
+} // get
+
+/*
+ * Changes cell x, y.  Returns 1 if it's outside the world or its tile
+ * can't be read.
+ */
+int world::set(uint32_t x, uint32_t y, terrain_type t, uint8_t h)
+{
+  tile *tl;
+  uint32_t i;
+
+  if (x >= width || y >= height ||
+      !(tl = get_tile(y / WORLD_TILE * tiles_x + x / WORLD_TILE))) {
+    return 1;
+  }
+  i = y % WORLD_TILE * WORLD_TILE + x % WORLD_TILE;
+  if (tl->ter[i] != t || tl->hard[i] != h) {
+    tl->ter[i] = t;
+    tl->hard[i] = h;
+    tl->dirty = true;
+  }
+  return 0;
+} // set
+
+/*
+ * Checks that a dungeon's worth of cells at x, y fit in the world
+ */
+static int check_window(world *w, uint32_t x, uint32_t y)
+{
+  if (x > w->get_width() || w->get_width() - x < DUNGEON_X - 2 ||
+      y > w->get_height() || w->get_height() - y < DUNGEON_Y - 2) {
+    std::fprintf(stderr, "A %ux%u window at %u, %u doesn't fit in a %ux%u "
+                 "world.\n", DUNGEON_X - 2, DUNGEON_Y - 2, x, y,
+                 w->get_width(), w->get_height());
+    return 1;
+  }
+  return 0;
+} // check_window
+
+/*
+ * Loads the part of the world at x, y into the dungeon: its cells
+ * become the dungeon's interior, inside the usual immutable border.
+ * Rooms are found again from the room floor; the world keeps no PC.
+ * Returns 1 on error.
+ */
+int load_window(world *w, dungeon *d, uint32_t x, uint32_t y)
+{
+  terrain_type t;
+  uint32_t i, j;
+  uint8_t h;
+
+  if (check_window(w, x, y)) {
+    return 1;
+  }
+  del_dungeon(d);
+  init_dungeon(d);
+  for (j = 1; j < DUNGEON_Y - 1; j++) {
+    for (i = 1; i < DUNGEON_X - 1; i++) {
+      if (w->get(x + i - 1, y + j - 1, &t, &h)) {
+        return 1;
+      }
+      dmapxy(i, j) = t;
+      hmapxy(i, j) = h;
+    }
+  }
+  find_rooms(d);
+  (*d).mark_all_dirty();
+  return 0;
+} // load_window
+
+/*
+ * Writes the dungeon's interior back to the world at x, y.  Only tiles
+ * whose cells changed are marked for writing.  Returns 1 on error.
+ */
+int store_window(world *w, dungeon *d, uint32_t x, uint32_t y)
+{
+  uint32_t i, j;
+
+  if (check_window(w, x, y)) {
+    return 1;
+  }
+  for (j = 1; j < DUNGEON_Y - 1; j++) {
+    for (i = 1; i < DUNGEON_X - 1; i++) {
+      if (w->set(x + i - 1, y + j - 1, dmapxy(i, j), hmapxy(i, j))) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+} // store_window
+
+/*
+ * The journal for editing the window of file at x, y: file.x.y.journal,
+ * so it is kept apart from the save file's journal and from other
+ * windows of the same world
+ */
+std::string window_journal_path(const char *file, uint32_t x, uint32_t y)
+{
+  return std::string(file) + "." + std::to_string(x) + "." +
+         std::to_string(y) + ".journal";
+} // window_journal_path
@@ -0,0 +1,93 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <list>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#include "dungeon.h"
+
+/* Cells on a side of a tile */
+const uint32_t WORLD_TILE = 64;
+const uint32_t WORLD_TILE_CELLS = WORLD_TILE * WORLD_TILE;
+/* Tiles kept in memory; 8KB each */
+const uint32_t DEFAULT_WORLD_CACHE = 1024;
+/* Largest world on a side */
+const uint32_t MAX_WORLD_SIZE = 1 << 20;
+
+/*
+ * A map far bigger than a dungeon, stored as WORLD_TILE square tiles
+ * so that only the tiles in use are ever read or written.
+ *
+ * The file starts with a header ("DGNW", version, width, height, tile
+ * size, tiles across and down, then the data offset) and an index of
+ * one offset per tile, in rows.  A tile is all terrain bytes then all
+ * hardness bytes, at a page aligned offset; tiles that were never
+ * written have offset 0 and read as solid rock.  Fields are in host
+ * order.
+ *
+ * The file is mapped, so reading a tile pages in just that tile.
+ * Tiles in use are copied into an LRU cache, where edits are made;
+ * changed tiles are written back when they're evicted or on flush,
+ * new ones appended to the file.
+ */
+class world {
+ private:
+  struct tile {
+    uint32_t id;
+    bool dirty;
+    terrain_type ter[WORLD_TILE_CELLS];
+    uint8_t hard[WORLD_TILE_CELLS];
+  };
+
+  std::string path;
+  int fd;
+  uint32_t width, height, tiles_x, tiles_y;
+  uint64_t data_off, file_len;
+  const uint8_t *map;
+  size_t map_len;
+  uint32_t capacity;
+  std::list<tile *> lru;  /* Most recently used first */
+  std::unordered_map<uint32_t, std::list<tile *>::iterator> cached;
+  tile *last;
+
+  const uint64_t *tile_index(void)
+  {
+    return (const uint64_t *) (map + 64);
+  }
+  tile *get_tile(uint32_t id);
+  int write_tile(tile *t);
+  int remap(size_t len);
+
+ public:
+  uint64_t tiles_read, tiles_written;
+
+  world() : path(), fd(-1), width(0), height(0), tiles_x(0), tiles_y(0),
+            data_off(0), file_len(0), map(nullptr), map_len(0),
+            capacity(DEFAULT_WORLD_CACHE), lru(), cached(), last(nullptr),
+            tiles_read(0), tiles_written(0) {}
+  ~world();
+
+  int create(const char *file, uint32_t w, uint32_t h);
+  int open(const char *file);
+  int flush(void);
+  uint32_t get_width(void)
+  {
+    return width;
+  }
+  uint32_t get_height(void)
+  {
+    return height;
+  }
+
+  int get(uint32_t x, uint32_t y, terrain_type *t, uint8_t *h);
+  int set(uint32_t x, uint32_t y, terrain_type t, uint8_t h);
+};
+
+int load_window(world *w, dungeon *d, uint32_t x, uint32_t y);
+int store_window(world *w, dungeon *d, uint32_t x, uint32_t y);
+std::string window_journal_path(const char *file, uint32_t x, uint32_t y);
+
+#endif